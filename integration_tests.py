@@ -7,10 +7,14 @@ import re
 ROOT_DIR = os.path.abspath(".")
 LANGUAGE_DIR = os.path.join(ROOT_DIR, "language")
 VM_TEST_DIR = os.path.join(ROOT_DIR, "vm/test")
-PARSER_EXE = os.path.join(LANGUAGE_DIR, "parser")
+PARSER_EXE = os.path.join(LANGUAGE_DIR, "a3c")
 VM_RUNNER_EXE = os.path.join(VM_TEST_DIR, "vm_runner")
+AOT_RUNNER_EXE = os.path.join(VM_TEST_DIR, "aot_runner")
+UPLOAD_EXE = os.path.join(VM_TEST_DIR, "a3_upload")
 TEST_SRC = os.path.join(LANGUAGE_DIR, "test.a3")
 VM_CODE = os.path.join(LANGUAGE_DIR, "program.vmcode")
+A3B_CODE = os.path.join(LANGUAGE_DIR, "program.a3b")
+AOT_CPP = os.path.join(LANGUAGE_DIR, "program.cpp")
 
 def run_command(cmd, cwd=None):
     try:
@@ -50,7 +54,7 @@ def run_test(name, source_code, expected_regs):
     
     # Compile
     try:
-        run_command([PARSER_EXE], cwd=LANGUAGE_DIR)
+        run_command([PARSER_EXE, "--cpp", AOT_CPP, TEST_SRC], cwd=LANGUAGE_DIR)
     except Exception:
         print(f"FAIL: Compilation failed for {name}")
         return False
@@ -62,6 +66,56 @@ def run_test(name, source_code, expected_regs):
         print(f"FAIL: VM execution failed for {name}")
         return False
 
+    # The host JIT must reproduce the interpreter's registers exactly
+    try:
+        jit_output = run_command([VM_RUNNER_EXE, "--jit", VM_CODE], cwd=VM_TEST_DIR)
+    except Exception:
+        print(f"FAIL: JIT execution failed for {name}")
+        return False
+    if parse_registers(jit_output) != parse_registers(output):
+        print(f"FAIL: {name} - JIT registers differ from the interpreter")
+        print(f"Interpreter: {parse_registers(output)}")
+        print(f"JIT: {parse_registers(jit_output)}")
+        return False
+
+    # The .a3b container a3c writes alongside must load to the same program
+    try:
+        a3b_output = run_command([VM_RUNNER_EXE, A3B_CODE], cwd=VM_TEST_DIR)
+    except Exception:
+        print(f"FAIL: .a3b execution failed for {name}")
+        return False
+    if parse_registers(a3b_output) != parse_registers(output):
+        print(f"FAIL: {name} - .a3b registers differ from the listing")
+        print(f"Listing: {parse_registers(output)}")
+        print(f".a3b: {parse_registers(a3b_output)}")
+        return False
+
+    # Likewise when a3c packs the container's code
+    try:
+        run_command([PARSER_EXE, "--compress", TEST_SRC], cwd=LANGUAGE_DIR)
+        packed_output = run_command([VM_RUNNER_EXE, A3B_CODE], cwd=VM_TEST_DIR)
+    except Exception:
+        print(f"FAIL: compressed .a3b execution failed for {name}")
+        return False
+    if parse_registers(packed_output) != parse_registers(output):
+        print(f"FAIL: {name} - compressed .a3b registers differ from the listing")
+        print(f"Listing: {parse_registers(output)}")
+        print(f"Compressed .a3b: {parse_registers(packed_output)}")
+        return False
+
+    # So must the ahead-of-time C++ translation of the same program
+    try:
+        run_command(["make", "-B", "aot_runner", f"AOT_PROGRAM={AOT_CPP}"], cwd=VM_TEST_DIR)
+        aot_output = run_command([AOT_RUNNER_EXE], cwd=VM_TEST_DIR)
+    except Exception:
+        print(f"FAIL: AOT build or execution failed for {name}")
+        return False
+    if parse_registers(aot_output) != parse_registers(output):
+        print(f"FAIL: {name} - AOT registers differ from the interpreter")
+        print(f"Interpreter: {parse_registers(output)}")
+        print(f"AOT: {parse_registers(aot_output)}")
+        return False
+
     # Check output
     actual_regs = parse_registers(output)
     
@@ -81,6 +135,163 @@ def run_test(name, source_code, expected_regs):
         print(f"Actual Regs: {actual_regs}")
         return False
 
+# Every idiom fuseProgram() looks for, as the current translator emits it
+FUSION_SOURCE = """
+start
+  int a = 0;
+  int b = 3;
+  int c = 0;
+  for (int i = 0; i < 10; i = i + 1) start
+    a = a + b;
+    if (a == 9) start
+      b = b * 2;
+    end
+    if (a >= 1000) start
+      c = c + 1;
+    end
+    a = a - 1;
+  end
+end
+"""
+
+FUSION_FAMILIES = {
+    "LOADI+Bcc": r"LOADI\+B(?:EQ|NE|LT|GE)",
+    "LOADK+Bcc": r"LOADK\+B(?:EQ|NE|LT|GE)",
+    "ALU3+LOAD": r"(?:ADD|SUB|MUL)3\+LOAD",
+    "LOADI+LOAD": r"LOADI\+LOAD",
+}
+
+def run_fusion_test():
+    name = "Superinstructions"
+    print(f"Running test: {name}")
+    with open(TEST_SRC, "w") as f:
+        f.write(FUSION_SOURCE)
+    try:
+        run_command([PARSER_EXE, TEST_SRC], cwd=LANGUAGE_DIR)
+        output = run_command([VM_RUNNER_EXE, "--fusion-stats", VM_CODE], cwd=VM_TEST_DIR)
+    except Exception:
+        print(f"FAIL: {name} - compilation or execution failed")
+        return False
+    sites = {}
+    for family, pattern in FUSION_FAMILIES.items():
+        sites[family] = sum(int(n) for n in re.findall(r"^" + pattern + r": (\d+) sites", output, re.M))
+    missing = [family for family, n in sites.items() if n == 0]
+    if missing:
+        print(f"FAIL: {name} - no fused sites for {', '.join(missing)}")
+        print(output)
+        return False
+    regs = parse_registers(output)
+    if regs.get("R1") != 38 or regs.get("R2") != 6 or regs.get("R3") != 0:
+        print(f"FAIL: {name} - registers {regs}")
+        return False
+    print(f"PASS: {name} ({sites})")
+    return True
+
+HOT_SWAP_SOURCE = """
+void proc globals() start
+  int count = 0;
+end
+
+void proc loop() start
+  count = count + STEP;
+end
+
+start
+end
+"""
+
+def compile_a3b(source, out_path):
+    with open(TEST_SRC, "w") as f:
+        f.write(source)
+    run_command([PARSER_EXE, TEST_SRC], cwd=LANGUAGE_DIR)
+    os.replace(A3B_CODE, out_path)
+
+def run_hot_swap_test():
+    name = "Hot Swap"
+    print(f"Running test: {name}")
+    first = os.path.join(LANGUAGE_DIR, "swap_first.a3b")
+    second = os.path.join(LANGUAGE_DIR, "swap_second.a3b")
+    try:
+        compile_a3b(HOT_SWAP_SOURCE.replace("STEP", "1"), first)
+        compile_a3b(HOT_SWAP_SOURCE.replace("STEP", "10"), second)
+        # Two iterations of the first program, then three of the second:
+        # kept registers carry count over, a fresh swap reruns globals()
+        kept = run_command([VM_RUNNER_EXE, "--loops", "5", "--swap", second,
+                            "--swap-after", "2", "--keep-registers", first], cwd=VM_TEST_DIR)
+        fresh = run_command([VM_RUNNER_EXE, "--loops", "5", "--swap", second,
+                             "--swap-after", "2", first], cwd=VM_TEST_DIR)
+    except Exception:
+        print(f"FAIL: {name} - compilation or execution failed")
+        return False
+    finally:
+        for path in (first, second):
+            if os.path.exists(path):
+                os.remove(path)
+    if parse_registers(kept).get("R1") != 32 or parse_registers(fresh).get("R1") != 30:
+        print(f"FAIL: {name} - kept {parse_registers(kept)}, fresh {parse_registers(fresh)}")
+        return False
+    print(f"PASS: {name}")
+    return True
+
+DELTA_SOURCE = """
+EXTRA
+int proc bump(int a) start
+  return a + STEP;
+end
+
+void proc globals() start
+  int count = 0;
+end
+
+void proc loop() start
+  int d = exec bump(count);
+  count = d;
+end
+
+start
+end
+"""
+
+def run_delta_upload_test():
+    name = "Delta Upload"
+    print(f"Running test: {name}")
+    first = os.path.join(LANGUAGE_DIR, "delta_first.a3b")
+    second = os.path.join(LANGUAGE_DIR, "delta_second.a3b")
+    try:
+        compile_a3b(DELTA_SOURCE.replace("STEP", "1").replace("EXTRA", ""), first)
+        # A new function in front moves loop() and bump(); only bump changes
+        compile_a3b(DELTA_SOURCE.replace("STEP", "10").replace(
+            "EXTRA", "int proc unused(int a) start\n  return a;\nend\n"), second)
+        # Two pipes stand in for the UART between the board and a3_upload
+        to_board, from_host = os.pipe()
+        to_host, from_board = os.pipe()
+        board = subprocess.Popen([VM_RUNNER_EXE, "--serial", "--loops", "2", "--keep-registers", first],
+                                 cwd=VM_TEST_DIR, stdin=to_board, stdout=from_board,
+                                 stderr=subprocess.PIPE, text=True)
+        host = subprocess.Popen([UPLOAD_EXE, second, "-"], cwd=VM_TEST_DIR, stdin=to_host,
+                                stdout=from_host, stderr=subprocess.PIPE, text=True)
+        for fd in (to_board, from_host, to_host, from_board):
+            os.close(fd)
+        host_log = host.communicate(timeout=30)[1]
+        board_log = board.communicate(timeout=30)[1]
+    except Exception:
+        print(f"FAIL: {name} - compilation or upload failed")
+        return False
+    finally:
+        for path in (first, second):
+            if os.path.exists(path):
+                os.remove(path)
+    # Two iterations count to 2, then the update adds 10; loop() is copied
+    # from the running program with its CALL relocated
+    if host.returncode != 0 or board.returncode != 0 or "1 copied" not in host_log or \
+            parse_registers(board_log).get("R1") != 12:
+        print(f"FAIL: {name}")
+        print(f"a3_upload: {host_log.strip()}")
+        print(f"vm_runner: {board_log.strip()}")
+        return False
+    print(f"PASS: {name}")
+    return True
+
 def main():
     try:
         build_tools()
@@ -107,7 +318,7 @@ start
   a = a + b;
 end
 """,
-            "expected_regs": {"R1": 30} # a = 30
+            "expected_regs": {"R1": 40, "R2": 30} # a = 40, b untouched
         },
         {
             "name": "Loop",
@@ -120,6 +331,167 @@ start
 end
 """,
             "expected_regs": {"R1": 5} # x = 5
+        },
+        {
+            "name": "Three-Operand Arithmetic",
+            "source": """
+start
+  int a = 6;
+  int b = 4;
+  int c = (a + b) * (a - b) + a;
+end
+""",
+            "expected_regs": {"R1": 6, "R2": 4, "R3": 26} # operands survive
+        },
+        {
+            "name": "Compare-and-Branch",
+            "source": """
+start
+  int a = 0;
+  int b = 0;
+  int c = 0;
+  int i = 10;
+  while (i > 0) start
+    i = i - 3;
+    a = a + 1;
+  end
+  if (a == 4 and not(i > 0)) start
+    b = 1;
+  end else start
+    b = 2;
+  end
+  if (a < 2 or i >= 0) start
+    c = 5;
+  end
+end
+""",
+            "expected_regs": {"R1": 4, "R2": 1, "R3": 0, "R4": -2}
+        },
+        {
+            "name": "Logical Values",
+            "source": """
+start
+  bool x = true;
+  bool y = not x;
+  int a = 0;
+  if (not x) start
+    a = 1;
+  end
+  int b = 0;
+  if (y) start
+    b = 1;
+  end
+  bool c = x and (a == 0);
+end
+""",
+            "expected_regs": {"R1": 1, "R2": 0, "R3": 0, "R4": 0, "R5": 1} # not/and give 0 or 1
+        },
+        {
+            "name": "Function Calls",
+            "source": """
+int proc add(int a, int b) start
+    return a + b;
+end
+
+int proc fact(int n) start
+    int r = 1;
+    while (n > 1) start
+        r = r * n;
+        n = n - 1;
+    end
+    return r;
+end
+
+start
+  int x = exec add(3, 4);
+  int y = exec fact(5);
+  int s = x + y;
+end
+""",
+            "expected_regs": {"R1": 7, "R2": 120, "R3": 127}
+        },
+        {
+            "name": "Global Updated By Callee",
+            "source": """
+void proc globals() start
+  int count = 0;
+end
+
+int proc add(int n) start
+  count = count + n;
+  return count;
+end
+
+start
+  int a = exec add(5);
+  int b = exec add(2);
+  int c = count;
+end
+""",
+            "expected_regs": {"R1": 7, "R2": 5, "R3": 7, "R4": 7} # globals are not saved around calls
+        },
+        {
+            "name": "Word Arrays",
+            "source": """
+start
+  int a[4];
+  a = [100000, 0 - 5, 300];
+  int i = 1;
+  int x = a[0];
+  int y = a[i] + a[2];
+  int z = a[3];
+end
+""",
+            "expected_regs": {"R1": 0, "R2": 1, "R3": 100000, "R4": 295, "R5": 0}
+        },
+        {
+            "name": "Array Frames",
+            "source": """
+int proc sum3(int a) start
+  int t[3];
+  t = [a, a + 1, a + 2];
+  return t[0] + t[1] + t[2];
+end
+
+start
+  int m[2];
+  m = [7, 9];
+  int s = exec sum3(10);
+  int k = m[0] + m[1];
+end
+""",
+            "expected_regs": {"R1": 0, "R2": 33, "R3": 16}
+        },
+        {
+            "name": "Frame Locals",
+            "source": """
+int proc fib(int n) start
+  if (n < 2) start
+    return n;
+  end
+  int a = exec fib(n - 1);
+  int b = exec fib(n - 2);
+  return a + b;
+end
+
+int proc many(int x) start
+  int a = x + 1;
+  int b = a + 1;
+  int c = b + 1;
+  int d = c + 1;
+  int e = d + 1;
+  int f = e + 1;
+  int g = f + 1;
+  int h = g + 1;
+  return a + b + c + d + e + f + g + h;
+end
+
+start
+  int r = exec fib(10);
+  int m = exec many(1);
+end
+""",
+            "expected_regs": {"R1": 55, "R2": 44}
         }
     ]
     
@@ -127,8 +499,16 @@ end
     for test in tests:
         if run_test(test["name"], test["source"], test["expected_regs"]):
             passed += 1
+    total = len(tests) + 3
+    if run_fusion_test():
+        passed += 1
+    if run_hot_swap_test():
+        passed += 1
+    if run_delta_upload_test():
+        passed += 1
     
-    print(f"\nSummary: {passed}/{len(tests)} tests passed.")
+    print(f"\nSummary: {passed}/{total} tests passed.")
+    sys.exit(0 if passed == total else 1)
 
 if __name__ == "__main__":
     main()
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "ast.h"
 #include "parser.h"
 #include "semantic.h"
@@ -8,12 +9,22 @@ extern FILE *yyin;
 extern int yylineno;
 
 int main (int argc, char **argv) {
-    
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s <input_file>\n", argv[0]);
+    const char *input_path = NULL;
+    TranslatorOptions options = { NULL, false };
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--cpp") == 0 && i + 1 < argc) {
+            options.cpp_path = argv[++i];
+        } else if (strcmp(argv[i], "--compress") == 0) {
+            options.compress = true;
+        } else {
+            input_path = argv[i];
+        }
+    }
+    if (!input_path) {
+        fprintf(stderr, "Usage: %s [--cpp <output.cpp>] [--compress] <input_file>\n", argv[0]);
         return 1;
     }
-    yyin = fopen(argv[1], "r");
+    yyin = fopen(input_path, "r");
     if (!yyin) {
         perror("Failed to open input file");
         return 1;
@@ -21,7 +32,7 @@ int main (int argc, char **argv) {
     Node* ast = parse_program();
     // ast_print(ast, 0);
     analyze_program(ast);
-    if (!translate_program(ast, "program.vmcode")) {
+    if (!translate_program_with_options(ast, "program.vmcode", &options)) {
         fprintf(stderr, "Code generation failed. See diagnostics above.\n");
         fclose(yyin);
         return 1;
@@ -4,11 +4,17 @@
 #include <string.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include "../vm/a3b.h"
 
 #define VM_NUM_REGISTERS 8
 #define MAX_ARRAY_BINDINGS 32
 #define MAX_LABELS 128
 #define MAX_GLOBAL_VARS (VM_NUM_REGISTERS - 1)
+#define MAX_BRANCH_SITES 32
+#define MAX_VAR_BINDINGS 64
+/* Registers kept free for temporaries once a function's locals spill */
+#define FRAME_TEMP_REGS 2
+#define VM_HEAP_WORDS 512     /* VM_HEAP_SIZE / 4: 32-bit array elements */
 
 /* Opcodes subset needed for the current translator */
 typedef enum {
@@ -29,6 +35,9 @@ typedef enum {
     OP_PUSH     = 0x15,
     OP_POP      = 0x16,
     OP_LOADM    = 0x18,
+    /* Indexed word access: heap word R[arg2 >> 4] + R[arg2 & 0x0F] */
+    OP_LOADX    = 0x19,
+    OP_STOREX   = 0x1A,
     OP_JMP      = 0x20,
     OP_JZ       = 0x21,
     OP_JNZ      = 0x22,
@@ -40,7 +49,31 @@ typedef enum {
     OP_RET      = 0x28,
     OP_HALT     = 0x29,
     PRINT       = 0x30,
-    TRAP        = 0x31
+    TRAP        = 0x31,
+    /* Heap arena: R[arg1] = base word of a new arg2-word block / release it */
+    OP_ALLOC    = 0x32,
+    OP_FREE     = 0x33,
+    /* Stack frames: ENTER pushes FP and reserves arg2 slots, LEAVE drops
+     * them, LDL/STL move R[arg1] from/to slot arg2 of the frame */
+    OP_ENTER    = 0x34,
+    OP_LEAVE    = 0x35,
+    OP_LDL      = 0x36,
+    OP_STL      = 0x37,
+    /* R[arg1] = constant arg2 of the program's constant pool */
+    OP_LOADK    = 0x38,
+    /* Three-operand ALU: R[arg1] = R[arg2 >> 4] op R[arg2 & 0x0F] */
+    OP_ADD3     = 0x41,
+    OP_SUB3     = 0x42,
+    OP_MUL3     = 0x43,
+    OP_DIV3     = 0x44,
+    OP_AND3     = 0x46,
+    OP_OR3      = 0x47,
+    OP_NOT3     = 0x49,
+    /* Compare-and-branch, wide form: op rA rB <target lo> <target hi> */
+    OP_BEQ      = 0x2A,
+    OP_BNE      = 0x2B,
+    OP_BLT      = 0x2C,
+    OP_BGE      = 0x2D
 } Opcode;
 
 /* Builtin trap IDs matching VM implementation */
@@ -68,12 +101,12 @@ typedef struct {
     uint8_t *data;
     size_t size;
     size_t capacity;
+    size_t last_offset;    /* start of the most recently emitted instruction */
 } BytecodeBuffer;
 
 typedef struct {
     char *name;
     size_t start_offset;   /* byte offset in buffer */
-    size_t start_index;    /* instruction index */
     uint8_t param_regs[VM_NUM_REGISTERS];
     size_t param_count;
 } FunctionInfo;
@@ -81,6 +114,8 @@ typedef struct {
 typedef struct {
     char *name;
     uint8_t reg;
+    bool in_frame;      /* lives in frame slot `slot` instead of `reg` */
+    uint8_t slot;
 } VarBinding;
 
 typedef struct {
@@ -108,6 +143,8 @@ static const char *opcode_name(Opcode op) {
         case OP_PUSH:    return "PUSH";
         case OP_POP:     return "POP";
         case OP_LOADM:   return "LOADM";
+        case OP_LOADX:   return "LOADX";
+        case OP_STOREX:  return "STOREX";
         case OP_JMP:     return "JMP";
         case OP_JZ:      return "JZ";
         case OP_JNZ:     return "JNZ";
@@ -120,25 +157,52 @@ static const char *opcode_name(Opcode op) {
         case OP_HALT:    return "HALT";
         case PRINT:      return "PRINT";
         case TRAP:       return "TRAP";
+        case OP_ALLOC:   return "ALLOC";
+        case OP_FREE:    return "FREE";
+        case OP_ENTER:   return "ENTER";
+        case OP_LEAVE:   return "LEAVE";
+        case OP_LDL:     return "LDL";
+        case OP_STL:     return "STL";
+        case OP_LOADK:   return "LOADK";
+        case OP_ADD3:    return "ADD3";
+        case OP_SUB3:    return "SUB3";
+        case OP_MUL3:    return "MUL3";
+        case OP_DIV3:    return "DIV3";
+        case OP_AND3:    return "AND3";
+        case OP_OR3:     return "OR3";
+        case OP_NOT3:    return "NOT3";
+        case OP_BEQ:     return "BEQ";
+        case OP_BNE:     return "BNE";
+        case OP_BLT:     return "BLT";
+        case OP_BGE:     return "BGE";
         default:         return "UNKNOWN";
     }
 }
 
 typedef struct {
     char *name;
-    uint16_t base_addr;
+    uint16_t base_addr;     /* word offset in the function's arena block */
     size_t length;
 } ArrayBinding;
 
 typedef struct {
     BytecodeBuffer code;
-    VarBinding vars[VM_NUM_REGISTERS];
+    VarBinding vars[MAX_VAR_BINDINGS];
     size_t var_count;
     uint8_t next_var_reg;
     uint8_t used_regs_mask;
     ArrayBinding arrays[MAX_ARRAY_BINDINGS];
     size_t array_count;
     uint16_t heap_top;
+    /* Register holding the base word of the current function's arena block
+     * (0 if it declares no arrays) and the ALLOC patched with its size */
+    uint8_t frame_reg;
+    size_t frame_alloc_offset;
+    /* Stack frame of the current function: set when its variables do not
+     * fit in registers, so the rest live in ENTER-reserved slots */
+    bool frame_locals;
+    uint8_t frame_slots;
+    size_t enter_offset;
     FunctionInfo functions[16];
     size_t function_count;
     FunctionInfo *current_function;
@@ -146,7 +210,7 @@ typedef struct {
     bool failed;
     char error[256];
     struct {
-        size_t start_index;
+        size_t start_offset;
         char *text;
     } labels[MAX_LABELS];
     size_t label_count;
@@ -154,6 +218,11 @@ typedef struct {
     size_t global_count;
     uint8_t global_regs_mask;
     bool globals_processed;
+    size_t main_offset;    /* first instruction of the top-level code */
+    /* Constant pool for LOADK, deduplicated; values that fit in LOADI's
+     * 8-bit immediate never get here */
+    int32_t consts[A3B_MAX_CONSTS];
+    size_t const_count;
 } Translator;
 
 typedef struct {
@@ -164,6 +233,7 @@ typedef struct {
 static void buffer_init(BytecodeBuffer *buf) {
     buf->capacity = 64;
     buf->size = 0;
+    buf->last_offset = 0;
     buf->data = (uint8_t *) malloc(buf->capacity);
 }
 
@@ -181,6 +251,25 @@ static size_t emit_instruction(BytecodeBuffer *buf, Opcode op, uint8_t arg1, uin
     buf->data[buf->size++] = op;
     buf->data[buf->size++] = arg1;
     buf->data[buf->size++] = arg2;
+    buf->last_offset = pos;
+    return pos;
+}
+
+/* Wide instructions carry a 16-bit little-endian word after the 3-byte head */
+static bool is_wide_opcode(uint8_t op) {
+    return op == OP_LOADI16 || (op >= OP_BEQ && op <= OP_BGE);
+}
+
+static size_t instruction_length(uint8_t op) {
+    return is_wide_opcode(op) ? 5 : 3;
+}
+
+static size_t emit_wide_instruction(BytecodeBuffer *buf, Opcode op, uint8_t arg1, uint8_t arg2,
+                                    uint16_t word) {
+    size_t pos = emit_instruction(buf, op, arg1, arg2);
+    buffer_reserve(buf, 2);
+    buf->data[buf->size++] = word & 0xFF;
+    buf->data[buf->size++] = (word >> 8) & 0xFF;
     return pos;
 }
 
@@ -199,6 +288,11 @@ static void translator_init(Translator *tr) {
     tr->used_regs_mask = 1;    /* R0 is used */
     tr->array_count = 0;
     tr->heap_top = 0;
+    tr->frame_reg = 0;
+    tr->frame_alloc_offset = 0;
+    tr->frame_locals = false;
+    tr->frame_slots = 0;
+    tr->enter_offset = 0;
     tr->function_count = 0;
     tr->current_function = NULL;
     tr->in_function = false;
@@ -208,6 +302,8 @@ static void translator_init(Translator *tr) {
     tr->global_count = 0;
     tr->global_regs_mask = 0;
     tr->globals_processed = false;
+    tr->main_offset = 0;
+    tr->const_count = 0;
 }
 
 static void translator_destroy(Translator *tr) {
@@ -297,7 +393,7 @@ static ArrayBinding *register_array(Translator *tr, const char *name, size_t len
         translator_fail(tr, "Exceeded maximum number of arrays supported");
         return NULL;
     }
-    if ((uint32_t) tr->heap_top + length > 255) {
+    if ((uint32_t) tr->heap_top + length > VM_HEAP_WORDS) {
         translator_fail(tr, "Array allocations exceed available address space");
         return NULL;
     }
@@ -309,6 +405,21 @@ static ArrayBinding *register_array(Translator *tr, const char *name, size_t len
     return binding;
 }
 
+/* True if the subtree declares an array, including in nested blocks */
+static bool declares_array(const Node *node) {
+    if (!node) return false;
+    if (node->node_type && strcmp(node->node_type, "DECLARACION_ARRAY") == 0) return true;
+    if (declares_array(node->left) || declares_array(node->right) || declares_array(node->extra)) {
+        return true;
+    }
+    if (node->list) {
+        for (int i = 0; i < node->list->size; ++i) {
+            if (declares_array(node->list->items[i])) return true;
+        }
+    }
+    return false;
+}
+
 static FunctionInfo *find_function_info(Translator *tr, const char *name) {
     for (size_t i = 0; i < tr->function_count; ++i) {
         if (strcmp(tr->functions[i].name, name) == 0) {
@@ -382,14 +493,19 @@ static void advance_next_var_reg(Translator *tr) {
 
 static VarBinding *register_var(Translator *tr, const char *name) {
     advance_next_var_reg(tr);
-    if (tr->next_var_reg >= VM_NUM_REGISTERS) {
+    bool spill = tr->frame_locals && tr->next_var_reg >= VM_NUM_REGISTERS - FRAME_TEMP_REGS;
+    if (!spill && tr->next_var_reg >= VM_NUM_REGISTERS) {
         translator_fail(tr, "Register limit reached (max 7 user registers)");
         return NULL;
     }
-    if (tr->var_count >= VM_NUM_REGISTERS - 1) {
+    if (tr->var_count >= (tr->frame_locals ? MAX_VAR_BINDINGS : VM_NUM_REGISTERS - 1)) {
         translator_fail(tr, "Too many variables for current translator backend");
         return NULL;
     }
+    if (spill && tr->frame_slots == 255) {
+        translator_fail(tr, "Too many locals in one frame (max 255)");
+        return NULL;
+    }
     if (tr->global_count > 0) {
         for (size_t i = 0; i < tr->global_count; ++i) {
             if (strcmp(tr->globals[i].binding.name, name) == 0) {
@@ -400,12 +516,94 @@ static VarBinding *register_var(Translator *tr, const char *name) {
     }
     VarBinding *binding = &tr->vars[tr->var_count++];
     binding->name = strdup(name);
+    binding->in_frame = spill;
+    binding->slot = 0;
+    if (spill) {
+        binding->reg = 0;
+        binding->slot = tr->frame_slots++;
+        return binding;
+    }
     binding->reg = tr->next_var_reg++;
     advance_next_var_reg(tr);
     tr->used_regs_mask |= (1 << binding->reg);
     return binding;
 }
 
+static int count_declarations(const Node *node) {
+    if (!node) return 0;
+    int count = node->node_type && strcmp(node->node_type, "DECLARACION") == 0;
+    count += count_declarations(node->left) + count_declarations(node->right) +
+             count_declarations(node->extra);
+    if (node->list) {
+        for (int i = 0; i < node->list->size; ++i) count += count_declarations(node->list->items[i]);
+    }
+    return count;
+}
+
+/* Functions whose variables outnumber the registers left below the
+ * temporaries get a stack frame: ENTER on entry (patched with the slot
+ * count at the end), LEAVE before every RET. Variables declared once the
+ * registers run out live in frame slots and go through LDL/STL. */
+static void begin_locals_frame(Translator *tr, int declarations) {
+    tr->frame_locals = false;
+    tr->frame_slots = 0;
+    advance_next_var_reg(tr);
+    int free_regs = 0;
+    for (int reg = tr->next_var_reg; reg < VM_NUM_REGISTERS - FRAME_TEMP_REGS; ++reg) {
+        if (!(tr->used_regs_mask & (1 << reg))) free_regs++;
+    }
+    if (declarations <= free_regs) return;
+    tr->frame_locals = true;
+    tr->enter_offset = emit_instruction(&tr->code, OP_ENTER, 0, 0);
+}
+
+static void end_locals_frame(Translator *tr) {
+    if (!tr->frame_locals) return;
+    tr->code.data[tr->enter_offset + 2] = tr->frame_slots;
+    tr->frame_locals = false;
+}
+
+/* A function that declares arrays gets one arena block for all of them:
+ * ALLOC into a dedicated register on entry, patched with the block size
+ * once the body is translated, and FREE before every RET. main's block is
+ * never freed, so it stays below the arena loop() restarts every tick. */
+static bool begin_array_frame(Translator *tr, bool needed) {
+    tr->frame_reg = 0;
+    if (!needed) return true;
+    advance_next_var_reg(tr);
+    if (tr->next_var_reg >= VM_NUM_REGISTERS) {
+        translator_fail(tr, "Register limit reached (max 7 user registers)");
+        return false;
+    }
+    tr->frame_reg = tr->next_var_reg++;
+    tr->used_regs_mask |= (1 << tr->frame_reg);
+    advance_next_var_reg(tr);
+    tr->frame_alloc_offset = emit_instruction(&tr->code, OP_ALLOC, tr->frame_reg, 0);
+    return true;
+}
+
+static bool end_array_frame(Translator *tr) {
+    if (tr->frame_reg == 0) return true;
+    tr->frame_reg = 0;
+    if (tr->heap_top > 255) {
+        translator_fail(tr, "Arrays of one function exceed 255 words");
+        return false;
+    }
+    tr->code.data[tr->frame_alloc_offset + 2] = (uint8_t) tr->heap_top;
+    return true;
+}
+
+static void emit_return(Translator *tr) {
+    if (tr->frame_reg != 0) {
+        emit_instruction(&tr->code, OP_FREE, tr->frame_reg, 0);
+    }
+    if (tr->frame_locals) {
+        emit_instruction(&tr->code, OP_LEAVE, 0, 0);
+    }
+    emit_instruction(&tr->code, OP_RET, 0, 0);
+}
+
+
 static uint8_t alloc_temp(Translator *tr) {
     for (int i = VM_NUM_REGISTERS - 1; i >= 0; --i) {
         if (!(tr->used_regs_mask & (1 << i))) {
@@ -426,15 +624,41 @@ static void emit_move(Translator *tr, uint8_t dst, uint8_t src) {
     emit_instruction(&tr->code, OP_LOAD, dst, src);
 }
 
+/* Stores a value into a variable, wherever it lives */
+static void emit_store_var(Translator *tr, const VarBinding *binding, uint8_t src) {
+    if (binding->in_frame) {
+        emit_instruction(&tr->code, OP_STL, src, binding->slot);
+    } else {
+        emit_move(tr, binding->reg, src);
+    }
+}
+
+/* Packs the two source registers of a three-operand ALU instruction */
+static uint8_t pack_sources(uint8_t a, uint8_t b) {
+    return (uint8_t) ((a << 4) | (b & 0x0F));
+}
+
+/* Jumps keep their target in arg1/arg2, compare-and-branch in the trailing word */
 static void patch_address(BytecodeBuffer *buf, size_t instr_offset, uint16_t target) {
-    buf->data[instr_offset + 1] = target & 0xFF;
-    buf->data[instr_offset + 2] = (target >> 8) & 0xFF;
+    size_t at = is_wide_opcode(buf->data[instr_offset]) ? instr_offset + 3 : instr_offset + 1;
+    buf->data[at] = target & 0xFF;
+    buf->data[at + 1] = (target >> 8) & 0xFF;
 }
 
 static uint16_t current_address(const Translator *tr) {
     return (uint16_t) tr->code.size;
 }
 
+/* Pool index of value, adding it if needed; -1 once the pool is full */
+static int intern_const(Translator *tr, int32_t value) {
+    for (size_t i = 0; i < tr->const_count; ++i) {
+        if (tr->consts[i] == value) return (int) i;
+    }
+    if (tr->const_count == A3B_MAX_CONSTS) return -1;
+    tr->consts[tr->const_count] = value;
+    return (int) tr->const_count++;
+}
+
 static void emit_load_const(Translator *tr, uint8_t dst, long value) {
     int32_t signed_value = (int32_t) value;
     uint32_t bits = (uint32_t) signed_value;
@@ -444,6 +668,13 @@ static void emit_load_const(Translator *tr, uint8_t dst, long value) {
         return;
     }
 
+    int idx = intern_const(tr, signed_value);
+    if (idx >= 0) {
+        emit_instruction(&tr->code, OP_LOADK, dst, (uint8_t) idx);
+        return;
+    }
+
+    /* Pool full: build the value a byte at a time */
     uint8_t bytes[4];
     bytes[0] = (uint8_t) ((bits >> 24) & 0xFFu);
     bytes[1] = (uint8_t) ((bits >> 16) & 0xFFu);
@@ -466,8 +697,7 @@ static void emit_load_const(Translator *tr, uint8_t dst, long value) {
         }
 
         emit_instruction(&tr->code, OP_LOADI, tmp, bytes[i]);
-        emit_instruction(&tr->code, OP_OR, dst, tmp);
-        emit_instruction(&tr->code, OP_LOAD, dst, 0);
+        emit_instruction(&tr->code, OP_OR3, dst, pack_sources(dst, tmp));
         release_temp(tr, tmp);
     }
 }
@@ -489,24 +719,18 @@ static RegValue make_error_reg(void) {
     return r;
 }
 
-static RegValue array_element_address(Translator *tr, ArrayBinding *binding, RegValue index_reg) {
-    /* Calculate address: base_addr + index */
-    uint8_t base_reg = alloc_temp(tr);
-    if (tr->failed) {
-        if (index_reg.is_temp) release_temp(tr, index_reg.reg);
-        return make_error_reg();
+/* Returns a register holding the array's base word. LOADX/STOREX add the
+ * index themselves, so one base register serves every element. The first
+ * array starts the arena block, so the frame register is its base. */
+static RegValue array_base(Translator *tr, ArrayBinding *binding) {
+    if (binding->base_addr == 0) {
+        RegValue frame = {tr->frame_reg, false};
+        return frame;
     }
-    
-    /* Load base address into a register */
+    uint8_t base_reg = alloc_temp(tr);
+    if (tr->failed) return make_error_reg();
     emit_load_const(tr, base_reg, (long) binding->base_addr);
-    
-    /* Add index to base address: base_reg = base_reg + index_reg */
-    emit_instruction(&tr->code, OP_ADD, base_reg, index_reg.reg);
-    /* Result is in R0, move it to base_reg */
-    emit_instruction(&tr->code, OP_LOAD, base_reg, 0);
-    
-    if (index_reg.is_temp) release_temp(tr, index_reg.reg);
-    
+    emit_instruction(&tr->code, OP_ADD3, base_reg, pack_sources(tr->frame_reg, base_reg));
     RegValue r = {base_reg, true};
     return r;
 }
@@ -521,6 +745,25 @@ static RegValue make_const_regvalue(Translator *tr, long value) {
     return r;
 }
 
+/* Emits a three-operand ALU instruction. The result goes into a temporary
+ * operand when there is one, so variable registers are never overwritten. */
+static RegValue emit_alu3(Translator *tr, Opcode op, RegValue lhs, RegValue rhs) {
+    RegValue dst;
+    if (lhs.is_temp) {
+        dst = lhs;
+    } else if (rhs.is_temp) {
+        dst = rhs;
+    } else {
+        dst.reg = alloc_temp(tr);
+        dst.is_temp = true;
+        if (tr->failed) return make_error_reg();
+    }
+    emit_instruction(&tr->code, op, dst.reg, pack_sources(lhs.reg, rhs.reg));
+    if (rhs.is_temp && rhs.reg != dst.reg) release_temp(tr, rhs.reg);
+    if (lhs.is_temp && lhs.reg != dst.reg) release_temp(tr, lhs.reg);
+    return dst;
+}
+
 static RegValue translate_binary_arith(Translator *tr, Node *node, Opcode op) {
     RegValue result = make_error_reg();
     RegValue lhs = translate_expression(tr, node->left);
@@ -528,73 +771,118 @@ static RegValue translate_binary_arith(Translator *tr, Node *node, Opcode op) {
     RegValue rhs = translate_expression(tr, node->right);
     if (tr->failed) return result;
 
-    emit_instruction(&tr->code, op, lhs.reg, rhs.reg);
-    emit_instruction(&tr->code, OP_LOAD, lhs.reg, 0); /* copy R0 into lhs */
-    if (rhs.is_temp) release_temp(tr, rhs.reg);
-    return lhs;
+    return emit_alu3(tr, op, lhs, rhs);
 }
 
-static RegValue translate_binary_logic(Translator *tr, Node *node, Opcode op) {
-    RegValue result = make_error_reg();
-    RegValue lhs = translate_expression(tr, node->left);
-    if (tr->failed) return result;
-    RegValue rhs = translate_expression(tr, node->right);
-    if (tr->failed) return result;
-
-    emit_instruction(&tr->code, op, lhs.reg, rhs.reg);
-    emit_instruction(&tr->code, OP_LOAD, lhs.reg, 0);
-    if (rhs.is_temp) release_temp(tr, rhs.reg);
-    return lhs;
+/* Picks the compare-and-branch that is taken when `kind` (EQ, NEQ, LT, GT,
+ * LEQ, GEQ) evaluates to `when_true`. GT and LEQ swap their operands. */
+static Opcode branch_opcode(const char *kind, bool when_true, bool *swap) {
+    *swap = false;
+    if (strcmp(kind, "EQ") == 0) return when_true ? OP_BEQ : OP_BNE;
+    if (strcmp(kind, "NEQ") == 0) return when_true ? OP_BNE : OP_BEQ;
+    if (strcmp(kind, "LT") == 0) return when_true ? OP_BLT : OP_BGE;
+    if (strcmp(kind, "GEQ") == 0) return when_true ? OP_BGE : OP_BLT;
+    *swap = true;
+    if (strcmp(kind, "GT") == 0) return when_true ? OP_BLT : OP_BGE;
+    if (strcmp(kind, "LEQ") == 0) return when_true ? OP_BGE : OP_BLT;
+    return OP_NOP;
 }
 
-static RegValue translate_unary_not(Translator *tr, Node *node) {
-    RegValue operand = translate_expression(tr, node->left);
-    if (tr->failed) return make_error_reg();
-    emit_instruction(&tr->code, OP_NOT, operand.reg, 0);
-    emit_instruction(&tr->code, OP_LOAD, operand.reg, 0);
-    return operand;
+static bool is_comparison(const char *kind) {
+    bool swap;
+    return branch_opcode(kind, true, &swap) != OP_NOP;
 }
 
-static RegValue translate_comparison(Translator *tr, Node *node, Opcode jump_opcode) {
-    RegValue result = make_error_reg();
-    RegValue lhs = translate_expression(tr, node->left);
-    if (tr->failed) return result;
-    RegValue rhs = translate_expression(tr, node->right);
-    if (tr->failed) return result;
+/* Branch instructions whose target is not known yet */
+typedef struct {
+    size_t offsets[MAX_BRANCH_SITES];
+    size_t count;
+} BranchSites;
 
-    uint8_t dst = alloc_temp(tr);
-    if (tr->failed) {
-        if (rhs.is_temp) release_temp(tr, rhs.reg);
-        if (lhs.is_temp) release_temp(tr, lhs.reg);
-        return result;
+static void add_branch_site(Translator *tr, BranchSites *sites, size_t offset) {
+    if (sites->count >= MAX_BRANCH_SITES) {
+        translator_fail(tr, "Condition too complex (too many pending branches)");
+        return;
     }
+    sites->offsets[sites->count++] = offset;
+}
 
-    emit_instruction(&tr->code, OP_CMP, lhs.reg, rhs.reg);
-    size_t jump_true = emit_instruction(&tr->code, jump_opcode, 0, 0);
-    emit_load_const(tr, dst, 0);
-    size_t jump_end = emit_instruction(&tr->code, OP_JMP, 0, 0);
-    uint16_t true_addr = current_address(tr);
-    patch_address(&tr->code, jump_true, true_addr);
-    emit_load_const(tr, dst, 1);
-    uint16_t end_addr = current_address(tr);
-    patch_address(&tr->code, jump_end, end_addr);
+static void patch_branch_sites(Translator *tr, BranchSites *sites, uint16_t target) {
+    for (size_t i = 0; i < sites->count; ++i) {
+        patch_address(&tr->code, sites->offsets[i], target);
+    }
+    sites->count = 0;
+}
 
+/* Emits code that branches when `cond` evaluates to `when_true` and falls
+ * through otherwise. Comparisons become a single BEQ/BNE/BLT/BGE, `and`/`or`
+ * short-circuit and `not` just flips the sense, so no boolean is materialised.
+ * The pending branches are added to `sites` for the caller to patch. */
+static bool emit_condition_branch(Translator *tr, Node *cond, bool when_true, BranchSites *sites) {
+    if (!cond) {
+        translator_fail(tr, "Unexpected empty condition");
+        return false;
+    }
+    const char *kind = cond->node_type;
+    if (strcmp(kind, "NOT") == 0) {
+        return emit_condition_branch(tr, cond->left, !when_true, sites);
+    }
+    if (strcmp(kind, "AND") == 0 || strcmp(kind, "OR") == 0) {
+        /* and: any false operand decides; or: any true operand decides */
+        bool decides = strcmp(kind, "OR") == 0;
+        if (when_true == decides) {
+            return emit_condition_branch(tr, cond->left, when_true, sites) &&
+                   emit_condition_branch(tr, cond->right, when_true, sites);
+        }
+        BranchSites skip = {{0}, 0};
+        if (!emit_condition_branch(tr, cond->left, decides, &skip)) return false;
+        if (!emit_condition_branch(tr, cond->right, when_true, sites)) return false;
+        patch_branch_sites(tr, &skip, current_address(tr));
+        return !tr->failed;
+    }
+
+    bool swap = false;
+    Opcode branch;
+    RegValue lhs;
+    RegValue rhs;
+    if (is_comparison(kind)) {
+        branch = branch_opcode(kind, when_true, &swap);
+        lhs = translate_expression(tr, cond->left);
+        if (tr->failed) return false;
+        rhs = translate_expression(tr, cond->right);
+        if (tr->failed) return false;
+    } else {
+        branch = when_true ? OP_BNE : OP_BEQ;
+        lhs = translate_expression(tr, cond);
+        if (tr->failed) return false;
+        rhs = make_const_regvalue(tr, 0);
+        if (tr->failed) return false;
+    }
+    uint8_t a = swap ? rhs.reg : lhs.reg;
+    uint8_t b = swap ? lhs.reg : rhs.reg;
+    add_branch_site(tr, sites, emit_wide_instruction(&tr->code, branch, a, b, 0));
     if (rhs.is_temp) release_temp(tr, rhs.reg);
     if (lhs.is_temp) release_temp(tr, lhs.reg);
+    return !tr->failed;
+}
+
+/* Comparisons, `and`, `or` and `not` used as values: the same branches as
+ * in a condition, around LOADI 1 / LOADI 0, so `y = not x; if (y)` and
+ * `if (not x)` agree and both sides short-circuit alike. */
+static RegValue translate_boolean(Translator *tr, Node *node) {
+    uint8_t dst = alloc_temp(tr);
+    if (tr->failed) return make_error_reg();
+
+    BranchSites done = {{0}, 0};
+    emit_load_const(tr, dst, 1);
+    if (!emit_condition_branch(tr, node, true, &done)) return make_error_reg();
+    emit_load_const(tr, dst, 0);
+    patch_branch_sites(tr, &done, current_address(tr));
 
     RegValue out = {dst, true};
     return out;
 }
 
-static size_t emit_jump_if_zero(Translator *tr, uint8_t reg) {
-    uint8_t zero = alloc_temp(tr);
-    if (tr->failed) return (size_t) -1;
-    emit_load_const(tr, zero, 0);
-    emit_instruction(&tr->code, OP_CMP, reg, zero);
-    release_temp(tr, zero);
-    return emit_instruction(&tr->code, OP_JZ, 0, 0);
-}
-
 static void cleanup_regvalues(Translator *tr, RegValue values[], size_t count) {
     for (size_t i = 0; i < count; ++i) {
         if (values[i].is_temp) {
@@ -608,7 +896,7 @@ static void push_label(Translator *tr, const char *text) {
         translator_fail(tr, "Too many labels generated for listing");
         return;
     }
-    tr->labels[tr->label_count].start_index = tr->code.size / 3;
+    tr->labels[tr->label_count].start_offset = tr->code.size;
     tr->labels[tr->label_count].text = strdup(text);
     if (!tr->labels[tr->label_count].text) {
         translator_fail(tr, "Out of memory while recording label");
@@ -789,8 +1077,15 @@ static RegValue translate_exec_expr(Translator *tr, Node *node) {
         return error;
     }
 
+    /* Save only registers that hold live values: variables, the array
+     * block and the enclosing expression's temporaries. Argument temporaries
+     * die at the call, and globals stay put so the callee's updates stick. */
+    uint8_t saved = (uint8_t) (tr->used_regs_mask & ~tr->global_regs_mask & ~1u);
+    for (size_t i = 0; i < arg_count; ++i) {
+        if (args[i].is_temp) saved &= (uint8_t) ~(1u << args[i].reg);
+    }
     for (int reg = 1; reg < VM_NUM_REGISTERS; ++reg) {
-        emit_instruction(&tr->code, OP_PUSH, (uint8_t) reg, 0);
+        if (saved & (1 << reg)) emit_instruction(&tr->code, OP_PUSH, (uint8_t) reg, 0);
     }
     for (size_t i = 0; i < arg_count; ++i) {
         emit_move(tr, info->param_regs[i], args[i].reg);
@@ -799,7 +1094,7 @@ static RegValue translate_exec_expr(Translator *tr, Node *node) {
     uint16_t addr = (uint16_t) info->start_offset;
     emit_instruction(&tr->code, OP_CALL, addr & 0xFF, (addr >> 8) & 0xFF);
     for (int reg = VM_NUM_REGISTERS - 1; reg >= 1; --reg) {
-        emit_instruction(&tr->code, OP_POP, (uint8_t) reg, 0);
+        if (saved & (1 << reg)) emit_instruction(&tr->code, OP_POP, (uint8_t) reg, 0);
     }
 
 capture_result:
@@ -873,6 +1168,13 @@ static RegValue translate_expression(Translator *tr, Node *expr) {
             RegValue r = {global->binding.reg, false};
             return r;
         }
+        if (binding->in_frame) {
+            uint8_t temp = alloc_temp(tr);
+            if (tr->failed) return make_error_reg();
+            emit_instruction(&tr->code, OP_LDL, temp, binding->slot);
+            RegValue r = {temp, true};
+            return r;
+        }
         RegValue r = {binding->reg, false};
         return r;
     }
@@ -890,59 +1192,42 @@ static RegValue translate_expression(Translator *tr, Node *expr) {
         RegValue index = translate_expression(tr, expr->left);
         if (tr->failed) return make_error_reg();
         
-        RegValue addr = array_element_address(tr, binding, index);
-        if (tr->failed) return make_error_reg();
-        uint8_t dst = alloc_temp(tr);
+        RegValue base = array_base(tr, binding);
         if (tr->failed) {
-            if (addr.is_temp) release_temp(tr, addr.reg);
+            if (index.is_temp) release_temp(tr, index.reg);
             return make_error_reg();
         }
-        emit_instruction(&tr->code, OP_LOADM, dst, addr.reg);
-        if (addr.is_temp) release_temp(tr, addr.reg);
-        RegValue r = {dst, true};
-        return r;
+        /* The element replaces a temporary operand; the frame register and
+         * variables are never overwritten */
+        RegValue dst = base.is_temp ? base : index;
+        if (!dst.is_temp) {
+            dst.reg = alloc_temp(tr);
+            dst.is_temp = true;
+            if (tr->failed) return make_error_reg();
+        }
+        emit_instruction(&tr->code, OP_LOADX, dst.reg, pack_sources(base.reg, index.reg));
+        if (base.is_temp && base.reg != dst.reg) release_temp(tr, base.reg);
+        if (index.is_temp && index.reg != dst.reg) release_temp(tr, index.reg);
+        return dst;
     }
     if (strcmp(kind, "EXEC") == 0) {
         return translate_exec_expr(tr, expr);
     }
     if (strcmp(kind, "ADD") == 0) {
-        return translate_binary_arith(tr, expr, OP_ADD);
+        return translate_binary_arith(tr, expr, OP_ADD3);
     }
     if (strcmp(kind, "MINUS") == 0) {
-        return translate_binary_arith(tr, expr, OP_SUB);
+        return translate_binary_arith(tr, expr, OP_SUB3);
     }
     if (strcmp(kind, "MULT") == 0) {
-        return translate_binary_arith(tr, expr, OP_MUL);
+        return translate_binary_arith(tr, expr, OP_MUL3);
     }
     if (strcmp(kind, "DIV") == 0) {
-        return translate_binary_arith(tr, expr, OP_DIV);
-    }
-    if (strcmp(kind, "AND") == 0) {
-        return translate_binary_logic(tr, expr, OP_AND);
+        return translate_binary_arith(tr, expr, OP_DIV3);
     }
-    if (strcmp(kind, "OR") == 0) {
-        return translate_binary_logic(tr, expr, OP_OR);
-    }
-    if (strcmp(kind, "NOT") == 0) {
-        return translate_unary_not(tr, expr);
-    }
-    if (strcmp(kind, "EQ") == 0) {
-        return translate_comparison(tr, expr, OP_JZ);
-    }
-    if (strcmp(kind, "NEQ") == 0) {
-        return translate_comparison(tr, expr, OP_JNZ);
-    }
-    if (strcmp(kind, "LT") == 0) {
-        return translate_comparison(tr, expr, OP_JLT);
-    }
-    if (strcmp(kind, "GT") == 0) {
-        return translate_comparison(tr, expr, OP_JGT);
-    }
-    if (strcmp(kind, "LEQ") == 0) {
-        return translate_comparison(tr, expr, OP_JLE);
-    }
-    if (strcmp(kind, "GEQ") == 0) {
-        return translate_comparison(tr, expr, OP_JGE);
+    if (strcmp(kind, "AND") == 0 || strcmp(kind, "OR") == 0 || strcmp(kind, "NOT") == 0 ||
+        is_comparison(kind)) {
+        return translate_boolean(tr, expr);
     }
     translator_fail(tr, "Expression type not supported by translator yet");
     return make_error_reg();
@@ -974,8 +1259,13 @@ static bool translate_declaration(Translator *tr, Node *node) {
         }
         RegValue init = translate_expression(tr, init_expr);
         if (tr->failed) return false;
-        emit_move(tr, binding->reg, init.reg);
+        emit_store_var(tr, binding, init.reg);
         if (init.is_temp) release_temp(tr, init.reg);
+    } else if (binding->in_frame) {
+        RegValue zero = make_const_regvalue(tr, 0);
+        if (tr->failed) return false;
+        emit_store_var(tr, binding, zero.reg);
+        release_temp(tr, zero.reg);
     } else {
         emit_load_const(tr, binding->reg, 0);
     }
@@ -1010,45 +1300,42 @@ static bool translate_array_assignment(Translator *tr, ArrayBinding *array, Node
         translator_fail(tr, "Array literal has more elements than target array");
         return false;
     }
+    RegValue base = array_base(tr, array);
+    if (tr->failed) return false;
     size_t i = 0;
     for (; i < provided; ++i) {
         Node *expr = values->list->items[i];
         RegValue val = translate_expression(tr, expr);
-        if (tr->failed) return false;
-        RegValue index = make_const_regvalue(tr, (long) i);
         if (tr->failed) {
-            if (val.is_temp) release_temp(tr, val.reg);
+            if (base.is_temp) release_temp(tr, base.reg);
             return false;
         }
-        RegValue addr = array_element_address(tr, array, index);
+        RegValue index = make_const_regvalue(tr, (long) i);
         if (tr->failed) {
             if (val.is_temp) release_temp(tr, val.reg);
+            if (base.is_temp) release_temp(tr, base.reg);
             return false;
         }
-        emit_instruction(&tr->code, OP_STORE, addr.reg, val.reg);
-        if (addr.is_temp) release_temp(tr, addr.reg);
+        emit_instruction(&tr->code, OP_STOREX, val.reg, pack_sources(base.reg, index.reg));
+        release_temp(tr, index.reg);
         if (val.is_temp) release_temp(tr, val.reg);
     }
     if (i < array->length) {
         uint8_t zero = alloc_temp(tr);
-        if (tr->failed) return false;
+        if (tr->failed) {
+            if (base.is_temp) release_temp(tr, base.reg);
+            return false;
+        }
         emit_load_const(tr, zero, 0);
         for (; i < array->length; ++i) {
             RegValue index = make_const_regvalue(tr, (long) i);
-            if (tr->failed) {
-                release_temp(tr, zero);
-                return false;
-            }
-            RegValue addr = array_element_address(tr, array, index);
-            if (tr->failed) {
-                release_temp(tr, zero);
-                return false;
-            }
-            emit_instruction(&tr->code, OP_STORE, addr.reg, zero);
-            if (addr.is_temp) release_temp(tr, addr.reg);
+            if (tr->failed) break;
+            emit_instruction(&tr->code, OP_STOREX, zero, pack_sources(base.reg, index.reg));
+            release_temp(tr, index.reg);
         }
         release_temp(tr, zero);
     }
+    if (base.is_temp) release_temp(tr, base.reg);
     return !tr->failed;
 }
 
@@ -1081,8 +1368,11 @@ static bool translate_assignment(Translator *tr, Node *node) {
     }
     RegValue value = translate_expression(tr, rhs);
     if (tr->failed) return false;
-    uint8_t dest_reg = binding ? binding->reg : global_binding->binding.reg;
-    emit_move(tr, dest_reg, value.reg);
+    if (binding) {
+        emit_store_var(tr, binding, value.reg);
+    } else {
+        emit_move(tr, global_binding->binding.reg, value.reg);
+    }
     if (value.is_temp) release_temp(tr, value.reg);
     return true;
 }
@@ -1092,18 +1382,15 @@ static bool translate_if(Translator *tr, Node *node) {
         translator_fail(tr, "Malformed IF statement");
         return false;
     }
-    RegValue cond = translate_expression(tr, node->left);
-    if (tr->failed) return false;
-    size_t jump_false = emit_jump_if_zero(tr, cond.reg);
-    if (cond.is_temp) release_temp(tr, cond.reg);
-    if (jump_false == (size_t) -1) return false;
+    BranchSites false_sites = {{0}, 0};
+    if (!emit_condition_branch(tr, node->left, false, &false_sites)) return false;
     if (!translate_block(tr, node->right)) return false;
     size_t jump_end = (size_t) -1;
     if (node->extra) {
         jump_end = emit_instruction(&tr->code, OP_JMP, 0, 0);
     }
     uint16_t false_addr = current_address(tr);
-    patch_address(&tr->code, jump_false, false_addr);
+    patch_branch_sites(tr, &false_sites, false_addr);
     if (node->extra) {
         if (!translate_block(tr, node->extra)) return false;
         uint16_t end_addr = current_address(tr);
@@ -1117,16 +1404,14 @@ static bool translate_while(Translator *tr, Node *node) {
         translator_fail(tr, "Malformed WHILE statement");
         return false;
     }
-    uint16_t loop_start = current_address(tr);
-    RegValue cond = translate_expression(tr, node->left);
-    if (tr->failed) return false;
-    size_t exit_jump = emit_jump_if_zero(tr, cond.reg);
-    if (cond.is_temp) release_temp(tr, cond.reg);
-    if (exit_jump == (size_t) -1) return false;
+    /* Test at the bottom so the back-edge is the conditional branch itself */
+    size_t enter_jump = emit_instruction(&tr->code, OP_JMP, 0, 0);
+    uint16_t body_start = current_address(tr);
     if (!translate_block(tr, node->list->items[0])) return false;
-    emit_instruction(&tr->code, OP_JMP, loop_start & 0xFF, (loop_start >> 8) & 0xFF);
-    uint16_t exit_addr = current_address(tr);
-    patch_address(&tr->code, exit_jump, exit_addr);
+    patch_address(&tr->code, enter_jump, current_address(tr));
+    BranchSites back_sites = {{0}, 0};
+    if (!emit_condition_branch(tr, node->left, true, &back_sites)) return false;
+    patch_branch_sites(tr, &back_sites, body_start);
     return !tr->failed;
 }
 
@@ -1136,16 +1421,12 @@ static bool translate_for(Translator *tr, Node *node) {
             return false;
         }
     }
-    uint16_t loop_start = current_address(tr);
     if (!node->right) {
         translator_fail(tr, "FOR loop missing condition");
         return false;
     }
-    RegValue cond = translate_expression(tr, node->right);
-    if (tr->failed) return false;
-    size_t exit_jump = emit_jump_if_zero(tr, cond.reg);
-    if (cond.is_temp) release_temp(tr, cond.reg);
-    if (exit_jump == (size_t) -1) return false;
+    size_t enter_jump = emit_instruction(&tr->code, OP_JMP, 0, 0);
+    uint16_t body_start = current_address(tr);
 
     Node *body = (node->list && node->list->size > 0) ? node->list->items[0] : NULL;
     if (body && !translate_block(tr, body)) return false;
@@ -1154,9 +1435,10 @@ static bool translate_for(Translator *tr, Node *node) {
             return false;
         }
     }
-    emit_instruction(&tr->code, OP_JMP, loop_start & 0xFF, (loop_start >> 8) & 0xFF);
-    uint16_t exit_addr = current_address(tr);
-    patch_address(&tr->code, exit_jump, exit_addr);
+    patch_address(&tr->code, enter_jump, current_address(tr));
+    BranchSites back_sites = {{0}, 0};
+    if (!emit_condition_branch(tr, node->right, true, &back_sites)) return false;
+    patch_branch_sites(tr, &back_sites, body_start);
     return !tr->failed;
 }
 
@@ -1199,7 +1481,7 @@ static bool translate_statement(Translator *tr, Node *stmt) {
         } else {
             emit_load_const(tr, 0, 0);
         }
-        emit_instruction(&tr->code, OP_RET, 0, 0);
+        emit_return(tr);
         return true;
     }
     if (strcmp(kind, "EXEC") == 0) {
@@ -1235,7 +1517,6 @@ static bool translate_function(Translator *tr, Node *func) {
     FunctionInfo *info = &tr->functions[tr->function_count++];
     info->name = strdup(func->value);
     info->start_offset = current_address(tr);
-    info->start_index = info->start_offset / 3;
     info->param_count = 0;
 
     translator_reset_registers(tr);
@@ -1256,6 +1537,8 @@ static bool translate_function(Translator *tr, Node *func) {
             info->param_regs[info->param_count++] = binding->reg;
         }
     }
+    if (!begin_array_frame(tr, declares_array(func->right))) return false;
+    begin_locals_frame(tr, count_declarations(func->right));
 
     bool previous_in_function = tr->in_function;
     FunctionInfo *previous_function = tr->current_function;
@@ -1272,9 +1555,12 @@ static bool translate_function(Translator *tr, Node *func) {
 
     bool ok = translate_block(tr, func->right);
 
-    if (ok && (tr->code.size < 3 || tr->code.data[tr->code.size - 3] != OP_RET)) {
-        emit_instruction(&tr->code, OP_RET, 0, 0);
+    if (ok && (tr->code.size == info->start_offset ||
+               tr->code.data[tr->code.last_offset] != OP_RET)) {
+        emit_return(tr);
     }
+    ok = end_array_frame(tr) && ok;
+    end_locals_frame(tr);
 
     tr->in_function = previous_in_function;
     tr->current_function = previous_function;
@@ -1347,6 +1633,7 @@ static bool translate_root(Translator *tr, Node *root) {
         }
     }
 
+    tr->main_offset = tr->code.size;
     if (has_functions) {
         uint16_t main_addr = current_address(tr);
         patch_address(&tr->code, jump_pos, main_addr);
@@ -1360,6 +1647,19 @@ static bool translate_root(Translator *tr, Node *root) {
         free(main_nodes);
         return false;
     }
+    bool main_arrays = false;
+    for (int i = 0; i < main_index; ++i) {
+        main_arrays = main_arrays || declares_array(main_nodes[i]);
+    }
+    if (!begin_array_frame(tr, main_arrays)) {
+        free(main_nodes);
+        return false;
+    }
+    int main_declarations = 0;
+    for (int i = 0; i < main_index; ++i) {
+        main_declarations += count_declarations(main_nodes[i]);
+    }
+    begin_locals_frame(tr, main_declarations);
 
     bool ok = true;
     for (int i = 0; i < main_index; ++i) {
@@ -1372,45 +1672,437 @@ static bool translate_root(Translator *tr, Node *root) {
         }
         if (!ok || tr->failed) break;
     }
+    ok = ok && end_array_frame(tr);
+    end_locals_frame(tr);
 
     free(main_nodes);
     return ok;
 }
 
+static bool write_listing(Translator *tr, const char *output_path) {
+    FILE *out = fopen(output_path, "w");
+    if (!out) {
+        fprintf(stderr, "translator: unable to open %s for writing\n", output_path);
+        return false;
+    }
+    fprintf(out, "# A3VM instruction listing generated by translator\n");
+    fprintf(out, "# format: <mnemonic> <arg1> <arg2> [<word>]\n");
+    for (size_t i = 0; i < tr->const_count; ++i) {
+        fprintf(out, "# CONST %zu %ld\n", i, (long) tr->consts[i]);
+    }
+    size_t count = 0;
+    for (size_t base = 0; base < tr->code.size; base += instruction_length(tr->code.data[base])) {
+        for (size_t f = 0; f < tr->function_count; ++f) {
+            if (tr->functions[f].start_offset == base) {
+                fprintf(out, "# FUNCTION %s\n", tr->functions[f].name);
+            }
+        }
+        for (size_t l = 0; l < tr->label_count; ++l) {
+            if (tr->labels[l].start_offset == base) {
+                fprintf(out, "# %s\n", tr->labels[l].text);
+            }
+        }
+        Opcode op = (Opcode) tr->code.data[base];
+        uint8_t arg1 = tr->code.data[base + 1];
+        uint8_t arg2 = tr->code.data[base + 2];
+        if (is_wide_opcode(op)) {
+            unsigned word = tr->code.data[base + 3] | (tr->code.data[base + 4] << 8);
+            fprintf(out, "%-7s %3u %3u %5u\n", opcode_name(op), arg1, arg2, word);
+        } else {
+            fprintf(out, "%-7s %3u %3u\n", opcode_name(op), arg1, arg2);
+        }
+        count++;
+    }
+    fclose(out);
+    fprintf(stderr, "translator: wrote %zu instructions to %s\n", count, output_path);
+    return true;
+}
+
+/* --- C++ backend ---
+ * Each function's bytecode becomes a C++ function over the A3Context
+ * declared in vm/a3_aot.h; jumps become gotos within the function, CALL a
+ * native call and TRAP/PRINT the context callbacks. Every instruction keeps
+ * the interpreter's semantics; CALL still counts against the VM's return
+ * stack depth so overflow happens at the same depth. */
+
+/* End of the code region (function or top-level code) starting at begin */
+static size_t cpp_region_end(const Translator *tr, size_t begin) {
+    size_t end = tr->code.size;
+    for (size_t f = 0; f < tr->function_count; ++f) {
+        size_t start = tr->functions[f].start_offset;
+        if (start > begin && start < end) end = start;
+    }
+    if (tr->main_offset > begin && tr->main_offset < end) end = tr->main_offset;
+    return end;
+}
+
+static uint16_t cpp_branch_target(const uint8_t *p) {
+    if (is_wide_opcode(p[0])) return (uint16_t) (p[3] | (p[4] << 8));
+    return (uint16_t) (p[1] | (p[2] << 8));
+}
+
+static bool cpp_is_local_branch(uint8_t op) {
+    return (op >= OP_JMP && op <= OP_JGE) || (op >= OP_BEQ && op <= OP_BGE);
+}
+
+static bool write_cpp_region(Translator *tr, FILE *out, const char *name, size_t begin) {
+    size_t end = cpp_region_end(tr, begin);
+    bool *is_target = (bool *) calloc(tr->code.size + 1, sizeof(bool));
+    if (!is_target) {
+        translator_fail(tr, "Out of memory while emitting C++");
+        return false;
+    }
+    bool uses_registers = false;
+    for (size_t pc = begin; pc < end; pc += instruction_length(tr->code.data[pc])) {
+        const uint8_t *p = &tr->code.data[pc];
+        uint8_t op = p[0];
+        if (op != OP_NOP && op != OP_JMP && op != OP_CALL && op != OP_RET &&
+            op != OP_HALT && op != TRAP && op != OP_ENTER && op != OP_LEAVE &&
+            !(op >= OP_JZ && op <= OP_JGE)) {
+            uses_registers = true;
+        }
+        if (!cpp_is_local_branch(op)) continue;
+        uint16_t target = cpp_branch_target(p);
+        if (target < begin || target >= end) {
+            translator_fail(tr, "C++ backend: branch leaves its function");
+            free(is_target);
+            return false;
+        }
+        is_target[target] = true;
+    }
+
+    fprintf(out, "\nstatic void %s(A3Context& c) {\n", name);
+    if (uses_registers) fprintf(out, "    int32_t* R = c.registers;\n");
+    static const char *const alu_ops[] = {
+        [OP_ADD3] = "+", [OP_SUB3] = "-", [OP_MUL3] = "*", [OP_AND3] = "&", [OP_OR3] = "|"
+    };
+    static const char *const flag_conditions[] = {
+        [OP_JZ] = "c.compared && c.cmp_lhs == c.cmp_rhs",
+        [OP_JNZ] = "!(c.compared && c.cmp_lhs == c.cmp_rhs)",
+        [OP_JLT] = "c.compared && c.cmp_lhs < c.cmp_rhs",
+        [OP_JGT] = "c.compared && c.cmp_lhs > c.cmp_rhs",
+        [OP_JLE] = "c.compared && c.cmp_lhs <= c.cmp_rhs",
+        [OP_JGE] = "c.compared && c.cmp_lhs >= c.cmp_rhs"
+    };
+    static const char *const branch_ops[] = {
+        [OP_BEQ - OP_BEQ] = "==", [OP_BNE - OP_BEQ] = "!=",
+        [OP_BLT - OP_BEQ] = "<", [OP_BGE - OP_BEQ] = ">="
+    };
+    bool ok = true;
+    for (size_t pc = begin; pc < end && ok; pc += instruction_length(tr->code.data[pc])) {
+        const uint8_t *p = &tr->code.data[pc];
+        uint8_t op = p[0], a = p[1], b = p[2];
+        if (is_target[pc]) fprintf(out, "L_%zu:\n", pc);
+        switch (op) {
+            case OP_NOP:
+                fprintf(out, "    ;\n");
+                break;
+            case OP_ADD: fprintf(out, "    R[0] = R[%u] + R[%u];\n", a, b); break;
+            case OP_SUB: fprintf(out, "    R[0] = R[%u] - R[%u];\n", a, b); break;
+            case OP_MUL: fprintf(out, "    R[0] = R[%u] * R[%u];\n", a, b); break;
+            case OP_AND: fprintf(out, "    R[0] = R[%u] & R[%u];\n", a, b); break;
+            case OP_OR:  fprintf(out, "    R[0] = R[%u] | R[%u];\n", a, b); break;
+            case OP_DIV:
+                fprintf(out, "    R[0] = R[%u] != 0 ? R[%u] / R[%u] : 0;\n", b, a, b);
+                break;
+            case OP_NOT: fprintf(out, "    R[0] = ~R[%u];\n", a); break;
+            case OP_SHL: fprintf(out, "    R[0] = R[%u] << %u;\n", a, b & 31); break;
+            case OP_ADD3: case OP_SUB3: case OP_MUL3: case OP_AND3: case OP_OR3:
+                fprintf(out, "    R[%u] = R[%u] %s R[%u];\n", a, b >> 4, alu_ops[op], b & 0x0F);
+                break;
+            case OP_DIV3:
+                fprintf(out, "    R[%u] = R[%u] != 0 ? R[%u] / R[%u] : 0;\n",
+                        a, b & 0x0F, b >> 4, b & 0x0F);
+                break;
+            case OP_NOT3: fprintf(out, "    R[%u] = ~R[%u];\n", a, b >> 4); break;
+            case OP_CMP:
+                fprintf(out, "    c.cmp_lhs = R[%u]; c.cmp_rhs = R[%u]; c.compared = true;\n", a, b);
+                break;
+            case OP_LOAD:  fprintf(out, "    R[%u] = R[%u];\n", a, b); break;
+            case OP_LOADI: fprintf(out, "    R[%u] = %u;\n", a, b); break;
+            case OP_LOADK:
+                fprintf(out, "    R[%u] = (int32_t) 0x%08Xu;  // %ld\n",
+                        a, (unsigned) tr->consts[b], (long) tr->consts[b]);
+                break;
+            case OP_LOADI16:
+                fprintf(out, "    R[%u] = %u;\n", a, (unsigned) cpp_branch_target(p));
+                break;
+            case OP_STORE:
+                fprintf(out, "    if (R[%u] >= 0 && R[%u] < c.heap_size) c.heap[R[%u]] = (uint8_t) R[%u];\n",
+                        a, a, a, b);
+                break;
+            case OP_LOADM:
+                fprintf(out, "    if (R[%u] < 0 || R[%u] >= c.heap_size) A3_FAIL(c, \"Error: LOADM out of bounds\");\n",
+                        b, b);
+                fprintf(out, "    R[%u] = c.heap[R[%u]];\n", a, b);
+                break;
+            case OP_LOADX:
+            case OP_STOREX:
+                fprintf(out, "    if ((uint32_t) (R[%u] + R[%u]) >= c.heap_size / 4u) A3_FAIL(c, \"Error: %s out of bounds\");\n",
+                        b >> 4, b & 0x0F, op == OP_LOADX ? "LOADX" : "STOREX");
+                if (op == OP_LOADX) {
+                    fprintf(out, "    R[%u] = a3_load_word(c, R[%u] + R[%u]);\n", a, b >> 4, b & 0x0F);
+                } else {
+                    fprintf(out, "    a3_store_word(c, R[%u] + R[%u], R[%u]);\n", b >> 4, b & 0x0F, a);
+                }
+                break;
+            case OP_PUSH:
+                fprintf(out, "    if (*c.sp >= c.stack_size) A3_FAIL(c, \"Error: Stack Overflow\");\n");
+                fprintf(out, "    c.stack[(*c.sp)++] = R[%u];\n", a);
+                break;
+            case OP_POP:
+                fprintf(out, "    if (*c.sp == 0) A3_FAIL(c, \"Error: Stack Underflow\");\n");
+                fprintf(out, "    R[%u] = c.stack[--(*c.sp)];\n", a);
+                break;
+            case OP_JMP:
+                fprintf(out, "    goto L_%u;\n", (unsigned) cpp_branch_target(p));
+                break;
+            case OP_JZ: case OP_JNZ: case OP_JLT: case OP_JGT: case OP_JLE: case OP_JGE:
+                fprintf(out, "    if (%s) goto L_%u;\n", flag_conditions[op], (unsigned) cpp_branch_target(p));
+                break;
+            case OP_BEQ: case OP_BNE: case OP_BLT: case OP_BGE:
+                fprintf(out, "    if (R[%u] %s R[%u]) goto L_%u;\n",
+                        a, branch_ops[op - OP_BEQ], b, (unsigned) cpp_branch_target(p));
+                break;
+            case OP_CALL: {
+                uint16_t target = cpp_branch_target(p);
+                const char *callee = NULL;
+                for (size_t f = 0; f < tr->function_count; ++f) {
+                    if (tr->functions[f].start_offset == target) callee = tr->functions[f].name;
+                }
+                if (!callee) {
+                    translator_fail(tr, "C++ backend: CALL target is not a function");
+                    ok = false;
+                    break;
+                }
+                fprintf(out, "    if (*c.rsp >= c.return_depth) A3_FAIL(c, \"Error: Return stack overflow\");\n");
+                fprintf(out, "    ++*c.rsp;\n");
+                fprintf(out, "    a3_fn_%s(c);\n", callee);
+                fprintf(out, "    if (!c.running) return;\n");
+                fprintf(out, "    --*c.rsp;\n");
+                break;
+            }
+            case OP_RET:
+                fprintf(out, "    return;\n");
+                break;
+            case OP_HALT:
+                fprintf(out, "    c.running = false;\n");
+                fprintf(out, "    return;\n");
+                break;
+            case PRINT:
+                fprintf(out, "    c.print(c.user, R[%u]);\n", a);
+                break;
+            case TRAP:
+                fprintf(out, "    c.trap(c.user, %u);\n", a);
+                break;
+            case OP_ALLOC:
+                fprintf(out, "    if (*c.heap_top + %uu * 4u > c.heap_size) A3_FAIL(c, \"Error: Heap exhausted\");\n", b);
+                fprintf(out, "    R[%u] = (int32_t) (*c.heap_top / 4u);\n", a);
+                fprintf(out, "    *c.heap_top += %uu * 4u;\n", b);
+                break;
+            case OP_FREE:
+                fprintf(out, "    if (R[%u] < 0 || (uint32_t) R[%u] * 4u > *c.heap_top) A3_FAIL(c, \"Error: FREE of unallocated block\");\n",
+                        a, a);
+                fprintf(out, "    *c.heap_top = (uint32_t) R[%u] * 4u;\n", a);
+                break;
+            case OP_ENTER:
+                fprintf(out, "    if (*c.sp + 1u + %uu > c.stack_size) A3_FAIL(c, \"Error: Stack overflow on ENTER\");\n", b);
+                fprintf(out, "    c.stack[(*c.sp)++] = *c.fp;\n");
+                fprintf(out, "    *c.fp = *c.sp;\n");
+                fprintf(out, "    *c.sp += %u;\n", b);
+                break;
+            case OP_LEAVE:
+                fprintf(out, "    if (*c.fp == 0 || *c.fp > *c.sp) A3_FAIL(c, \"Error: LEAVE without a frame\");\n");
+                fprintf(out, "    *c.sp = *c.fp - 1;\n");
+                fprintf(out, "    if ((uint32_t) c.stack[*c.sp] > *c.sp) A3_FAIL(c, \"Error: LEAVE without a frame\");\n");
+                fprintf(out, "    *c.fp = (uint16_t) c.stack[*c.sp];\n");
+                break;
+            case OP_LDL:
+            case OP_STL:
+                fprintf(out, "    if (*c.fp + %uu >= *c.sp) A3_FAIL(c, \"Error: local outside the frame\");\n", b);
+                if (op == OP_LDL) {
+                    fprintf(out, "    R[%u] = c.stack[*c.fp + %u];\n", a, b);
+                } else {
+                    fprintf(out, "    c.stack[*c.fp + %u] = R[%u];\n", b, a);
+                }
+                break;
+            default:
+                translator_fail(tr, "C++ backend: opcode not supported");
+                ok = false;
+                break;
+        }
+    }
+    fprintf(out, "}\n");
+    free(is_target);
+    return ok;
+}
+
+static bool write_cpp(Translator *tr, const char *cpp_path) {
+    FILE *out = fopen(cpp_path, "w");
+    if (!out) {
+        fprintf(stderr, "translator: unable to open %s for writing\n", cpp_path);
+        return false;
+    }
+    const FunctionInfo *loop_fn = NULL;
+    fprintf(out, "// A3 program compiled ahead of time by a3c. Do not edit.\n");
+    fprintf(out, "#include \"a3_aot.h\"\n\n");
+    for (size_t f = 0; f < tr->function_count; ++f) {
+        fprintf(out, "static void a3_fn_%s(A3Context& c);\n", tr->functions[f].name);
+        if (strcmp(tr->functions[f].name, "loop") == 0) loop_fn = &tr->functions[f];
+    }
+
+    bool ok = true;
+    char name[128];
+    for (size_t f = 0; f < tr->function_count && ok; ++f) {
+        snprintf(name, sizeof(name), "a3_fn_%s", tr->functions[f].name);
+        ok = write_cpp_region(tr, out, name, tr->functions[f].start_offset);
+    }
+    if (ok) ok = write_cpp_region(tr, out, "a3_top_level", tr->main_offset);
+
+    if (ok) {
+        fprintf(out, "\nvoid a3_main(A3Context& c) {\n");
+        fprintf(out, "    c.running = true;\n");
+        fprintf(out, "    a3_top_level(c);\n");
+        fprintf(out, "    c.running = false;\n}\n");
+        fprintf(out, "\nvoid a3_loop(A3Context& c) {\n");
+        if (loop_fn) {
+            fprintf(out, "    c.running = true;\n");
+            fprintf(out, "    a3_fn_loop(c);\n");
+            fprintf(out, "    c.running = false;\n");
+        } else {
+            fprintf(out, "    (void) c;\n");
+        }
+        fprintf(out, "}\n");
+        fprintf(out, "\nconst bool a3_has_loop = %s;\n", loop_fn ? "true" : "false");
+    }
+    fclose(out);
+    if (ok) {
+        fprintf(stderr, "translator: wrote C++ translation unit to %s\n", cpp_path);
+    }
+    return ok;
+}
+
+/* --- .a3b container ---
+ * The same bytecode as the listing, with the function table, constant pool
+ * and labels that write_listing() prints as comments, in the layout of
+ * vm/a3b.h. */
+
+/* program.vmcode -> program.a3b, next to the listing */
+static char *a3b_path_for(const char *listing_path) {
+    size_t len = strlen(listing_path);
+    const char *dot = strrchr(listing_path, '.');
+    const char *slash = strrchr(listing_path, '/');
+    if (dot && (!slash || dot > slash)) len = (size_t) (dot - listing_path);
+    char *path = (char *) malloc(len + sizeof(".a3b"));
+    if (!path) return NULL;
+    memcpy(path, listing_path, len);
+    strcpy(path + len, ".a3b");
+    return path;
+}
+
+static bool write_a3b(Translator *tr, const char *path, bool compress) {
+    A3bHeader h;
+    h.version = A3B_VERSION;
+    h.flags = 0;
+    h.setup_entry = 0;
+    h.loop_entry = A3B_NO_ENTRY;
+    h.function_count = (uint16_t) tr->function_count;
+    h.const_count = (uint16_t) tr->const_count;
+    h.code_size = (uint16_t) tr->code.size;
+    h.packed_size = 0;
+    h.debug_size = 0;
+    for (size_t f = 0; f < tr->function_count; ++f) {
+        if (strcmp(tr->functions[f].name, "loop") == 0) {
+            h.flags |= A3B_FLAG_HAS_LOOP;
+            h.loop_entry = (uint16_t) tr->functions[f].start_offset;
+        }
+    }
+    for (size_t l = 0; l < tr->label_count; ++l) {
+        size_t text_len = strlen(tr->labels[l].text);
+        h.debug_size += 3 + (uint32_t) (text_len > 255 ? 255 : text_len);
+    }
+    if (h.debug_size > 0) h.flags |= A3B_FLAG_DEBUG_MAP;
+    if (h.const_count > 0) h.flags |= A3B_FLAG_CONST_POOL;
+    if (tr->code.size > 0xFFFF) {
+        fprintf(stderr, "translator: program too large for %s\n", path);
+        return false;
+    }
+    /* The packed code is only kept when it is smaller */
+    uint8_t *packed = compress ? (uint8_t *) malloc(tr->code.size) : NULL;
+    if (packed) {
+        h.packed_size = (uint16_t) a3b_lz_compress(tr->code.data, tr->code.size, packed, tr->code.size);
+        if (h.packed_size > 0) h.flags |= A3B_FLAG_COMPRESSED;
+    }
+
+    /* Zero-filled, so section padding needs no extra writes */
+    size_t total = a3b_total_size(&h);
+    uint8_t *image = (uint8_t *) calloc(total, 1);
+    if (!image) {
+        free(packed);
+        fprintf(stderr, "translator: out of memory writing %s\n", path);
+        return false;
+    }
+    a3b_write_header(image, &h);
+    uint8_t *entry = image + A3B_HEADER_SIZE;
+    for (size_t f = 0; f < tr->function_count; ++f, entry += A3B_FUNCTION_SIZE) {
+        size_t start = tr->functions[f].start_offset;
+        a3b_write_function(entry, (uint16_t) start,
+                           (uint16_t) (cpp_region_end(tr, start) - start), tr->functions[f].name);
+    }
+    for (size_t i = 0; i < tr->const_count; ++i) {
+        a3b_put32(image + a3b_constants_offset(&h) + i * 4, (uint32_t) tr->consts[i]);
+    }
+    memcpy(image + a3b_code_offset(&h), h.packed_size > 0 ? packed : tr->code.data,
+           a3b_stored_code_size(&h));
+    free(packed);
+    uint8_t *debug = image + a3b_debug_offset(&h);
+    for (size_t l = 0; l < tr->label_count; ++l) {
+        size_t text_len = strlen(tr->labels[l].text);
+        if (text_len > 255) text_len = 255;
+        a3b_put16(debug, (uint16_t) tr->labels[l].start_offset);
+        debug[2] = (uint8_t) text_len;
+        memcpy(debug + 3, tr->labels[l].text, text_len);
+        debug += 3 + text_len;
+    }
+    a3b_put32(image + total - 4, a3b_crc32_final(a3b_crc32_update(A3B_CRC_INIT, image, total - 4)));
+
+    FILE *out = fopen(path, "wb");
+    bool ok = out && fwrite(image, 1, total, out) == total;
+    if (out && fclose(out) != 0) ok = false;
+    free(image);
+    if (!ok) {
+        fprintf(stderr, "translator: unable to write %s\n", path);
+        return false;
+    }
+    if (h.packed_size > 0) {
+        fprintf(stderr, "translator: wrote %zu byte container to %s (code packed %zu -> %u bytes)\n",
+                total, path, tr->code.size, (unsigned) h.packed_size);
+    } else {
+        fprintf(stderr, "translator: wrote %zu byte container to %s\n", total, path);
+    }
+    return true;
+}
+
 bool translate_program(Node *root, const char *output_path) {
+    TranslatorOptions options = { NULL, false };
+    return translate_program_with_options(root, output_path, &options);
+}
+
+bool translate_program_with_options(Node *root, const char *output_path, const TranslatorOptions *options) {
     Translator tr;
     translator_init(&tr);
 
     bool ok = translate_root(&tr, root);
     if (ok && !tr.failed) {
         emit_instruction(&tr.code, OP_HALT, 0, 0);
-        FILE *out = fopen(output_path, "w");
-        if (!out) {
-            fprintf(stderr, "translator: unable to open %s for writing\n", output_path);
-            ok = false;
-        } else {
-            fprintf(out, "# A3VM instruction listing generated by translator\n");
-            fprintf(out, "# format: <mnemonic> <arg1> <arg2>\n");
-            size_t count = tr.code.size / 3;
-            for (size_t i = 0; i < count; ++i) {
-                for (size_t f = 0; f < tr.function_count; ++f) {
-                    if (tr.functions[f].start_index == i) {
-                        fprintf(out, "# FUNCTION %s\n", tr.functions[f].name);
-                    }
-                }
-                for (size_t l = 0; l < tr.label_count; ++l) {
-                    if (tr.labels[l].start_index == i) {
-                        fprintf(out, "# %s\n", tr.labels[l].text);
-                    }
-                }
-                size_t base = i * 3;
-                Opcode op = (Opcode) tr.code.data[base];
-                uint8_t arg1 = tr.code.data[base + 1];
-                uint8_t arg2 = tr.code.data[base + 2];
-                fprintf(out, "%-7s %3u %3u\n", opcode_name(op), arg1, arg2);
-            }
-            fclose(out);
-            fprintf(stderr, "translator: wrote %zu instructions to %s\n", count, output_path);
+        ok = write_listing(&tr, output_path);
+        if (ok) {
+            char *a3b_path = a3b_path_for(output_path);
+            ok = a3b_path && write_a3b(&tr, a3b_path, options->compress);
+            free(a3b_path);
+        }
+        if (ok && options->cpp_path) {
+            ok = write_cpp(&tr, options->cpp_path);
         }
     } else {
         ok = false;
@@ -5,8 +5,24 @@
 /*
  * Translates the given AST into a TinyVM instruction listing (human
  * readable text where each line contains the mnemonic and its two
- * operands). Returns true on success, false if the AST contains
- * constructs that are not supported by the current translator or if
- * any IO error happens. On failure a diagnostic is printed to stderr.
+ * operands). The same program is also written as an .a3b container (see
+ * vm/a3b.h) next to the listing, e.g. program.a3b for program.vmcode.
+ * Returns true on success, false if the AST contains constructs that are
+ * not supported by the current translator or if any IO error happens. On
+ * failure a diagnostic is printed to stderr.
  */
 bool translate_program(Node *root, const char *output_path);
+
+typedef struct {
+    /* C++ translation unit for the ahead-of-time path, or NULL: each
+     * function becomes a native C++ function built against vm/a3_aot.h, and
+     * builtins go through the same call_trap routines the interpreter uses. */
+    const char *cpp_path;
+    bool compress;          /* LZ-pack the .a3b code when that makes it smaller */
+} TranslatorOptions;
+
+/*
+ * translate_program with every output option; translate_program is the
+ * shorthand with all of them off.
+ */
+bool translate_program_with_options(Node *root, const char *output_path, const TranslatorOptions *options);
@@ -0,0 +1,54 @@
+#pragma once
+
+// Interface between TinyVM and programs compiled ahead of time with
+// `a3c --cpp <out.cpp> <source>`. The generated translation unit only
+// depends on this header: it runs on the registers, stack and heap the
+// context points at and reaches builtins through the callbacks, which the
+// firmware wires to TinyVM::call_trap (see TinyVM::runCompiled()).
+
+#include <stdint.h>
+#include <string.h>
+
+struct A3Context {
+    int32_t* registers;     // R0-R7, shared with the VM
+    int32_t* stack;         // data stack used by PUSH/POP
+    uint16_t* sp;
+    uint16_t* fp;           // current frame (ENTER/LEAVE/LDL/STL)
+    uint16_t* rsp;          // call depth; compiled calls keep no return addresses
+    uint8_t* heap;
+    size_t* heap_top;       // arena bump pointer in bytes (ALLOC/FREE)
+    uint16_t stack_size;
+    uint16_t heap_size;
+    uint16_t return_depth;  // CALL limit, TinyVM's ReturnDepth
+    bool running;           // cleared by HALT and runtime errors
+    int32_t cmp_lhs, cmp_rhs;   // operands of the last CMP, as in Flags
+    bool compared;              // false until the first CMP
+    void* user;
+    void (*trap)(void* user, uint8_t id);
+    void (*print)(void* user, int32_t value);
+    void (*fail)(void* user, const char* message);
+};
+
+// Stops the program the way the interpreter's error paths do
+#define A3_FAIL(c, message)             \
+    do {                                \
+        (c).fail((c).user, (message));  \
+        (c).running = false;            \
+        return;                         \
+    } while (0)
+
+// Word view of the heap used by LOADX/STOREX, matching TinyVM::loadWord()
+inline int32_t a3_load_word(const A3Context& c, uint32_t idx) {
+    int32_t value;
+    memcpy(&value, &c.heap[idx * 4], sizeof(value));
+    return value;
+}
+
+inline void a3_store_word(A3Context& c, uint32_t idx, int32_t value) {
+    memcpy(&c.heap[idx * 4], &value, sizeof(value));
+}
+
+// Defined by the generated translation unit
+void a3_main(A3Context& c);     // top-level code, what TinyVM::run() executes
+void a3_loop(A3Context& c);     // one call of loop(), what TinyVM::runLoop() executes
+extern const bool a3_has_loop;
@@ -0,0 +1,395 @@
+#pragma once
+
+/* .a3b program container, written by a3c next to program.vmcode and loaded
+ * by TinyVM without any text parsing. Shared by the translator (C) and the
+ * VM (C++), so it only uses C. All fields are little-endian.
+ *
+ *   offset  size  field
+ *        0     4  magic "A3B\x1A"
+ *        4     2  version (A3B_VERSION)
+ *        6     2  flags (A3B_FLAG_*)
+ *        8     2  setup entry: where run() starts
+ *       10     2  loop entry, A3B_NO_ENTRY without a loop function
+ *       12     2  function count
+ *       14     2  constant count
+ *       16     2  code size in bytes
+ *       18     2  packed code size, 0 unless A3B_FLAG_COMPRESSED
+ *       20     4  debug map size in bytes
+ *
+ * The header is followed by the function table (A3B_FUNCTION_SIZE bytes
+ * per function: start, length, NUL-padded name), the constant pool (one
+ * int32 per constant), the bytecode and the debug map, then a CRC-32 of
+ * everything before it. Every section starts 4-byte aligned, so a mapped
+ * container can be executed in place. The debug map holds the listing's
+ * labels as (offset:2, length:1, text) records; the VM skips it.
+ *
+ * A compressed container (a3c --compress) stores the bytecode LZ-packed
+ * (see a3b_lz_compress()) and has to be inflated before it runs. Uncompressed
+ * containers are unchanged: the packed size is zero.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define A3B_MAGIC           "A3B\x1A"
+#define A3B_VERSION         1
+#define A3B_FLAG_HAS_LOOP   0x0001
+#define A3B_FLAG_CONST_POOL 0x0002
+#define A3B_FLAG_DEBUG_MAP  0x0004
+#define A3B_FLAG_COMPRESSED 0x0008
+#define A3B_NO_ENTRY        0xFFFF
+#define A3B_HEADER_SIZE     24
+#define A3B_FUNCTION_SIZE   16
+#define A3B_NAME_SIZE       12      /* longer function names are truncated */
+#define A3B_MAX_CONSTS      256     /* LOADK indexes the pool with 8 bits */
+#define A3B_CRC_INIT        0xFFFFFFFFu
+#define A3B_LZ_WINDOW       256     /* bytes an inflater keeps */
+#define A3B_LZ_MIN_MATCH    3
+#define A3B_LZ_MAX_MATCH    258
+
+typedef struct {
+    uint16_t version;
+    uint16_t flags;
+    uint16_t setup_entry;
+    uint16_t loop_entry;
+    uint16_t function_count;
+    uint16_t const_count;
+    uint16_t code_size;
+    uint16_t packed_size;
+    uint32_t debug_size;
+} A3bHeader;
+
+/* A container checked by a3b_parse(); pointers refer into its bytes */
+typedef struct {
+    A3bHeader header;
+    const uint8_t *functions;
+    const uint8_t *constants;
+    const uint8_t *code;
+    const uint8_t *debug;
+} A3bImage;
+
+static inline uint16_t a3b_get16(const uint8_t *p) {
+    return (uint16_t) (p[0] | (p[1] << 8));
+}
+
+static inline uint32_t a3b_get32(const uint8_t *p) {
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static inline void a3b_put16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t) v;
+    p[1] = (uint8_t) (v >> 8);
+}
+
+static inline void a3b_put32(uint8_t *p, uint32_t v) {
+    a3b_put16(p, (uint16_t) v);
+    a3b_put16(p + 2, (uint16_t) (v >> 16));
+}
+
+/* Bitwise CRC-32 (IEEE), no table. Start from A3B_CRC_INIT, feed the data
+ * in any number of pieces and finish with a3b_crc32_final(). */
+static inline uint32_t a3b_crc32_update(uint32_t crc, const uint8_t *data, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1u)));
+        }
+    }
+    return crc;
+}
+
+static inline uint32_t a3b_crc32_final(uint32_t crc) {
+    return ~crc;
+}
+
+static inline void a3b_write_header(uint8_t *out, const A3bHeader *h) {
+    memcpy(out, A3B_MAGIC, 4);
+    a3b_put16(out + 4, h->version);
+    a3b_put16(out + 6, h->flags);
+    a3b_put16(out + 8, h->setup_entry);
+    a3b_put16(out + 10, h->loop_entry);
+    a3b_put16(out + 12, h->function_count);
+    a3b_put16(out + 14, h->const_count);
+    a3b_put16(out + 16, h->code_size);
+    a3b_put16(out + 18, h->packed_size);
+    a3b_put32(out + 20, h->debug_size);
+}
+
+/* Decodes a header. Returns NULL or the reason it was rejected. */
+static inline const char *a3b_read_header(const uint8_t *in, A3bHeader *h) {
+    if (memcmp(in, A3B_MAGIC, 4) != 0) return "bad magic";
+    h->version = a3b_get16(in + 4);
+    h->flags = a3b_get16(in + 6);
+    h->setup_entry = a3b_get16(in + 8);
+    h->loop_entry = a3b_get16(in + 10);
+    h->function_count = a3b_get16(in + 12);
+    h->const_count = a3b_get16(in + 14);
+    h->code_size = a3b_get16(in + 16);
+    h->packed_size = a3b_get16(in + 18);
+    h->debug_size = a3b_get32(in + 20);
+    if (h->version != A3B_VERSION) return "unsupported version";
+    if (h->code_size == 0) return "code size out of range";
+    if (((h->flags & A3B_FLAG_COMPRESSED) != 0) != (h->packed_size != 0)) return "bad packed size";
+    if (h->const_count > A3B_MAX_CONSTS) return "too many constants";
+    if (h->setup_entry >= h->code_size) return "setup entry outside the code";
+    if ((h->flags & A3B_FLAG_HAS_LOOP) ? h->loop_entry >= h->code_size
+                                       : h->loop_entry != A3B_NO_ENTRY) {
+        return "bad loop entry";
+    }
+    return NULL;
+}
+
+/* Section offsets within the container; the function table starts right
+ * after the header */
+static inline uint32_t a3b_constants_offset(const A3bHeader *h) {
+    return A3B_HEADER_SIZE + (uint32_t) h->function_count * A3B_FUNCTION_SIZE;
+}
+
+static inline uint32_t a3b_code_offset(const A3bHeader *h) {
+    return a3b_constants_offset(h) + (uint32_t) h->const_count * 4;
+}
+
+/* Bytes the code section takes in the file */
+static inline uint32_t a3b_stored_code_size(const A3bHeader *h) {
+    return h->packed_size != 0 ? h->packed_size : h->code_size;
+}
+
+static inline uint32_t a3b_debug_offset(const A3bHeader *h) {
+    return a3b_code_offset(h) + ((a3b_stored_code_size(h) + 3) & ~3u);
+}
+
+/* Total size including the trailing CRC */
+static inline uint32_t a3b_total_size(const A3bHeader *h) {
+    return a3b_debug_offset(h) + ((h->debug_size + 3) & ~3u) + 4;
+}
+
+static inline void a3b_write_function(uint8_t *out, uint16_t start, uint16_t length, const char *name) {
+    a3b_put16(out, start);
+    a3b_put16(out + 2, length);
+    memset(out + 4, 0, A3B_NAME_SIZE);
+    size_t n = strlen(name);
+    memcpy(out + 4, name, n < A3B_NAME_SIZE ? n : A3B_NAME_SIZE);
+}
+
+/* Checks a whole container in memory: header, sizes and CRC. Returns NULL
+ * and fills image, or the reason it was rejected. */
+static inline const char *a3b_parse(const uint8_t *data, size_t size, A3bImage *image) {
+    if (size < A3B_HEADER_SIZE + 4) return "truncated header";
+    const char *error = a3b_read_header(data, &image->header);
+    if (error) return error;
+    const A3bHeader *h = &image->header;
+    if (a3b_total_size(h) != size) return "size does not match the header";
+    uint32_t crc = a3b_crc32_final(a3b_crc32_update(A3B_CRC_INIT, data, size - 4));
+    if (crc != a3b_get32(data + size - 4)) return "CRC mismatch";
+    image->functions = data + A3B_HEADER_SIZE;
+    image->constants = data + a3b_constants_offset(h);
+    image->code = data + a3b_code_offset(h);
+    image->debug = data + a3b_debug_offset(h);
+    return NULL;
+}
+
+/* LZ code compression. The packed stream is groups of one flag byte and up
+ * to eight items, lowest bit first: a 0 bit is a literal byte, a 1 bit a
+ * match of two bytes (distance - 1, length - A3B_LZ_MIN_MATCH) copying
+ * bytes already produced at most A3B_LZ_WINDOW back. A decoder only keeps
+ * that window, so code can be inflated as it streams in. */
+
+/* Packs n bytes into out (cap bytes). Returns the packed size, or 0 when
+ * it would not be smaller than the input. */
+static inline size_t a3b_lz_compress(const uint8_t *in, size_t n, uint8_t *out, size_t cap) {
+    size_t i = 0, o = 0;
+    if (cap >= n) cap = n > 0 ? n - 1 : 0;
+    while (i < n) {
+        if (o >= cap) return 0;
+        size_t flag_at = o++;
+        uint8_t flags = 0;
+        for (int bit = 0; bit < 8 && i < n; ++bit) {
+            size_t best = 0, best_dist = 0;
+            size_t max_dist = i < A3B_LZ_WINDOW ? i : A3B_LZ_WINDOW;
+            for (size_t d = 1; d <= max_dist && best < A3B_LZ_MAX_MATCH; ++d) {
+                size_t len = 0;
+                while (len < A3B_LZ_MAX_MATCH && i + len < n && in[i + len - d] == in[i + len]) ++len;
+                if (len > best) {
+                    best = len;
+                    best_dist = d;
+                }
+            }
+            if (best >= A3B_LZ_MIN_MATCH) {
+                if (o + 2 > cap) return 0;
+                flags |= (uint8_t) (1u << bit);
+                out[o++] = (uint8_t) (best_dist - 1);
+                out[o++] = (uint8_t) (best - A3B_LZ_MIN_MATCH);
+                i += best;
+            } else {
+                if (o + 1 > cap) return 0;
+                out[o++] = in[i++];
+            }
+        }
+        out[flag_at] = flags;
+    }
+    return o;
+}
+
+/* Receives output byte b at offset at; returns 0 to stop */
+typedef int (*a3b_emit_fn)(void *user, uint32_t at, uint8_t b);
+
+/* Streaming inflater: feed it packed bytes in pieces of any size */
+typedef struct {
+    uint8_t window[A3B_LZ_WINDOW];
+    uint32_t out;           /* bytes produced */
+    uint16_t flags;         /* unread flag bits above a sentinel 1 bit */
+    uint8_t dist;           /* match distance waiting for its length byte */
+    uint8_t in_match;
+} A3bInflate;
+
+static inline void a3b_inflate_init(A3bInflate *z) {
+    z->out = 0;
+    z->flags = 1;
+    z->dist = 0;
+    z->in_match = 0;
+}
+
+static inline const char *a3b_inflate_put(A3bInflate *z, uint8_t b, uint32_t limit,
+                                          a3b_emit_fn emit, void *user) {
+    if (z->out >= limit) return "packed code too long";
+    z->window[z->out % A3B_LZ_WINDOW] = b;
+    if (!emit(user, z->out, b)) return "output rejected";
+    z->out++;
+    return NULL;
+}
+
+/* Inflates n packed bytes, handing each output byte to emit. Output past
+ * limit and matches before the start are errors. Returns NULL or the
+ * reason. */
+static inline const char *a3b_inflate(A3bInflate *z, const uint8_t *in, size_t n, uint32_t limit,
+                                      a3b_emit_fn emit, void *user) {
+    const char *error = NULL;
+    for (size_t i = 0; i < n && error == NULL; ++i) {
+        uint8_t b = in[i];
+        if (z->in_match) {
+            uint32_t dist = z->dist + 1u;
+            if (dist > z->out) return "match before the start";
+            for (size_t len = b + A3B_LZ_MIN_MATCH; len > 0 && error == NULL; --len) {
+                error = a3b_inflate_put(z, z->window[(z->out - dist) % A3B_LZ_WINDOW], limit, emit, user);
+            }
+            z->in_match = 0;
+        } else if (z->flags == 1) {
+            z->flags = (uint16_t) (b | 0x100);
+        } else {
+            int match = z->flags & 1;
+            z->flags >>= 1;
+            if (match) {
+                z->dist = b;
+                z->in_match = 1;
+            } else {
+                error = a3b_inflate_put(z, b, limit, emit, user);
+            }
+        }
+    }
+    return error;
+}
+
+typedef struct {
+    uint8_t *data;
+    size_t capacity;
+} A3bBuffer;
+
+static inline int a3b_emit_to_buffer(void *user, uint32_t at, uint8_t b) {
+    A3bBuffer *buffer = (A3bBuffer *) user;
+    if (at >= buffer->capacity) return 0;
+    buffer->data[at] = b;
+    return 1;
+}
+
+/* Inflates the code of a parsed compressed container into out */
+static inline const char *a3b_unpack(const A3bImage *image, uint8_t *out, size_t capacity) {
+    const A3bHeader *h = &image->header;
+    if (capacity < h->code_size) return "code does not fit the unpack buffer";
+    A3bBuffer buffer = { out, capacity };
+    A3bInflate z;
+    a3b_inflate_init(&z);
+    const char *error = a3b_inflate(&z, image->code, h->packed_size, h->code_size,
+                                    a3b_emit_to_buffer, &buffer);
+    if (error == NULL && (z.out != h->code_size || z.in_match)) error = "packed code truncated";
+    return error;
+}
+
+/* Reads up to len bytes of a container in order; returns 0 on failure */
+typedef int (*a3b_read_fn)(void *user, uint8_t *dst, uint16_t len);
+
+/* Sequential container reader for files too slow or large to map, e.g. on
+ * SD: it checks the CRC on the way and needs only a small chunk buffer
+ * (plus the inflater window for compressed code). */
+typedef struct {
+    a3b_read_fn read;
+    void *user;
+    uint32_t crc;
+    A3bHeader header;
+} A3bStream;
+
+/* Reads n bytes into dst, or skips them when dst is NULL */
+static inline int a3b_stream_read(A3bStream *s, uint8_t *dst, uint32_t n) {
+    uint8_t chunk[64];
+    while (n > 0) {
+        uint16_t len = n < sizeof(chunk) ? (uint16_t) n : (uint16_t) sizeof(chunk);
+        uint8_t *to = dst != NULL ? dst : chunk;
+        if (!s->read(s->user, to, len)) return 0;
+        s->crc = a3b_crc32_update(s->crc, to, len);
+        if (dst != NULL) dst += len;
+        n -= len;
+    }
+    return 1;
+}
+
+/* Reads and checks the header into s->header */
+static inline const char *a3b_stream_begin(A3bStream *s, a3b_read_fn read, void *user) {
+    uint8_t head[A3B_HEADER_SIZE];
+    s->read = read;
+    s->user = user;
+    if (!read(user, head, sizeof(head))) return "truncated header";
+    s->crc = a3b_crc32_update(A3B_CRC_INIT, head, sizeof(head));
+    return a3b_read_header(head, &s->header);
+}
+
+/* Reads the rest of the container. The function table goes to functions
+ * and the constants to pool (each skipped when NULL), and the code,
+ * inflated if packed, to emit one byte at a time (only checked when emit
+ * is NULL). The CRC is checked last. */
+static inline const char *a3b_stream_body(A3bStream *s, uint8_t *functions, uint8_t *pool,
+                                          a3b_emit_fn emit, void *user) {
+    const A3bHeader *h = &s->header;
+    uint32_t stored = a3b_stored_code_size(h);
+    uint32_t tail = a3b_total_size(h) - 4 - a3b_code_offset(h) - stored;
+    /* The debug map only counts towards the CRC here */
+    if (!a3b_stream_read(s, functions, a3b_constants_offset(h) - A3B_HEADER_SIZE) ||
+        !a3b_stream_read(s, pool, (uint32_t) h->const_count * 4)) {
+        return "truncated container";
+    }
+    if (emit == NULL) {
+        if (!a3b_stream_read(s, NULL, stored)) return "truncated container";
+    } else {
+        A3bInflate z;
+        a3b_inflate_init(&z);
+        uint8_t chunk[64];
+        for (uint32_t at = 0; at < stored; ) {
+            uint16_t len = stored - at < sizeof(chunk) ? (uint16_t) (stored - at) : (uint16_t) sizeof(chunk);
+            if (!a3b_stream_read(s, chunk, len)) return "truncated container";
+            if (h->packed_size != 0) {
+                const char *error = a3b_inflate(&z, chunk, len, h->code_size, emit, user);
+                if (error != NULL) return error;
+            } else {
+                for (uint16_t i = 0; i < len; ++i) {
+                    if (!emit(user, at + i, chunk[i])) return "output rejected";
+                }
+            }
+            at += len;
+        }
+        if (h->packed_size != 0 && (z.out != h->code_size || z.in_match)) return "packed code truncated";
+    }
+    if (!a3b_stream_read(s, NULL, tail)) return "truncated container";
+    uint8_t stored_crc[4];
+    if (!s->read(s->user, stored_crc, 4)) return "truncated container";
+    if (a3b_get32(stored_crc) != a3b_crc32_final(s->crc)) return "CRC mismatch";
+    return NULL;
+}
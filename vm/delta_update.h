@@ -0,0 +1,416 @@
+#pragma once
+
+// Function-level program updates over a serial line, shared by the firmware
+// and the host tools. vm_complete.ino includes it after TinyVM, whose
+// opcodes it relocates. The uploader (vm/test/a3_upload) first asks for the
+// hashes of the functions the board is running, then sends only what
+// changed; functions it already has are copied from the running program
+// and relocated. DeltaReceiver builds the new program in caller-owned
+// buffers, so the old one keeps running until it is swapped in.
+//
+// One command per line. Every command is answered by one "OK ..." or
+// "ERR <reason>" line before the next is sent, which keeps the board's
+// receive buffer from overflowing; anything else the board prints is
+// ignored by the uploader.
+//
+//   HASHES                      "FN <index> <start> <length> <hash> <name>"
+//                               per running function, then "OK <code size>"
+//   BEGIN <size> <setup> <loop> <functions> <constants> <crc>
+//                               starts a program: header fields as in .a3b
+//                               (loop 65535 for none) and the CRC-32 of
+//                               header, function table, pool and code
+//                               (see deltaProgramCrc)
+//   FN <index> <start> <length> <name>
+//                               function table entries, in order
+//   CONST <index> <value>       constant pool entry
+//   COPY <index> <old index>    copies a running function into new entry
+//                               <index>, relocating its code targets
+//   DATA <offset> <hex>         literal code bytes
+//   COMMIT                      checks the crc and hands the program over
+//
+// The receiver keeps the buffers it had at BEGIN until the upload ends, and
+// busy() tells the firmware not to touch them (or the running program) in
+// the meantime.
+//
+// Function hashes are position independent: a code target inside the
+// function counts by its offset from the start and a target at another
+// function's start (a CALL) by that function's name. A function that only
+// moved, or whose callees moved, can be copied instead of resent.
+
+#include "a3b.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define DELTA_LINE_MAX 128
+#define DELTA_DATA_MAX 48       // bytes per DATA line, 96 hex digits
+
+// A program and its function table, raw A3B_FUNCTION_SIZE entries as in a
+// container
+struct DeltaProgram {
+    const uint8_t* code;
+    uint32_t size;
+    const uint8_t* functions;
+    uint16_t functionCount;
+};
+
+// Offset of the 16-bit code target in an instruction, 0 if it has none
+inline uint8_t deltaTargetOffset(uint8_t op) {
+    if (op >= JMP && op <= CALL) return 1;
+    if (op >= BEQ && op <= BGE) return 3;
+    return 0;
+}
+
+inline int deltaFunctionAt(const uint8_t* functions, uint16_t count, uint32_t start) {
+    for (uint16_t i = 0; i < count; i++) {
+        if (a3b_get16(functions + i * A3B_FUNCTION_SIZE) == start) return i;
+    }
+    return -1;
+}
+
+inline int deltaFunctionNamed(const uint8_t* functions, uint16_t count, const uint8_t* name) {
+    for (uint16_t i = 0; i < count; i++) {
+        if (memcmp(functions + i * A3B_FUNCTION_SIZE + 4, name, A3B_NAME_SIZE) == 0) return i;
+    }
+    return -1;
+}
+
+inline void deltaMix(uint32_t& hash, uint8_t b) {
+    hash = (hash ^ b) * 16777619u;
+}
+
+inline void deltaMix16(uint32_t& hash, char tag, uint32_t v) {
+    deltaMix(hash, (uint8_t)tag);
+    deltaMix(hash, (uint8_t)v);
+    deltaMix(hash, (uint8_t)(v >> 8));
+}
+
+// FNV-1a over the function's instructions with their code targets
+// normalized; 0 if the entry lies outside the code
+inline uint32_t deltaFunctionHash(const DeltaProgram& p, uint16_t index) {
+    const uint8_t* entry = p.functions + index * A3B_FUNCTION_SIZE;
+    uint32_t start = a3b_get16(entry), length = a3b_get16(entry + 2);
+    if (start + length > p.size) return 0;
+    uint32_t hash = 2166136261u;
+    deltaMix16(hash, 'N', length);
+    for (uint32_t at = 0; at < length; ) {
+        const uint8_t* ins = p.code + start + at;
+        uint32_t len = TinyVM::instructionLength(ins[0]);
+        uint8_t t = deltaTargetOffset(ins[0]);
+        if (at + len > length) {
+            // Truncated last instruction: hashed as plain bytes
+            len = length - at;
+            t = 0;
+        }
+        for (uint32_t i = 0; i < len; i++) {
+            if (t == 0 || i < t || i > t + 1u) deltaMix(hash, ins[i]);
+        }
+        if (t != 0) {
+            uint32_t target = a3b_get16(ins + t);
+            int callee = deltaFunctionAt(p.functions, p.functionCount, target);
+            if (target >= start && target < start + length) {
+                deltaMix16(hash, 'L', target - start);
+            } else if (callee >= 0) {
+                deltaMix(hash, 'F');
+                for (int i = 0; i < A3B_NAME_SIZE; i++) deltaMix(hash, p.functions[callee * A3B_FUNCTION_SIZE + 4 + i]);
+            } else {
+                deltaMix16(hash, 'A', target);
+            }
+        }
+        at += len;
+    }
+    return hash;
+}
+
+// Header of an uploaded program, built the same way on both ends
+inline A3bHeader deltaHeader(uint32_t size, uint32_t setup, uint32_t loop, uint32_t functions,
+                             uint32_t constants) {
+    A3bHeader h = A3bHeader();
+    h.version = A3B_VERSION;
+    h.flags = (loop != A3B_NO_ENTRY ? A3B_FLAG_HAS_LOOP : 0) | (constants > 0 ? A3B_FLAG_CONST_POOL : 0);
+    h.setup_entry = (uint16_t)setup;
+    h.loop_entry = (uint16_t)loop;
+    h.function_count = (uint16_t)functions;
+    h.const_count = (uint16_t)constants;
+    h.code_size = (uint16_t)size;
+    return h;
+}
+
+// CRC-32 announced by BEGIN: the encoded header, function table, constant
+// pool and code, the sections a container's CRC covers (without padding)
+inline uint32_t deltaProgramCrc(const A3bHeader& h, const uint8_t* functions, const uint8_t* pool,
+                                const uint8_t* code) {
+    uint8_t head[A3B_HEADER_SIZE];
+    a3b_write_header(head, &h);
+    uint32_t crc = a3b_crc32_update(A3B_CRC_INIT, head, sizeof(head));
+    crc = a3b_crc32_update(crc, functions, (size_t)h.function_count * A3B_FUNCTION_SIZE);
+    crc = a3b_crc32_update(crc, pool, (size_t)h.const_count * 4);
+    crc = a3b_crc32_update(crc, code, h.code_size);
+    return a3b_crc32_final(crc);
+}
+
+struct DeltaReceiver {
+    // Sends one reply line (without the newline)
+    typedef void (*ReplyFn)(void* user, const char* line);
+    // Takes over a complete, CRC-checked program; returns NULL or the
+    // reason it was refused (e.g. by the verifier)
+    typedef const char* (*CommitFn)(void* user, const A3bHeader& header);
+
+    A3bHeader header;           // of the upload in progress or just committed
+    uint16_t copied = 0;        // functions copied by the last upload
+    uint32_t sent = 0;          // code bytes it sent as DATA
+
+    void begin(ReplyFn replyFn, CommitFn commitFn, void* callbackUser) {
+        reply = replyFn;
+        commit = commitFn;
+        user = callbackUser;
+        pending = 0;
+        active = false;
+    }
+
+    // Between BEGIN and the end of the upload
+    bool busy() const {
+        return active;
+    }
+
+    // The running program, copied from by COPY; code == NULL when it cannot
+    // be read (e.g. paged from SD), which makes HASHES report no functions.
+    // Ignored while busy(): an upload copies from the program it began on.
+    void setCurrent(const DeltaProgram& program) {
+        if (active) return;
+        current = program;
+    }
+
+    // Buffers the next program is built in: code, its function table and a
+    // pool of A3B_MAX_CONSTS constants. Ignored while busy().
+    void setTarget(uint8_t* code, uint32_t capacity, uint8_t* functions, uint16_t functionCapacity,
+                   uint8_t* pool) {
+        if (active) return;
+        target = code;
+        targetCapacity = capacity;
+        targetFunctions = functions;
+        targetFunctionCapacity = functionCapacity;
+        targetPool = pool;
+    }
+
+    // Feeds received bytes; complete lines are run as they arrive
+    void feed(const char* text, size_t len) {
+        for (size_t i = 0; i < len; i++) {
+            char c = text[i];
+            if (c == '\r') continue;
+            if (c != '\n') {
+                if (pending < DELTA_LINE_MAX) line[pending] = c;
+                pending++;
+                continue;
+            }
+            if (pending > DELTA_LINE_MAX) {
+                fail("line too long");
+            } else {
+                line[pending] = '\0';
+                run(line);
+            }
+            pending = 0;
+        }
+    }
+
+private:
+    ReplyFn reply = nullptr;
+    CommitFn commit = nullptr;
+    void* user = nullptr;
+    DeltaProgram current = { nullptr, 0, nullptr, 0 };
+    uint8_t* target = nullptr;
+    uint32_t targetCapacity = 0;
+    uint8_t* targetFunctions = nullptr;
+    uint16_t targetFunctionCapacity = 0;
+    uint8_t* targetPool = nullptr;
+    char line[DELTA_LINE_MAX + 1];
+    size_t pending = 0;
+    bool active = false;        // between BEGIN and COMMIT
+    uint16_t defined = 0;       // FN entries received
+    uint32_t crc = 0;
+
+    // A failed command ends the upload; the uploader starts over
+    void fail(const char* reason) {
+        char out[DELTA_LINE_MAX];
+        snprintf(out, sizeof(out), "ERR %s", reason);
+        active = false;
+        reply(user, out);
+    }
+
+    void ok() {
+        reply(user, "OK");
+    }
+
+    // Splits the next blank-separated word off p
+    static char* token(char*& p) {
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '\0') return nullptr;
+        char* start = p;
+        while (*p != '\0' && *p != ' ' && *p != '\t') p++;
+        if (*p != '\0') *p++ = '\0';
+        return start;
+    }
+
+    static bool number(char*& p, uint32_t max, uint32_t& value, int base = 10) {
+        char* word = token(p);
+        if (word == nullptr) return false;
+        char* end;
+        unsigned long v = strtoul(word, &end, base);
+        if (*end != '\0' || v > max) return false;
+        value = (uint32_t)v;
+        return true;
+    }
+
+    void run(char* p) {
+        char* command = token(p);
+        if (command == nullptr) return;
+        if (strcmp(command, "HASHES") == 0) {
+            hashes();
+        } else if (strcmp(command, "BEGIN") == 0) {
+            beginUpload(p);
+        } else if (!active) {
+            fail("no upload in progress");
+        } else if (strcmp(command, "FN") == 0) {
+            function(p);
+        } else if (strcmp(command, "CONST") == 0) {
+            constant(p);
+        } else if (strcmp(command, "COPY") == 0) {
+            copy(p);
+        } else if (strcmp(command, "DATA") == 0) {
+            data(p);
+        } else if (strcmp(command, "COMMIT") == 0) {
+            finish();
+        } else {
+            fail("unknown command");
+        }
+    }
+
+    void hashes() {
+        char out[DELTA_LINE_MAX];
+        uint16_t count = current.code != nullptr ? current.functionCount : 0;
+        for (uint16_t i = 0; i < count; i++) {
+            const uint8_t* entry = current.functions + i * A3B_FUNCTION_SIZE;
+            char name[A3B_NAME_SIZE + 1];
+            memcpy(name, entry + 4, A3B_NAME_SIZE);
+            name[A3B_NAME_SIZE] = '\0';
+            snprintf(out, sizeof(out), "FN %u %u %u %08lx %s", (unsigned)i, (unsigned)a3b_get16(entry),
+                     (unsigned)a3b_get16(entry + 2), (unsigned long)deltaFunctionHash(current, i), name);
+            reply(user, out);
+        }
+        snprintf(out, sizeof(out), "OK %lu", (unsigned long)(current.code != nullptr ? current.size : 0));
+        reply(user, out);
+    }
+
+    void beginUpload(char* p) {
+        uint32_t size, setup, loop, functions, constants;
+        active = false;
+        if (!number(p, 0xFFFF, size) || !number(p, 0xFFFF, setup) || !number(p, 0xFFFF, loop) ||
+            !number(p, 0xFFFF, functions) || !number(p, A3B_MAX_CONSTS, constants) ||
+            !number(p, 0xFFFFFFFFu, crc, 16)) {
+            return fail("malformed BEGIN");
+        }
+        if (target == nullptr || size == 0 || size > targetCapacity) return fail("program too large");
+        if (functions > targetFunctionCapacity) return fail("too many functions");
+        if (setup >= size || (loop != A3B_NO_ENTRY && loop >= size)) return fail("entry outside the code");
+        header = deltaHeader(size, setup, loop, functions, constants);
+        memset(targetPool, 0, constants * 4);
+        defined = 0;
+        copied = 0;
+        sent = 0;
+        active = true;
+        ok();
+    }
+
+    void function(char* p) {
+        uint32_t index, start, length;
+        char* name;
+        if (!number(p, 0xFFFF, index) || !number(p, 0xFFFF, start) || !number(p, 0xFFFF, length) ||
+            (name = token(p)) == nullptr) {
+            return fail("malformed FN");
+        }
+        if (index != defined || index >= header.function_count) return fail("function out of order");
+        if (start + length > header.code_size) return fail("function outside the code");
+        a3b_write_function(targetFunctions + index * A3B_FUNCTION_SIZE, (uint16_t)start, (uint16_t)length, name);
+        defined++;
+        ok();
+    }
+
+    void constant(char* p) {
+        uint32_t index;
+        char* value = nullptr;
+        char* end = nullptr;
+        if (number(p, 0xFFFF, index)) value = token(p);
+        long v = value != nullptr ? strtol(value, &end, 10) : 0;
+        if (value == nullptr || *end != '\0') return fail("malformed CONST");
+        if (index >= header.const_count) return fail("constant index out of range");
+        a3b_put32(targetPool + index * 4, (uint32_t)v);
+        ok();
+    }
+
+    void copy(char* p) {
+        uint32_t index, old;
+        if (!number(p, 0xFFFF, index) || !number(p, 0xFFFF, old)) return fail("malformed COPY");
+        if (index >= defined) return fail("COPY before its FN");
+        if (current.code == nullptr || old >= current.functionCount) return fail("no such running function");
+        const uint8_t* from = current.functions + old * A3B_FUNCTION_SIZE;
+        const uint8_t* to = targetFunctions + index * A3B_FUNCTION_SIZE;
+        uint32_t oldStart = a3b_get16(from), length = a3b_get16(from + 2), start = a3b_get16(to);
+        if (length != a3b_get16(to + 2) || oldStart + length > current.size) return fail("function size differs");
+
+        uint8_t* code = target + start;
+        memcpy(code, current.code + oldStart, length);
+        for (uint32_t at = 0; at < length; at += TinyVM::instructionLength(code[at])) {
+            uint8_t t = deltaTargetOffset(code[at]);
+            if (at + TinyVM::instructionLength(code[at]) > length) return fail("function ends mid-instruction");
+            if (t == 0) continue;
+            uint32_t addr = a3b_get16(code + at + t);
+            int callee = deltaFunctionAt(current.functions, current.functionCount, addr);
+            if (addr >= oldStart && addr < oldStart + length) {
+                addr = addr - oldStart + start;
+            } else if (callee >= 0) {
+                int moved = deltaFunctionNamed(targetFunctions, defined,
+                                               current.functions + callee * A3B_FUNCTION_SIZE + 4);
+                if (moved < 0) return fail("called function is gone");
+                addr = a3b_get16(targetFunctions + moved * A3B_FUNCTION_SIZE);
+            }
+            a3b_put16(code + at + t, (uint16_t)addr);
+        }
+        copied++;
+        ok();
+    }
+
+    static int hexDigit(char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+
+    void data(char* p) {
+        uint32_t offset;
+        char* hex = nullptr;
+        if (number(p, 0xFFFF, offset)) hex = token(p);
+        size_t digits = hex != nullptr ? strlen(hex) : 0;
+        if (hex == nullptr || digits % 2 != 0) return fail("malformed DATA");
+        if (offset + digits / 2 > header.code_size) return fail("DATA outside the code");
+        for (size_t i = 0; i < digits; i += 2) {
+            int hi = hexDigit(hex[i]), lo = hexDigit(hex[i + 1]);
+            if (hi < 0 || lo < 0) return fail("malformed DATA");
+            target[offset + i / 2] = (uint8_t)(hi << 4 | lo);
+        }
+        sent += digits / 2;
+        ok();
+    }
+
+    void finish() {
+        active = false;
+        if (defined != header.function_count) return fail("missing FN entries");
+        if (deltaProgramCrc(header, targetFunctions, targetPool, target) != crc) {
+            return fail("CRC mismatch");
+        }
+        const char* error = commit(user, header);
+        if (error != nullptr) return fail(error);
+        char out[DELTA_LINE_MAX];
+        snprintf(out, sizeof(out), "OK %u copied, %lu bytes sent", (unsigned)copied, (unsigned long)sent);
+        reply(user, out);
+    }
+};
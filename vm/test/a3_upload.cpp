@@ -0,0 +1,122 @@
+#define UNIT_TESTING
+#include "mock_arduino.h"
+#include "../vm_complete.ino"
+#include "mapped_image.h"
+#include "delta_upload.h"
+#include <iostream>
+#include <poll.h>
+#include <termios.h>
+
+MockSerial Serial;
+
+// Sends an .a3b program to a board over its serial port (see
+// delta_update.h). Only the functions the board is not already running
+// cross the wire; the board swaps the program in at its next loop()
+// boundary and saves it to SD. With "-" as the port the protocol runs over
+// stdin/stdout, e.g. through pipes to `vm_runner --serial`.
+
+static const int REPLY_TIMEOUT_MS = 5000;
+
+static int in_fd = 0;
+static int out_fd = 1;
+
+static bool send_line(const std::string& line) {
+    std::string out = line + "\n";
+    for (size_t done = 0; done < out.size(); ) {
+        ssize_t n = write(out_fd, out.data() + done, out.size() - done);
+        if (n <= 0) return false;
+        done += (size_t)n;
+    }
+    return true;
+}
+
+static bool read_line(std::string& line) {
+    line.clear();
+    for (;;) {
+        struct pollfd p = { in_fd, POLLIN, 0 };
+        if (poll(&p, 1, REPLY_TIMEOUT_MS) <= 0) return false;
+        char c;
+        if (read(in_fd, &c, 1) != 1) return false;
+        if (c == '\n') return true;
+        if (c != '\r') line += c;
+    }
+}
+
+// Reads up to the "OK"/"ERR" line that ends a reply, collecting the lines
+// that start with prefix; the board's own log lines are skipped
+static bool read_reply(std::string& status, const char* prefix = nullptr,
+                       std::vector<std::string>* lines = nullptr) {
+    std::string line;
+    while (read_line(line)) {
+        if (line == "OK" || line.compare(0, 3, "OK ") == 0 || line.compare(0, 4, "ERR ") == 0) {
+            status = line;
+            return true;
+        }
+        if (prefix != nullptr && line.compare(0, strlen(prefix), prefix) == 0) lines->push_back(line);
+    }
+    status = "ERR no reply";
+    return false;
+}
+
+static bool open_port(const char* port) {
+    if (strcmp(port, "-") == 0) return true;
+    int fd = open(port, O_RDWR | O_NOCTTY);
+    if (fd < 0) return false;
+    struct termios tio;
+    if (isatty(fd) && tcgetattr(fd, &tio) == 0) {
+        cfmakeraw(&tio);
+        cfsetspeed(&tio, B115200);
+        tcsetattr(fd, TCSANOW, &tio);
+    }
+    in_fd = out_fd = fd;
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 3) {
+        std::cerr << "Usage: " << argv[0] << " <program.a3b> <serial port | ->" << std::endl;
+        return 1;
+    }
+    MappedImage file;
+    A3bImage image;
+    const char* error = file.open(argv[1]) ? a3b_parse(file.data(), file.size(), &image) : "cannot open file";
+    std::vector<uint8_t> code;
+    if (error == nullptr) {
+        code.resize(image.header.code_size);
+        if (image.header.packed_size != 0) error = a3b_unpack(&image, code.data(), code.size());
+        else memcpy(code.data(), image.code, code.size());
+    }
+    if (error != nullptr) {
+        std::cerr << argv[1] << ": " << error << std::endl;
+        return 1;
+    }
+    if (!open_port(argv[2])) {
+        std::cerr << "Cannot open " << argv[2] << std::endl;
+        return 1;
+    }
+
+    std::string status;
+    std::vector<std::string> lines;
+    if (!send_line("HASHES") || !read_reply(status, "FN ", &lines) || status.compare(0, 2, "OK") != 0) {
+        std::cerr << "No answer to HASHES: " << status << std::endl;
+        return 1;
+    }
+    std::vector<RunningFunction> running;
+    for (const std::string& line : lines) {
+        RunningFunction f;
+        if (parse_running_function(line, f)) running.push_back(f);
+    }
+
+    const A3bHeader& h = image.header;
+    DeltaProgram next = { code.data(), h.code_size, image.functions, h.function_count };
+    UploadPlan plan = plan_upload(h, next, image.constants, running);
+    for (const std::string& command : plan.commands) {
+        if (!send_line(command) || !read_reply(status) || status.compare(0, 2, "OK") != 0) {
+            std::cerr << "Upload failed at \"" << command.substr(0, 24) << "\": " << status << std::endl;
+            return 1;
+        }
+    }
+    std::cerr << "a3_upload: " << h.function_count << " functions, " << plan.copied << " copied; sent "
+              << plan.sent << " of " << h.code_size << " code bytes (" << status << ")" << std::endl;
+    return 0;
+}
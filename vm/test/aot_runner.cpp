@@ -0,0 +1,25 @@
+#define UNIT_TESTING
+#define VM_AOT
+#include "mock_arduino.h"
+#include "../vm_complete.ino"
+#include <iostream>
+
+MockSerial Serial;
+
+// Host driver for programs compiled with `a3c --cpp`. It is linked with the
+// generated translation unit (see the Makefile "aot_runner" target) and
+// prints the registers in the same format as vm_runner so both paths can be
+// compared.
+
+int main() {
+    TinyVM vm;
+    vm.runAot();
+
+    std::cout << "Regs: ";
+    for (int i = 0; i < NUM_REGISTERS; ++i) {
+        std::cout << "R" << i << "=" << vm.registers[i];
+        if (i + 1 < NUM_REGISTERS) std::cout << ", ";
+    }
+    std::cout << std::endl;
+    return 0;
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+// Host side of delta_update.h: matches a new program's functions against
+// the hashes the board reports and writes the commands that send the rest.
+// Include after vm_complete.ino.
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// One "FN" line of the board's reply to HASHES
+struct RunningFunction {
+    unsigned index = 0;
+    unsigned start = 0;
+    unsigned length = 0;
+    uint32_t hash = 0;
+    std::string name;
+};
+
+inline bool parse_running_function(const std::string& line, RunningFunction& f) {
+    char name[A3B_NAME_SIZE + 1] = "";
+    unsigned long hash;
+    if (sscanf(line.c_str(), "FN %u %u %u %lx %12s", &f.index, &f.start, &f.length, &hash, name) < 4) {
+        return false;
+    }
+    f.hash = (uint32_t)hash;
+    f.name = name;
+    return true;
+}
+
+struct UploadPlan {
+    std::vector<std::string> commands;  // BEGIN ... COMMIT, one per line
+    unsigned copied = 0;                // functions the board copies
+    size_t sent = 0;                    // code bytes sent as DATA
+};
+
+inline std::string function_name(const uint8_t* entry) {
+    const char* name = reinterpret_cast<const char*>(entry + 4);
+    return std::string(name, strnlen(name, A3B_NAME_SIZE));
+}
+
+// Plans the upload of next (header h, constants pool) to a board running
+// the functions in running. A function is copied when the board has one of
+// the same length and hash, preferably of the same name; all other code,
+// including what lies outside the function table, is sent as DATA.
+inline UploadPlan plan_upload(const A3bHeader& h, const DeltaProgram& next, const uint8_t* pool,
+                              const std::vector<RunningFunction>& running) {
+    UploadPlan plan;
+    char line[DELTA_LINE_MAX + 1];
+    A3bHeader sent = deltaHeader(next.size, h.setup_entry, h.loop_entry, next.functionCount, h.const_count);
+    uint32_t crc = deltaProgramCrc(sent, next.functions, pool, next.code);
+    snprintf(line, sizeof(line), "BEGIN %u %u %u %u %u %08lx", (unsigned)next.size, (unsigned)h.setup_entry,
+             (unsigned)h.loop_entry, (unsigned)next.functionCount, (unsigned)h.const_count, (unsigned long)crc);
+    plan.commands.push_back(line);
+    for (uint16_t i = 0; i < next.functionCount; i++) {
+        const uint8_t* entry = next.functions + i * A3B_FUNCTION_SIZE;
+        snprintf(line, sizeof(line), "FN %u %u %u %s", (unsigned)i, (unsigned)a3b_get16(entry),
+                 (unsigned)a3b_get16(entry + 2), function_name(entry).c_str());
+        plan.commands.push_back(line);
+    }
+    for (uint16_t i = 0; i < h.const_count; i++) {
+        snprintf(line, sizeof(line), "CONST %u %ld", (unsigned)i, (long)(int32_t)a3b_get32(pool + i * 4));
+        plan.commands.push_back(line);
+    }
+
+    std::vector<bool> covered(next.size, false);
+    for (uint16_t i = 0; i < next.functionCount; i++) {
+        const uint8_t* entry = next.functions + i * A3B_FUNCTION_SIZE;
+        unsigned start = a3b_get16(entry), length = a3b_get16(entry + 2);
+        uint32_t hash = deltaFunctionHash(next, i);
+        const RunningFunction* match = nullptr;
+        for (const RunningFunction& f : running) {
+            if (hash == 0 || length == 0 || f.hash != hash || f.length != length) continue;
+            if (match == nullptr || f.name == function_name(entry)) match = &f;
+        }
+        if (match == nullptr) continue;
+        snprintf(line, sizeof(line), "COPY %u %u", (unsigned)i, match->index);
+        plan.commands.push_back(line);
+        std::fill(covered.begin() + start, covered.begin() + start + length, true);
+        plan.copied++;
+    }
+    for (uint32_t at = 0; at < next.size; ) {
+        if (covered[at]) {
+            at++;
+            continue;
+        }
+        uint32_t end = at;
+        while (end < next.size && !covered[end] && end - at < DELTA_DATA_MAX) end++;
+        int n = snprintf(line, sizeof(line), "DATA %u ", (unsigned)at);
+        for (uint32_t i = at; i < end; i++) n += snprintf(line + n, sizeof(line) - n, "%02x", next.code[i]);
+        plan.commands.push_back(line);
+        plan.sent += end - at;
+        at = end;
+    }
+    plan.commands.push_back("COMMIT");
+    return plan;
+}
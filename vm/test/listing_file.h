@@ -0,0 +1,77 @@
+#pragma once
+
+// Host side of VmcodeLoader: maps a listing and assembles it in one pass.
+// A listing never assembles to more bytes than it has characters, so the
+// output is sized once from the file and nothing is allocated per line.
+// Include after vm_complete.ino.
+
+#include "mapped_image.h"
+#include <string>
+#include <vector>
+
+struct Listing {
+    std::vector<uint8_t> program;
+    std::vector<uint8_t> pool;      // "# CONST" entries as little-endian int32s
+    int loop_start = -1;            // offset of "# FUNCTION loop", or -1
+    std::string error;              // "path:line: message" on failure
+};
+
+inline bool emit_to_vector(void* user, uint32_t at, uint8_t b) {
+    std::vector<uint8_t>* out = static_cast<std::vector<uint8_t>*>(user);
+    if (at >= out->size()) return false;
+    (*out)[at] = b;
+    return true;
+}
+
+inline bool assemble_listing(const std::string& path, Listing& out) {
+    out = Listing();
+    MappedImage text;
+    if (!text.open(path.c_str())) {
+        out.error = path + ": cannot open listing";
+        return false;
+    }
+    out.program.resize(text.size());
+    out.pool.resize(A3B_MAX_CONSTS * 4);
+    VmcodeLoader loader;
+    loader.begin(emit_to_vector, &out.program, out.pool.data());
+    if (!loader.load(reinterpret_cast<const char*>(text.data()), text.size())) {
+        out.error = path + ":" + std::to_string(loader.line) + ": " + loader.error;
+        out.program.clear();
+        out.pool.clear();
+        return false;
+    }
+    out.program.resize(loader.size);
+    out.pool.resize((size_t)loader.constCount * 4);
+    if (loader.loopEntry != VMCODE_NO_ENTRY) out.loop_start = (int)loader.loopEntry;
+    return true;
+}
+
+// Wraps an assembled listing in an .a3b container as a3c would, minus the
+// function table and labels. compress LZ-packs the code when that makes
+// it smaller, like a3c --compress.
+inline std::vector<uint8_t> listing_container(const Listing& listing, bool compress) {
+    A3bHeader h = {};
+    h.version = A3B_VERSION;
+    h.loop_entry = A3B_NO_ENTRY;
+    if (listing.loop_start >= 0) {
+        h.flags |= A3B_FLAG_HAS_LOOP;
+        h.loop_entry = (uint16_t)listing.loop_start;
+    }
+    h.const_count = (uint16_t)(listing.pool.size() / 4);
+    if (h.const_count > 0) h.flags |= A3B_FLAG_CONST_POOL;
+    h.code_size = (uint16_t)listing.program.size();
+    std::vector<uint8_t> packed(listing.program.size());
+    if (compress) {
+        h.packed_size = (uint16_t)a3b_lz_compress(listing.program.data(), listing.program.size(),
+                                                  packed.data(), packed.size());
+        if (h.packed_size != 0) h.flags |= A3B_FLAG_COMPRESSED;
+    }
+    std::vector<uint8_t> image(a3b_total_size(&h), 0);
+    a3b_write_header(image.data(), &h);
+    if (!listing.pool.empty()) memcpy(&image[a3b_constants_offset(&h)], listing.pool.data(), listing.pool.size());
+    memcpy(&image[a3b_code_offset(&h)], h.packed_size != 0 ? packed.data() : listing.program.data(),
+           a3b_stored_code_size(&h));
+    a3b_put32(&image[image.size() - 4],
+              a3b_crc32_final(a3b_crc32_update(A3B_CRC_INIT, image.data(), image.size() - 4)));
+    return image;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+// Host-only read-only mapping of an assembled program image (the raw
+// bytecode loadProgramFromSD() writes to /program.vmimg) or an .a3b
+// container. TinyVM keeps the pointer it is given, so a mapped file goes
+// straight to loadProgram()/loadImage() with no copy and no parse; keep the
+// MappedImage alive while the VM runs.
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+class MappedImage {
+public:
+    MappedImage() {}
+    ~MappedImage() { close(); }
+
+    MappedImage(const MappedImage&) = delete;
+    MappedImage& operator=(const MappedImage&) = delete;
+
+    // Maps the whole file. Returns false for missing or empty files.
+    bool open(const char* path) {
+        close();
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+            ::close(fd);
+            return false;
+        }
+        void* mapped = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        // The mapping stays valid after the descriptor is closed
+        ::close(fd);
+        if (mapped == MAP_FAILED) return false;
+        bytes = static_cast<const uint8_t*>(mapped);
+        length = (size_t)st.st_size;
+        return true;
+    }
+
+    void close() {
+        if (bytes != nullptr) munmap(const_cast<uint8_t*>(bytes), length);
+        bytes = nullptr;
+        length = 0;
+    }
+
+    const uint8_t* data() const { return bytes; }
+    size_t size() const { return length; }
+
+private:
+    const uint8_t* bytes = nullptr;
+    size_t length = 0;
+};
+
+// Writes assembled bytecode as an image MappedImage can load
+inline bool write_image(const std::string& path, const std::vector<uint8_t>& program) {
+    FILE* out = fopen(path.c_str(), "wb");
+    if (out == nullptr) return false;
+    bool ok = fwrite(program.data(), 1, program.size(), out) == program.size();
+    return fclose(out) == 0 && ok;
+}
+
+// Raw images and .a3b containers are recognised by extension; everything
+// else is a text listing
+inline bool is_image_path(const std::string& path) {
+    for (const std::string ext : { ".vmimg", ".a3b" }) {
+        if (path.size() > ext.size() &&
+            path.compare(path.size() - ext.size(), ext.size(), ext) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
@@ -4,6 +4,7 @@
 #include <string>
 #include <cstdint>
 #include <cstring>
+#include <cstdio>
 #include <thread>
 #include <chrono>
 #include <unordered_map>
@@ -69,6 +70,12 @@ inline void delay(unsigned long ms) {
     std::this_thread::sleep_for(std::chrono::milliseconds(ms));
 }
 
+inline unsigned long micros() {
+    static const auto boot = std::chrono::steady_clock::now();
+    return (unsigned long)std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - boot).count();
+}
+
 #define HEX 16
 #define DEC 10
 
@@ -4,14 +4,14 @@
 // Include the VM implementation directly
 // Since it's a .ino file, we treat it as a header for testing purposes
 #include "../vm_complete.ino"
+#include "vm_jit.h"
+#include "listing_file.h"
+#include "delta_upload.h"
 
 #include <cassert>
 #include <iostream>
 #include <vector>
-#include <fstream>
-#include <sstream>
 #include <string>
-#include <map>
 
 MockSerial Serial;
 
@@ -24,52 +24,18 @@ static void print_registers(TinyVM &vm) {
     std::cout << std::endl;
 }
 
-// Function to parse vmcode file and convert to bytecode
-std::vector<uint8_t> parse_vmcode_file(const std::string& filename) {
-    // Map instruction names to opcodes - these match the opcodes in vm_complete.ino
-    std::map<std::string, uint8_t> opcode_map = {
-        {"NOP", 0x00},
-        {"ADD", 0x01}, {"SUB", 0x02}, {"MUL", 0x03}, {"DIV", 0x04}, {"MOD", 0x05},
-        {"AND", 0x06}, {"OR", 0x07}, {"XOR", 0x08}, {"NOT", 0x09}, {"CMP", 0x0A},
-        {"SHL", 0x0B}, {"SHR", 0x0C},
-        {"LOAD", 0x10}, {"LOADI", 0x11}, {"LOADI16", 0x12}, {"STORE", 0x13},
-        {"LOAD_ADDR", 0x14}, {"PUSH", 0x15}, {"POP", 0x16}, {"PEEK", 0x17}, {"LOADM", 0x18},
-        {"JMP", 0x20}, {"JZ", 0x21}, {"JNZ", 0x22}, {"JLT", 0x23}, {"JGT", 0x24},
-        {"JLE", 0x25}, {"JGE", 0x26}, {"CALL", 0x27}, {"RET", 0x28}, {"HALT", 0x29},
-        {"PRINT", 0x30}, {"TRAP", 0x31}
-    };
-    
-    std::vector<uint8_t> bytecode;
-    std::ifstream file(filename);
-    std::string line;
-    
-    if (!file.is_open()) {
-        std::cerr << "Error: Could not open file " << filename << std::endl;
-        return bytecode;
-    }
-    
-    while (std::getline(file, line)) {
-        // Skip comments and empty lines
-        if (line.empty() || line[0] == '#') continue;
-        
-        std::istringstream iss(line);
-        std::string opcode_str;
-        int arg1, arg2;
-        
-        if (iss >> opcode_str >> arg1 >> arg2) {
-            auto it = opcode_map.find(opcode_str);
-            if (it != opcode_map.end()) {
-                bytecode.push_back(it->second); // opcode
-                bytecode.push_back(static_cast<uint8_t>(arg1)); // arg1
-                bytecode.push_back(static_cast<uint8_t>(arg2)); // arg2
-            } else {
-                std::cerr << "Warning: Unknown opcode " << opcode_str << std::endl;
-            }
-        }
+// Assembles a vmcode listing with the shared loader. If loop_start is
+// given it receives the offset of the "# FUNCTION loop" marker (or -1), and
+// pool receives the "# CONST" entries as little-endian int32s.
+std::vector<uint8_t> parse_vmcode_file(const std::string& filename, int* loop_start = nullptr,
+                                       std::vector<uint8_t>* pool = nullptr) {
+    Listing listing;
+    if (!assemble_listing(filename, listing)) {
+        std::cerr << "Error: " << listing.error << std::endl;
     }
-    
-    file.close();
-    return bytecode;
+    if (loop_start) *loop_start = listing.loop_start;
+    if (pool) *pool = listing.pool;
+    return listing.program;
 }
 
 void test_program_vmcode() {
@@ -98,7 +64,8 @@ void test_program_vmcode() {
     // Based on the vmcode, it seems to store values 0-4 in heap[0]-heap[4], 
     // then iterates through them and prints each value
     TinyVM vm;
-    vm.loadProgram(program.data(), program.size());
+    bool loaded = vm.loadProgram(program.data(), program.size());
+    assert(loaded);
     vm.run();
     print_registers(vm);
     
@@ -107,9 +74,1339 @@ void test_program_vmcode() {
     std::cout << "test_program_vmcode completed successfully" << std::endl;
 }
 
+void test_verifier() {
+    TinyVM vm;
+
+    // LOADI16 shifts later instructions off the 3-byte grid; the JMP lands on
+    // the real boundary at byte 8.
+    const uint8_t good[] = {
+        LOADI16, 1, 0, 0x34, 0x12,
+        JMP, 8, 0,
+        ADD, 1, 1,
+        HALT, 0, 0
+    };
+    const uint8_t bad_register[] = { LOAD, 1, 9, HALT, 0, 0 };
+    const uint8_t bad_target[] = { JMP, 4, 0, NOP, 0, 0, HALT, 0, 0 };
+    const uint8_t truncated_word[] = { HALT, 0, 0, LOADI16, 1, 0, 0x34 };
+    const uint8_t falls_off_end[] = { LOADI, 1, 7 };
+    const uint8_t unknown_opcode[] = { 0x7F, 0, 0, HALT, 0, 0 };
+
+    assert(vm.loadProgram(good, sizeof(good)));
+    vm.run();
+    assert(vm.registers[1] == 0x1234);
+    assert(vm.registers[0] == 0x2468);
+
+    assert(!vm.loadProgram(bad_register, sizeof(bad_register)));
+    assert(!vm.loadProgram(bad_target, sizeof(bad_target)));
+    assert(!vm.loadProgram(truncated_word, sizeof(truncated_word)));
+    assert(!vm.loadProgram(falls_off_end, sizeof(falls_off_end)));
+    assert(!vm.loadProgram(unknown_opcode, sizeof(unknown_opcode)));
+    assert(!vm.running);
+
+    std::cout << "test_verifier completed successfully" << std::endl;
+}
+
+void test_compare_branch() {
+    // Counts R1 up to R2 with a single BLT back-edge, then checks the taken
+    // and fall-through paths of the other forms. Targets live in the
+    // trailing word, so later instructions sit off the 3-byte grid.
+    const uint8_t program[] = {
+        LOADI, 1, 0,
+        LOADI, 2, 5,
+        LOADI, 3, 1,
+        ADD3, 1, 0x13,          // 9:  R1 = R1 + R3
+        BLT, 1, 2, 9, 0,        // 12: loop while R1 < R2
+        BEQ, 1, 2, 25, 0,       // 17: taken, skips R4 = 99
+        LOADI, 4, 99,
+        BNE, 1, 2, 33, 0,       // 25: not taken
+        LOADI, 5, 7,
+        BGE, 1, 2, 41, 0,       // 33: taken, skips R6 = 1
+        LOADI, 6, 1,
+        HALT, 0, 0              // 41
+    };
+    const uint8_t bad_target[] = { BEQ, 0, 0, 2, 0, HALT, 0, 0 };
+    const uint8_t bad_register[] = { BLT, 1, 8, 5, 0, HALT, 0, 0 };
+    const uint8_t truncated_word[] = { HALT, 0, 0, BNE, 1, 2, 0 };
+
+    TinyVM fast, slow;
+    assert(fast.loadProgram(program, sizeof(program)));
+    fast.run();
+    assert(slow.loadProgram(program, sizeof(program)));
+    while (slow.running) slow.step();
+
+    for (const TinyVM* vm : { &fast, &slow }) {
+        assert(vm->registers[1] == 5);
+        assert(vm->registers[4] == 0);
+        assert(vm->registers[5] == 7);
+        assert(vm->registers[6] == 0);
+    }
+
+    assert(!fast.loadProgram(bad_target, sizeof(bad_target)));
+    assert(!fast.loadProgram(bad_register, sizeof(bad_register)));
+    assert(!fast.loadProgram(truncated_word, sizeof(truncated_word)));
+
+    std::cout << "test_compare_branch completed successfully" << std::endl;
+}
+
+static void assert_same_state(const TinyVM& a, const TinyVM& b) {
+    for (int r = 0; r < NUM_REGISTERS; r++) assert(a.registers[r] == b.registers[r]);
+    assert(a.flags.valid == b.flags.valid && a.flags.lhs == b.flags.lhs &&
+           a.flags.rhs == b.flags.rhs);
+    assert(a.sp == b.sp && a.pc == b.pc && a.running == b.running);
+    assert(a.rsp == b.rsp && memcmp(a.retStack, b.retStack, a.rsp * sizeof(a.retStack[0])) == 0);
+    assert(memcmp(a.stack, b.stack, sizeof(a.stack)) == 0);
+    assert(memcmp(a.heap, b.heap, sizeof(a.heap)) == 0);
+}
+
+// LOADX/STOREX address 32-bit heap words at R[base] + R[index]; word i
+// overlays heap bytes 4i..4i+3, and out-of-range words stop the VM.
+void test_indexed_words() {
+    const uint8_t program[] = {
+        LOADI, 1, 10,           // base
+        LOADI, 2, 3,            // index
+        LOADI16, 3, 0, 0x60, 0xEA,  // R3 = 60000
+        STOREX, 3, 0x12,        // word[13] = R3
+        LOADX, 4, 0x12,         // R4 = word[13]
+        LOADI16, 5, 0, 52, 0,   // R5 = 52, byte address of word 13
+        LOADM, 6, 5,            // R6 = low byte of word 13
+        HALT, 0, 0
+    };
+    const uint8_t out_of_range[] = {
+        LOADI16, 1, 0, 0x00, 0x02,  // R1 = 512 = VM_HEAP_WORDS
+        LOADX, 2, 0x10,
+        HALT, 0, 0
+    };
+    const uint8_t bad_register[] = { STOREX, 1, 0x18, HALT, 0, 0 };
+
+    TinyVM fast, slow;
+    assert(fast.loadProgram(program, sizeof(program)));
+    fast.run();
+    assert(slow.loadProgram(program, sizeof(program)));
+    while (slow.running) slow.step();
+    for (const TinyVM* vm : { &fast, &slow }) {
+        assert(vm->registers[4] == 60000);
+        assert(vm->registers[6] == (60000 & 0xFF));
+        assert(vm->loadWord(13) == 60000);
+    }
+
+    assert(fast.loadProgram(out_of_range, sizeof(out_of_range)));
+    assert(fast.runFor(10) == TinyVM::RUN_ERROR);
+    assert(slow.loadProgram(out_of_range, sizeof(out_of_range)));
+    while (slow.running) slow.step();
+    assert(slow.status() == TinyVM::RUN_ERROR);
+    assert(!fast.loadProgram(bad_register, sizeof(bad_register)));
+
+    std::cout << "test_indexed_words completed successfully" << std::endl;
+}
+
+// Lazy flags: before any CMP every condition is false, so only JNZ jumps.
+void test_flags_before_compare() {
+    const uint8_t program[] = {
+        JZ, 21, 0,
+        JLE, 21, 0,
+        JGE, 21, 0,
+        JNZ, 15, 0,
+        HALT, 0, 0,
+        LOADI, 2, 7,            // 15: reached through JNZ
+        HALT, 0, 0,
+        LOADI, 1, 99,           // 21: must not be reached
+        HALT, 0, 0
+    };
+
+    TinyVM fast, slow;
+    assert(fast.loadProgram(program, sizeof(program)));
+    fast.run();
+    assert(slow.loadProgram(program, sizeof(program)));
+    while (slow.running) slow.step();
+    for (const TinyVM* vm : { &fast, &slow }) {
+        assert(vm->registers[1] == 0);
+        assert(vm->registers[2] == 7);
+    }
+#ifdef VM_JIT_AVAILABLE
+    TinyVM native;
+    assert(native.loadProgram(program, sizeof(program)));
+    TinyJit jit(native);
+    assert(jit.compile());
+    jit.run();
+    assert_same_state(fast, native);
+#endif
+
+    std::cout << "test_flags_before_compare completed successfully" << std::endl;
+}
+
+// ALLOC bumps heap_top by whole words and FREE rolls it back LIFO. Each
+// loop() iteration restarts the arena above what main() allocated.
+void test_heap_arena() {
+    const uint8_t program[] = {
+        ALLOC, 1, 2,            // main keeps words 0-1
+        HALT, 0, 0,
+        ALLOC, 2, 4,            // 6: loop scratch, never freed
+        ALLOC, 3, 1,
+        FREE, 3, 0,
+        RET, 0, 0
+    };
+    const uint8_t exhausted[] = { ALLOC, 1, 255, ALLOC, 2, 255, ALLOC, 3, 255, HALT, 0, 0 };
+    const uint8_t bad_free[] = { ALLOC, 1, 1, LOADI, 2, 9, FREE, 2, 0, HALT, 0, 0 };
+
+    TinyVM fast, slow;
+    for (TinyVM* vm : { &fast, &slow }) {
+        vm->setLoopStart(6);
+        assert(vm->loadProgram(program, sizeof(program)));
+    }
+    fast.run();
+    while (slow.running) slow.step();
+    for (int tick = 0; tick < 3; tick++) {
+        fast.runLoop();
+        slow.beginLoop();
+        while (slow.running) slow.step();
+        for (const TinyVM* vm : { &fast, &slow }) {
+            assert(vm->status() == TinyVM::RUN_HALTED);
+            assert(vm->registers[1] == 0 && vm->registers[2] == 2 && vm->registers[3] == 6);
+            assert(vm->heap_top == 6 * 4);
+        }
+    }
+
+    fast.reset();
+    assert(fast.loadProgram(exhausted, sizeof(exhausted)));
+    fast.run();
+    assert(fast.status() == TinyVM::RUN_ERROR && fast.registers[2] == 255);
+    slow.reset();
+    assert(slow.loadProgram(bad_free, sizeof(bad_free)));
+    while (slow.running) slow.step();
+    assert(slow.status() == TinyVM::RUN_ERROR && slow.heap_top == 4);
+
+    std::cout << "test_heap_arena completed successfully" << std::endl;
+}
+
+// ENTER/LEAVE bracket a frame above the caller's stack; LDL/STL only
+// reach slots inside it.
+void test_stack_frames() {
+    const uint8_t program[] = {
+        LOADI, 1, 5,
+        CALL, 9, 0,
+        HALT, 0, 0,
+        ENTER, 0, 2,            // 9
+        STL, 1, 0,
+        LOADI, 2, 7,
+        STL, 2, 1,
+        LDL, 3, 0,
+        LDL, 4, 1,
+        ADD3, 5, 0x34,
+        LEAVE, 0, 0,
+        RET, 0, 0
+    };
+    const uint8_t outside[] = { ENTER, 0, 1, LDL, 1, 1, HALT, 0, 0 };
+    const uint8_t no_frame[] = { LEAVE, 0, 0, HALT, 0, 0 };
+
+    TinyVM fast, slow;
+    assert(fast.loadProgram(program, sizeof(program)));
+    fast.run();
+    assert(slow.loadProgram(program, sizeof(program)));
+    while (slow.running) slow.step();
+    for (const TinyVM* vm : { &fast, &slow }) {
+        assert(vm->status() == TinyVM::RUN_HALTED);
+        assert(vm->registers[5] == 12 && vm->sp == 0 && vm->fp == 0);
+    }
+    assert_same_state(fast, slow);
+
+    for (const uint8_t* bad : { outside, no_frame }) {
+        size_t size = bad == outside ? sizeof(outside) : sizeof(no_frame);
+        fast.reset();
+        slow.reset();
+        assert(fast.loadProgram(bad, size));
+        fast.run();
+        assert(fast.status() == TinyVM::RUN_ERROR);
+        assert(slow.loadProgram(bad, size));
+        while (slow.running) slow.step();
+        assert(slow.status() == TinyVM::RUN_ERROR);
+    }
+
+    std::cout << "test_stack_frames completed successfully" << std::endl;
+}
+
+// CALL/RET keep return addresses on their own stack: data stack traffic in
+// the callee cannot disturb them, and nesting past ReturnDepth stops the VM.
+void test_return_stack() {
+    uint8_t program[] = {
+        LOADI, 1, 0,
+        LOADI, 3, 1,
+        LOADI, 4, 4,            // recursion depth
+        CALL, 15, 0,
+        HALT, 0, 0,
+        PUSH, 1, 0,             // 15
+        POP, 2, 0,
+        ADD3, 1, 0x13,
+        BGE, 1, 4, 32, 0,       // 24: stop recursing once R1 >= R4
+        CALL, 15, 0,
+        RET, 0, 0               // 32
+    };
+    typedef BasicTinyVM<16, 64, 256, 4> ShallowVM;
+
+    ShallowVM fast, slow;
+    assert(fast.loadProgram(program, sizeof(program)));
+    fast.run();
+    assert(slow.loadProgram(program, sizeof(program)));
+    while (slow.running) slow.step();
+    for (const ShallowVM* vm : { &fast, &slow }) {
+        assert(vm->status() == ShallowVM::RUN_HALTED);
+        assert(vm->registers[1] == 4 && vm->rsp == 0 && vm->sp == 0);
+    }
+
+    // One level deeper than the return stack holds
+    program[8] = 5;
+    fast.reset();
+    slow.reset();
+    assert(fast.loadProgram(program, sizeof(program)));
+    fast.run();
+    assert(slow.loadProgram(program, sizeof(program)));
+    while (slow.running) slow.step();
+    for (const ShallowVM* vm : { &fast, &slow }) {
+        assert(vm->status() == ShallowVM::RUN_ERROR);
+        assert(vm->registers[1] == 4 && vm->rsp == 4);
+        assert(vm->retStack[0] == 12 && vm->retStack[3] == 32);
+    }
+
+    std::cout << "test_return_stack completed successfully" << std::endl;
+}
+
+// Slicing a program with runFor()/runUntil() must end in the same state as
+// run(), with each slice executing exactly its step budget.
+void test_time_slicing() {
+    const uint8_t program[] = {
+        LOADI, 1, 0,
+        LOADI, 2, 200,
+        LOADI, 3, 1,
+        ADD3, 1, 0x13,          // 9:  R1 = R1 + R3
+        BLT, 1, 2, 9, 0,        // 12: loop while R1 < R2
+        HALT, 0, 0
+    };
+    const uint8_t underflow[] = { POP, 1, 0, HALT, 0, 0 };
+
+    TinyVM whole, sliced, single;
+    assert(whole.loadProgram(program, sizeof(program)));
+    whole.run();
+    assert(whole.status() == TinyVM::RUN_HALTED);
+
+    assert(sliced.loadProgram(program, sizeof(program)));
+    assert(sliced.runFor(0) == TinyVM::RUN_YIELDED && sliced.pc == 0);
+    int slices = 0;
+    while (sliced.runFor(7) == TinyVM::RUN_YIELDED) slices++;
+    assert(slices == 403 / 7);
+    assert_same_state(whole, sliced);
+
+    // One step per call matches step() instruction for instruction
+    assert(single.loadProgram(program, sizeof(program)));
+    TinyVM reference;
+    assert(reference.loadProgram(program, sizeof(program)));
+    int steps = 0;
+    while (single.runFor(1) == TinyVM::RUN_YIELDED) {
+        reference.step();
+        assert(single.pc == reference.pc);
+        assert(single.registers[1] == reference.registers[1]);
+        steps++;
+    }
+    assert(steps == 403);
+    assert(single.status() == TinyVM::RUN_HALTED);
+
+    // A deadline in the past yields without running; a distant one finishes
+    TinyVM timed;
+    assert(timed.loadProgram(program, sizeof(program)));
+    assert(timed.runUntil((uint32_t)micros() - 1) == TinyVM::RUN_YIELDED);
+    assert(timed.pc == 0);
+    assert(timed.runUntil((uint32_t)micros() + 1000000) == TinyVM::RUN_HALTED);
+    assert(timed.registers[1] == 200);
+
+    TinyVM failing;
+    assert(failing.loadProgram(underflow, sizeof(underflow)));
+    assert(failing.runFor(10) == TinyVM::RUN_ERROR);
+    assert(failing.runFor(10) == TinyVM::RUN_ERROR);
+
+    std::cout << "test_time_slicing completed successfully" << std::endl;
+}
+
+// After the first loop() pass has decoded every block, further passes must
+// run entirely from the trace cache.
+void test_trace_cache(const std::string& vmcode_path) {
+    int loop_start = -1;
+    std::vector<uint8_t> program = parse_vmcode_file(vmcode_path, &loop_start);
+    assert(!program.empty() && loop_start >= 0);
+
+    static TinyVM vm;
+    vm.reset();
+    vm.setLoopStart((size_t)loop_start);
+    assert(vm.loadProgram(program.data(), program.size()));
+    vm.run();
+    vm.runLoop();
+
+#ifdef VM_TRACE_CACHE
+    uint32_t warm_misses = vm.traceMisses;
+    uint32_t warm_hits = vm.traceHits;
+    for (int i = 0; i < 10; i++) vm.runLoop();
+    assert(warm_misses > 0);
+    assert(vm.traceMisses == warm_misses);
+    assert(vm.traceHits > warm_hits);
+#else
+    for (int i = 0; i < 10; i++) vm.runLoop();
+#endif
+    vm.dumpTraceStats();
+
+    std::cout << "test_trace_cache(" << vmcode_path << ") completed successfully" << std::endl;
+}
+
+#ifdef VM_JIT_AVAILABLE
+// The JIT must leave exactly the interpreter's state behind: main, then
+// loop() once per IR sensor combination.
+void test_jit_matches_interpreter(const std::string& vmcode_path) {
+    int loop_start = -1;
+    std::vector<uint8_t> pool;
+    std::vector<uint8_t> program = parse_vmcode_file(vmcode_path, &loop_start, &pool);
+    assert(!program.empty());
+
+    static TinyVM interp, native;
+    interp.reset();
+    interp.setConstPool(pool.data(), (uint16_t)(pool.size() / 4));
+    native.reset();
+    native.setConstPool(pool.data(), (uint16_t)(pool.size() / 4));
+    if (loop_start >= 0) {
+        interp.setLoopStart((size_t)loop_start);
+        native.setLoopStart((size_t)loop_start);
+    }
+    assert(interp.loadProgram(program.data(), program.size()));
+    assert(native.loadProgram(program.data(), program.size()));
+    TinyJit jit(native);
+    assert(jit.compile());
+
+    interp.run();
+    jit.run();
+    assert_same_state(interp, native);
+
+    for (int pass = 0; pass < 4 && loop_start >= 0; pass++) {
+        mock_set_analog_read(sensorIzqPin, (pass & 1) ? 4095 : 0);
+        mock_set_analog_read(sensorDerPin, (pass & 2) ? 4095 : 0);
+        int speed = speed_global;
+        interp.runLoop();
+        int interp_speed = speed_global;
+        speed_global = speed;
+        jit.runLoop();
+        assert(speed_global == interp_speed);
+        assert_same_state(interp, native);
+    }
+
+    std::cout << "test_jit_matches_interpreter(" << vmcode_path << ") completed successfully" << std::endl;
+}
+
+// Arithmetic corner cases and every stop path: division by zero, shifts,
+// negative compares, wide branches, CALL/RET and a POP underflow.
+void test_jit_edge_cases() {
+    const uint8_t program[] = {
+        LOADI16, 1, 0, 0xFF, 0xFF,  // 0:  R1 = 65535
+        LOADI, 2, 0,                // 5
+        DIV, 1, 2,                  // 8:  R0 = 0 (divide by zero)
+        MOD3, 3, 0x12,              // 11: R3 = 0
+        SHL, 1, 20,                 // 14: R0 = R1 << 20 (overflows sign)
+        LOAD, 4, 0,                 // 17
+        SHR, 4, 4,                  // 20: arithmetic shift of a negative value
+        NOT3, 5, 0x40,              // 23
+        CMP, 4, 1,                  // 26
+        BLT, 4, 1, 37, 0,           // 29: negative < positive, taken
+        LOADI, 6, 1,                // 34: skipped
+        CALL, 46, 0,                // 37
+        DIV3, 7, 0x41,              // 40: R7 = R4 / R1
+        POP, 2, 0,                  // 43: underflow stops here
+        PUSH, 1, 0,                 // 46
+        POP, 6, 0,                  // 49
+        RET, 0, 0                   // 52
+    };
+
+    TinyVM interp, native;
+    assert(interp.loadProgram(program, sizeof(program)));
+    assert(native.loadProgram(program, sizeof(program)));
+    TinyJit jit(native);
+    assert(jit.compile());
+    interp.run();
+    jit.run();
+    assert_same_state(interp, native);
+    assert(native.pc == 46 && native.registers[6] == 65535);
+
+    std::cout << "test_jit_edge_cases completed successfully" << std::endl;
+}
+#endif
+
+// Policy that records what the hooks see, for test_vm_policies
+struct RecordingPolicy : DefaultVMPolicy {
+    static const bool kTrace = true;
+    static const bool kProfile = true;
+    static std::vector<uint16_t> traced;
+    static uint32_t profiled[256];
+    static std::string lastError, lastMessage;
+    static void trace(uint16_t pc, uint8_t, uint8_t, uint8_t) { traced.push_back(pc); }
+    static void profile(uint8_t op) { profiled[op]++; }
+    static void error(const char* message) { lastError = message; }
+    static void message(const char* text) { lastMessage = text; }
+};
+std::vector<uint16_t> RecordingPolicy::traced;
+uint32_t RecordingPolicy::profiled[256];
+std::string RecordingPolicy::lastError, RecordingPolicy::lastMessage;
+
+struct UncheckedPolicy : DefaultVMPolicy {
+    static const bool kBoundsChecks = false;
+};
+
+// BasicTinyVM instantiated with other sizes and policies: hooks see every
+// dispatched instruction, errors reach the policy, and disabling checks
+// leaves in-bounds programs unchanged.
+void test_vm_policies() {
+    const uint8_t program[] = {
+        LOADI, 1, 0,
+        LOADI, 2, 20,
+        LOADI, 3, 1,
+        PUSH, 1, 0,             // 9
+        ADD3, 1, 0x13,
+        BLT, 1, 2, 9, 0,        // 15: loop while R1 < R2
+        HALT, 0, 0
+    };
+    typedef BasicTinyVM<16, 64, 256, 4, RecordingPolicy> SmallVM;
+    static_assert(sizeof(SmallVM) < sizeof(TinyVM), "sizes must shrink the VM");
+
+    SmallVM small;
+    assert(small.loadProgram(program, sizeof(program)));
+    assert(RecordingPolicy::lastMessage == "Program Loaded.");
+    small.run();
+    // The 17th PUSH overflows the 16-slot stack
+    assert(small.status() == SmallVM::RUN_ERROR);
+    assert(RecordingPolicy::lastError == "Error: Stack Overflow");
+    assert(small.sp == 16 && small.registers[1] == 16);
+    assert(!RecordingPolicy::traced.empty() && RecordingPolicy::traced[0] == 0);
+    uint32_t profiled = 0;
+    for (uint32_t count : RecordingPolicy::profiled) profiled += count;
+    assert(profiled == RecordingPolicy::traced.size());
+    for (uint16_t pc : RecordingPolicy::traced) assert(small.isInstructionStart(pc));
+
+    RecordingPolicy::lastError.clear();
+    small.reset();
+    assert(small.loadProgram(program, sizeof(program)));
+    while (small.running) small.step();
+    assert(RecordingPolicy::lastError == "Error: Stack Overflow");
+
+    // Load-time rejections go to the same reporter
+    const uint8_t bad_register[] = { LOAD, 1, 9, HALT, 0, 0 };
+    RecordingPolicy::lastMessage.clear();
+    assert(!small.loadProgram(bad_register, sizeof(bad_register)));
+    assert(RecordingPolicy::lastError == "Program rejected by verifier.");
+    const uint8_t truncated[] = { 'A', '3' };
+    assert(!small.loadImage(truncated, sizeof(truncated)));
+    assert(RecordingPolicy::lastError.rfind("Container rejected: ", 0) == 0);
+    assert(RecordingPolicy::lastMessage.empty());
+
+    TinyVM checked;
+    BasicTinyVM<VM_STACK_SIZE, VM_HEAP_SIZE, VM_MAX_PROGRAM_SIZE, VM_RETURN_DEPTH,
+                UncheckedPolicy> unchecked;
+    assert(checked.loadProgram(program, sizeof(program)));
+    assert(unchecked.loadProgram(program, sizeof(program)));
+    checked.run();
+    unchecked.run();
+    assert(checked.status() == TinyVM::RUN_HALTED && unchecked.sp == checked.sp);
+    for (int r = 0; r < NUM_REGISTERS; r++) assert(unchecked.registers[r] == checked.registers[r]);
+    assert(memcmp(unchecked.stack, checked.stack, sizeof(checked.stack)) == 0);
+
+    std::cout << "test_vm_policies completed successfully" << std::endl;
+}
+
+// Snapshots taken after main() must let every loop() variant start from
+// the same state: restore() and fork() match a VM that re-ran main().
+void test_snapshot_fork(const std::string& vmcode_path) {
+    int loop_start = -1;
+    std::vector<uint8_t> pool;
+    std::vector<uint8_t> program = parse_vmcode_file(vmcode_path, &loop_start, &pool);
+    assert(!program.empty() && loop_start >= 0);
+
+    static TinyVM base, child, fresh;
+    static TinyVM::Snapshot setup;
+    static std::vector<uint8_t> saved;
+    base.reset();
+    base.setConstPool(pool.data(), (uint16_t)(pool.size() / 4));
+    base.setLoopStart((size_t)loop_start);
+    assert(base.loadProgram(program.data(), program.size()));
+    base.run();
+    // The buffer only holds what main() left on the stacks and heap
+    saved.resize(base.snapshotSize());
+    assert(saved.size() < sizeof(base.stack) + sizeof(base.heap));
+    assert(!base.snapshot(setup, saved.data(), saved.size() - 1) || saved.empty());
+    assert(base.snapshot(setup, saved.data(), saved.size()));
+
+    for (int pattern = 0; pattern < 4; pattern++) {
+        mock_set_analog_read(sensorIzqPin, (pattern & 1) ? 4095 : 0);
+        mock_set_analog_read(sensorDerPin, (pattern & 2) ? 4095 : 0);
+        // The robot speed lives in the firmware, outside the snapshot
+        int speed = speed_global;
+        fresh.reset();
+        fresh.setConstPool(pool.data(), (uint16_t)(pool.size() / 4));
+        fresh.setLoopStart((size_t)loop_start);
+        assert(fresh.loadProgram(program.data(), program.size()));
+        fresh.run();
+        fresh.runLoop();
+
+        speed_global = speed;
+        base.restore(setup);
+        base.runLoop();
+        base.fork(child);
+        speed_global = speed;
+        child.restore(setup);
+        child.runLoop();
+        assert_same_state(fresh, base);
+        assert_same_state(fresh, child);
+    }
+
+    // Heap written after the snapshot reads as zero again once restored
+    const uint8_t heapy[] = {
+        LOADI, 1, 40,
+        LOADI, 2, 7,
+        STORE, 1, 2,            // heap[40] = 7
+        HALT, 0, 0,
+        LOADI, 3, 0,            // 12: second phase
+        STOREX, 2, 0x33,        // word[0] = 7
+        LOADI, 1, 200,
+        STORE, 1, 2,            // heap[200] = 7
+        HALT, 0, 0
+    };
+    TinyVM vm;
+    assert(vm.loadProgram(heapy, sizeof(heapy)));
+    vm.run();
+    assert(vm.heapUsed == 41);
+    TinyVM::Snapshot after_first;
+    uint8_t buffer[64];
+    assert(vm.snapshotSize() == 41);
+    assert(vm.snapshot(after_first, buffer, sizeof(buffer)));
+    vm.pc = 12;
+    vm.running = true;
+    vm.run();
+    assert(vm.heapUsed == 201 && vm.loadWord(0) == 7 && vm.heap[200] == 7);
+    vm.restore(after_first);
+    assert(vm.heapUsed == 41 && vm.heap[40] == 7);
+    assert(vm.loadWord(0) == 0 && vm.heap[200] == 0);
+
+    std::cout << "test_snapshot_fork(" << vmcode_path << ") completed successfully" << std::endl;
+}
+
+// Runs the listing's main code and then loop() once per IR sensor
+// combination, both through the fast engine (fused superinstructions) and
+// through the checked step() path, and requires identical machine state.
+static bool read_image(void* user, uint32_t offset, uint8_t* dst, uint16_t len) {
+    const std::vector<uint8_t>& image = *static_cast<const std::vector<uint8_t>*>(user);
+    if (offset + len > image.size()) return false;
+    memcpy(dst, image.data() + offset, len);
+    return true;
+}
+
+// A paged program must end in the same state as the same bytes loaded into
+// RAM; pages are only read when execution reaches them and are evicted
+// least recently used first.
+void test_paged_code(const std::string& vmcode_path) {
+    int loop_start = -1;
+    std::vector<uint8_t> program = parse_vmcode_file(vmcode_path, &loop_start);
+    assert(!program.empty() && loop_start >= 0);
+
+    static TinyVM resident, paged;
+    static CodePager pager;
+    resident.reset();
+    resident.setLoopStart((size_t)loop_start);
+    assert(resident.loadProgram(program.data(), program.size()));
+    paged.reset();
+    paged.setLoopStart((size_t)loop_start);
+    pager.begin(read_image, &program, program.size());
+    assert(paged.loadPaged(pager));
+    resident.run();
+    paged.run();
+    assert_same_state(resident, paged);
+    for (int pattern = 0; pattern < 4; pattern++) {
+        mock_set_analog_read(sensorIzqPin, (pattern & 1) ? 4095 : 0);
+        mock_set_analog_read(sensorDerPin, (pattern & 2) ? 4095 : 0);
+        resident.runLoop();
+        paged.runLoop();
+        assert_same_state(resident, paged);
+    }
+    uint32_t pages = (program.size() + VM_CODE_PAGE_SIZE - 1) / VM_CODE_PAGE_SIZE;
+    assert(pager.misses <= pages && pager.hits > 0);
+
+    // Hot loop near the start calling a function past 6KB, more code than
+    // the VM_CODE_PAGES cache slots hold
+    const size_t far = 6023;
+    std::vector<uint8_t> big = {
+        LOADI, 4, 0,
+        LOADI, 2, 1,
+        LOADI, 3, 100,
+        CALL, (uint8_t)(far & 0xFF), (uint8_t)(far >> 8),    // 9
+        ADD3, 4, 0x42,
+        BLT, 4, 3, 9, 0,
+        HALT, 0, 0,
+    };
+    while (big.size() < far) big.insert(big.end(), { NOP, 0, 0 });
+    big.insert(big.end(), { ADD3, 5, 0x52, RET, 0, 0 });
+
+    static BasicTinyVM<VM_STACK_SIZE, VM_HEAP_SIZE, 8192> wide;
+    wide.reset();
+    assert(wide.loadProgram(big.data(), big.size()));
+    wide.run();
+    paged.reset();
+    pager.begin(read_image, &big, big.size());
+    assert(paged.loadPaged(pager));
+    paged.run();
+    assert(paged.status() == TinyVM::RUN_HALTED);
+    assert(paged.registers[4] == 100 && paged.registers[5] == 100);
+    for (int r = 0; r < NUM_REGISTERS; r++) assert(paged.registers[r] == wide.registers[r]);
+    // Only the loop's page and the function's page were ever read
+    assert(pager.misses == 2 && pager.hits > 600);
+
+    // Sliding through the NOPs into the function reads every page once and
+    // evicts the function's page on the way
+    paged.pc = 23;
+    paged.running = true;
+    paged.run();
+    assert(paged.status() == TinyVM::RUN_HALTED && paged.registers[5] == 101);
+    assert(pager.misses == 2 + far / VM_CODE_PAGE_SIZE);
+
+    // A page that cannot be read stops the VM with an error
+    std::vector<uint8_t> truncated(big.begin(), big.begin() + 300);
+    paged.reset();
+    pager.begin(read_image, &truncated, big.size());
+    assert(paged.loadPaged(pager));
+    paged.run();
+    assert(paged.status() == TinyVM::RUN_ERROR);
+
+    // Paged code skips the verifier, so step() rejects what it would have
+    std::vector<uint8_t> bad_register = { LOADI, 1, 5, LOAD, 1, 9, HALT, 0, 0 };
+    paged.reset();
+    pager.begin(read_image, &bad_register, bad_register.size());
+    assert(paged.loadPaged(pager));
+    paged.run();
+    assert(paged.status() == TinyVM::RUN_ERROR && paged.registers[1] == 5 && paged.pc == 3);
+
+    std::cout << "test_paged_code completed successfully" << std::endl;
+}
+
+// A mapped image runs in place: the VM executes the mapping itself and ends
+// in the same state as the listing it was assembled from.
+void test_mapped_image(const std::string& vmcode_path) {
+    int loop_start = -1;
+    std::vector<uint8_t> pool;
+    std::vector<uint8_t> program = parse_vmcode_file(vmcode_path, &loop_start, &pool);
+    assert(!program.empty() && loop_start >= 0);
+
+    const std::string image_path = "test_mapped.vmimg";
+    assert(is_image_path(image_path) && !is_image_path(vmcode_path));
+    assert(write_image(image_path, program));
+    MappedImage image;
+    assert(image.open(image_path.c_str()));
+    assert(image.size() == program.size());
+    assert(memcmp(image.data(), program.data(), program.size()) == 0);
+
+    static TinyVM parsed, mapped;
+    parsed.reset();
+    parsed.setConstPool(pool.data(), (uint16_t)(pool.size() / 4));
+    parsed.setLoopStart((size_t)loop_start);
+    assert(parsed.loadProgram(program.data(), program.size()));
+    mapped.reset();
+    mapped.setConstPool(pool.data(), (uint16_t)(pool.size() / 4));
+    mapped.setLoopStart((size_t)loop_start);
+    assert(mapped.loadProgram(image.data(), image.size()));
+    assert(mapped.program == image.data());
+    parsed.run();
+    mapped.run();
+    int speed = speed_global;
+    parsed.runLoop();
+    speed_global = speed;
+    mapped.runLoop();
+    assert_same_state(parsed, mapped);
+
+    image.close();
+    std::remove(image_path.c_str());
+    assert(!image.open(image_path.c_str()));
+
+    std::cout << "test_mapped_image completed successfully" << std::endl;
+}
+
+// Wraps bytecode in an .a3b container the way a3c does, with one function
+// table entry for loop and a debug label; compress packs the code like
+// a3c --compress
+static std::vector<uint8_t> build_a3b(const std::vector<uint8_t>& code, int loop_start,
+                                      const std::vector<uint8_t>& pool = {}, bool compress = false) {
+    A3bHeader h = {};
+    h.version = A3B_VERSION;
+    h.flags = A3B_FLAG_DEBUG_MAP | (loop_start >= 0 ? A3B_FLAG_HAS_LOOP : 0) |
+              (pool.empty() ? 0 : A3B_FLAG_CONST_POOL);
+    h.loop_entry = loop_start >= 0 ? (uint16_t)loop_start : A3B_NO_ENTRY;
+    h.function_count = loop_start >= 0 ? 1 : 0;
+    h.const_count = (uint16_t)(pool.size() / 4);
+    h.code_size = (uint16_t)code.size();
+    h.debug_size = 3 + 5;
+    std::vector<uint8_t> packed(code.size());
+    if (compress) {
+        h.packed_size = (uint16_t)a3b_lz_compress(code.data(), code.size(), packed.data(), packed.size());
+        assert(h.packed_size > 0);
+        h.flags |= A3B_FLAG_COMPRESSED;
+    }
+    std::vector<uint8_t> image(a3b_total_size(&h), 0);
+    a3b_write_header(image.data(), &h);
+    if (loop_start >= 0) {
+        a3b_write_function(&image[A3B_HEADER_SIZE], (uint16_t)loop_start,
+                           (uint16_t)(code.size() - loop_start), "loop");
+    }
+    if (!pool.empty()) memcpy(&image[a3b_constants_offset(&h)], pool.data(), pool.size());
+    memcpy(&image[a3b_code_offset(&h)], compress ? packed.data() : code.data(), a3b_stored_code_size(&h));
+    uint8_t* label = &image[a3b_debug_offset(&h)];
+    a3b_put16(label, 0);
+    label[2] = 5;
+    memcpy(label + 3, "BLOCK", 5);
+    uint32_t crc = a3b_crc32_final(a3b_crc32_update(A3B_CRC_INIT, image.data(), image.size() - 4));
+    a3b_put32(&image[image.size() - 4], crc);
+    return image;
+}
+
+// An .a3b container loads without parsing: code runs in place, the loop
+// entry comes from the header, and damaged containers are rejected.
+void test_a3b_container(const std::string& vmcode_path) {
+    int loop_start = -1;
+    std::vector<uint8_t> program = parse_vmcode_file(vmcode_path, &loop_start);
+    assert(!program.empty() && loop_start >= 0);
+    std::vector<uint8_t> image = build_a3b(program, loop_start);
+
+    A3bImage parsed;
+    assert(a3b_parse(image.data(), image.size(), &parsed) == nullptr);
+    assert((a3b_code_offset(&parsed.header) & 3) == 0);
+    assert(a3b_get16(parsed.functions) == loop_start);
+    assert(memcmp(parsed.functions + 4, "loop", 5) == 0);
+
+    static TinyVM listing, container;
+    listing.reset();
+    listing.setLoopStart((size_t)loop_start);
+    assert(listing.loadProgram(program.data(), program.size()));
+    container.reset();
+    assert(container.loadImage(image.data(), image.size()));
+    assert(container.program == parsed.code && container.loop_start_pc == loop_start);
+    listing.run();
+    container.run();
+    listing.runLoop();
+    container.runLoop();
+    assert_same_state(listing, container);
+
+    std::vector<uint8_t> bad = image;
+    bad[a3b_code_offset(&parsed.header)] ^= 0xFF;
+    assert(std::string(a3b_parse(bad.data(), bad.size(), &parsed)) == "CRC mismatch");
+    assert(!container.loadImage(bad.data(), bad.size()) && container.program == nullptr);
+    bad = image;
+    bad[0] = 'X';
+    assert(std::string(a3b_parse(bad.data(), bad.size(), &parsed)) == "bad magic");
+    bad = image;
+    bad.pop_back();
+    assert(!container.loadImage(bad.data(), bad.size()));
+    // A loop entry inside an instruction fails verification like a listing's
+    image = build_a3b(program, loop_start + 1);
+    assert(!container.loadImage(image.data(), image.size()));
+
+    std::cout << "test_a3b_container completed successfully" << std::endl;
+}
+
+struct MemoryReader {
+    const std::vector<uint8_t>* data;
+    size_t at;
+};
+
+static int read_memory(void* user, uint8_t* dst, uint16_t len) {
+    MemoryReader* r = static_cast<MemoryReader*>(user);
+    if (r->at + len > r->data->size()) return 0;
+    memcpy(dst, r->data->data() + r->at, len);
+    r->at += len;
+    return 1;
+}
+
+static int emit_to_code(void* user, uint32_t at, uint8_t b) {
+    return emit_to_vector(user, at, b) ? 1 : 0;
+}
+
+// Compressed containers inflate to the original code, whether unpacked in
+// memory or streamed in pieces of any size, and damaged packed code is
+// rejected instead of producing a program.
+void test_compressed_container(const std::string& vmcode_path) {
+    int loop_start = -1;
+    std::vector<uint8_t> program = parse_vmcode_file(vmcode_path, &loop_start);
+    assert(!program.empty() && loop_start >= 0);
+
+    std::vector<uint8_t> packed(program.size());
+    size_t packed_size = a3b_lz_compress(program.data(), program.size(), packed.data(), packed.size());
+    assert(packed_size > 0 && packed_size < program.size());
+    packed.resize(packed_size);
+    for (size_t chunk : { (size_t)1, (size_t)7, packed.size() }) {
+        std::vector<uint8_t> out(program.size());
+        A3bInflate z;
+        a3b_inflate_init(&z);
+        for (size_t at = 0; at < packed.size(); at += chunk) {
+            assert(a3b_inflate(&z, packed.data() + at, std::min(chunk, packed.size() - at),
+                               (uint32_t)out.size(), emit_to_code, &out) == nullptr);
+        }
+        assert(z.out == program.size() && out == program);
+    }
+    // Random bytes do not shrink, and runs collapse into long matches
+    std::vector<uint8_t> noise(300), runs(600, NOP);
+    for (size_t i = 0; i < noise.size(); i++) noise[i] = (uint8_t)(i * 2654435761u >> 13);
+    assert(a3b_lz_compress(noise.data(), noise.size(), packed.data(), packed.size()) == 0);
+    std::vector<uint8_t> room(runs.size());
+    assert(a3b_lz_compress(runs.data(), runs.size(), room.data(), room.size()) <= 8);
+
+    std::vector<uint8_t> pool(4);
+    a3b_put32(&pool[0], 1500);
+    std::vector<uint8_t> stored = build_a3b(program, loop_start, pool);
+    std::vector<uint8_t> image = build_a3b(program, loop_start, pool, true);
+    assert(image.size() < stored.size());
+    static TinyVM plain, compressed;
+    plain.reset();
+    assert(plain.loadImage(stored.data(), stored.size()));
+    compressed.reset();
+    assert(!compressed.loadImage(image.data(), image.size()));
+    std::vector<uint8_t> unpack(program.size());
+    assert(!compressed.loadImage(image.data(), image.size(), unpack.data(), unpack.size() - 1));
+    assert(compressed.loadImage(image.data(), image.size(), unpack.data(), unpack.size()));
+    assert(compressed.program == unpack.data() && compressed.loop_start_pc == loop_start);
+    plain.run();
+    compressed.run();
+    plain.runLoop();
+    compressed.runLoop();
+    assert_same_state(plain, compressed);
+
+    // The streaming reader the firmware uses, on both kinds of container
+    for (const std::vector<uint8_t>* container : { &stored, &image }) {
+        MemoryReader reader = { container, 0 };
+        A3bStream stream;
+        std::vector<uint8_t> code(program.size()), constants(4);
+        assert(a3b_stream_begin(&stream, read_memory, &reader) == nullptr);
+        assert(a3b_stream_body(&stream, nullptr, constants.data(), emit_to_code, &code) == nullptr);
+        assert(code == program && constants == pool && reader.at == container->size());
+    }
+
+    // A match reaching before the start, a stream that ends early, and a
+    // corrupted container
+    const uint8_t backwards[] = { 0x01, 4, 0 };
+    std::vector<uint8_t> out(16);
+    A3bInflate z;
+    a3b_inflate_init(&z);
+    assert(std::string(a3b_inflate(&z, backwards, sizeof(backwards), 16, emit_to_code, &out)) ==
+           "match before the start");
+    a3b_inflate_init(&z);
+    const uint8_t too_long[] = { 0x02, HALT, 0, 20 };
+    assert(std::string(a3b_inflate(&z, too_long, sizeof(too_long), 16, emit_to_code, &out)) ==
+           "packed code too long");
+    A3bImage parsed;
+    assert(a3b_parse(image.data(), image.size(), &parsed) == nullptr);
+    parsed.header.code_size++;
+    assert(std::string(a3b_unpack(&parsed, unpack.data(), program.size() + 1)) == "packed code truncated");
+    std::vector<uint8_t> bad = image;
+    bad[a3b_code_offset(&parsed.header) + 1] ^= 0x40;
+    assert(!compressed.loadImage(bad.data(), bad.size(), unpack.data(), unpack.size()));
+    MemoryReader reader = { &bad, 0 };
+    A3bStream stream;
+    std::vector<uint8_t> code(program.size());
+    assert(a3b_stream_begin(&stream, read_memory, &reader) == nullptr);
+    assert(a3b_stream_body(&stream, nullptr, nullptr, emit_to_code, &code) != nullptr);
+
+    std::cout << "test_compressed_container completed successfully" << std::endl;
+}
+
+// LOADK reads the program's constant pool; indices past the pool are
+// rejected by the verifier and stop unverified (paged) programs.
+void test_constant_pool() {
+    std::vector<uint8_t> pool(8);
+    a3b_put32(&pool[0], 1500);
+    a3b_put32(&pool[4], (uint32_t)-70000);
+    std::vector<uint8_t> program = {
+        LOADK, 1, 0,
+        LOADK, 2, 1,
+        CMP, 1, 2,
+        HALT, 0, 0
+    };
+
+    TinyVM fast, slow;
+    fast.setConstPool(pool.data(), 2);
+    assert(fast.loadProgram(program.data(), program.size()));
+    fast.run();
+    slow.setConstPool(pool.data(), 2);
+    assert(slow.loadProgram(program.data(), program.size()));
+    while (slow.running) slow.step();
+    assert(fast.registers[1] == 1500 && fast.registers[2] == -70000);
+    assert_same_state(fast, slow);
+
+    std::vector<uint8_t> image = build_a3b(program, -1, pool);
+    TinyVM container;
+    assert(container.loadImage(image.data(), image.size()));
+    container.run();
+    assert_same_state(fast, container);
+
+    // Only one constant: LOADK 2, 1 is out of range
+    fast.reset();
+    fast.setConstPool(pool.data(), 1);
+    assert(!fast.loadProgram(program.data(), program.size()));
+    static CodePager pager;
+    pager.begin(read_image, &program, program.size());
+    slow.reset();
+    slow.setConstPool(pool.data(), 1);
+    assert(slow.loadPaged(pager));
+    slow.run();
+    assert(slow.status() == TinyVM::RUN_ERROR && slow.registers[1] == 1500);
+
+    std::cout << "test_constant_pool completed successfully" << std::endl;
+}
+
+// Every mnemonic resolves through the perfect hash; near misses that land
+// in a used slot are still rejected by the name check.
+void test_mnemonic_hash() {
+    int count = 0;
+#define CHECK_MNEMONIC(m) assert(opcodeForMnemonic(#m, strlen(#m)) == m); count++;
+    VM_MNEMONICS(CHECK_MNEMONIC)
+#undef CHECK_MNEMONIC
+    assert(count == 56);
+
+    const char* line = "LOADI16 1 0 300";
+    assert(opcodeForMnemonic(line, 7) == LOADI16);
+    assert(opcodeForMnemonic(line, 5) == LOADI);
+    assert(opcodeForMnemonic(line, 4) == LOAD);
+    for (const char* bad : { "", "L", "LOA", "ADD4", "add", "JMPX", "LOAD_ADD", "F_CMP_JZ" }) {
+        assert(opcodeForMnemonic(bad, strlen(bad)) == 0xFF);
+    }
+
+    std::cout << "test_mnemonic_hash completed successfully" << std::endl;
+}
+
+// Feeding a listing in chunks of any size assembles the same bytes as one
+// span; malformed lines stop the load with their line number.
+void test_vmcode_loader(const std::string& vmcode_path) {
+    MappedImage text;
+    assert(text.open(vmcode_path.c_str()));
+    const char* data = reinterpret_cast<const char*>(text.data());
+    Listing whole;
+    assert(assemble_listing(vmcode_path, whole) && whole.loop_start >= 0);
+
+    std::vector<uint8_t> out(text.size());
+    VmcodeLoader loader;
+    for (size_t chunk : { (size_t)1, (size_t)7, (size_t)512 }) {
+        loader.begin(emit_to_vector, &out);
+        for (size_t at = 0; at < text.size(); at += chunk) {
+            assert(loader.feed(data + at, std::min(chunk, text.size() - at)));
+        }
+        assert(loader.finish());
+        assert(loader.size == whole.program.size());
+        assert(std::equal(whole.program.begin(), whole.program.end(), out.begin()));
+        assert((int)loader.loopEntry == whole.loop_start);
+    }
+
+    const char listing[] =
+        "# FUNCTION setup\r\n"
+        "# CONST 1 -70000\r\n"
+        "  LOADK 1 1\r\n"
+        "\r\n"
+        "# FUNCTION loop2\n"
+        "LOADI16 2 0 1500\n"
+        "# FUNCTION loop\n"
+        "HALT 0 0";                 // no final newline
+    uint8_t pool[A3B_MAX_CONSTS * 4];
+    VmcodeFunction functions[2];
+    loader.begin(emit_to_vector, &out, pool, functions, 2);
+    assert(loader.load(listing, sizeof(listing) - 1));
+    assert(loader.size == 11 && loader.line == 8);
+    assert(out[0] == LOADK && out[3] == LOADI16 && out[6] == 0xDC && out[7] == 0x05 && out[8] == HALT);
+    assert(loader.loopEntry == 8 && loader.constCount == 2);
+    assert(a3b_get32(pool) == 0 && (int32_t)a3b_get32(pool + 4) == -70000);
+    assert(loader.functionCount == 3);
+    assert(strcmp(functions[0].name, "setup") == 0 && functions[0].start == 0);
+    assert(strcmp(functions[1].name, "loop2") == 0 && functions[1].start == 3);
+
+    struct { const char* text; uint32_t line; } bad[] = {
+        { "NOP 0 0\nFOO 1 2\n", 2 },              // unknown mnemonic
+        { "# c\nBEQ 1 2\n", 2 },                  // missing operands
+        { "NOP 0 0\nNOP 0 0\nLOADI16 1 0\n", 3 }, // missing trailing word
+        { "ADD 1 2 3\n", 1 },                     // extra column
+        { "# CONST 256 1\n", 1 },
+    };
+    for (const auto& b : bad) {
+        loader.begin(emit_to_vector, &out);
+        assert(!loader.load(b.text, strlen(b.text)));
+        assert(loader.error != nullptr && loader.line == b.line);
+    }
+
+    // The output refuses bytes past its end
+    std::vector<uint8_t> small(4);
+    loader.begin(emit_to_vector, &small);
+    assert(!loader.load("NOP 0 0\nNOP 0 0\n", 16) && loader.line == 2);
+
+    std::cout << "test_vmcode_loader completed successfully" << std::endl;
+}
+
+// A staged program takes over only at the next loop boundary: the
+// iteration in flight finishes on the old code, and a rejected update
+// leaves the running program alone.
+void test_hot_swap() {
+    const uint8_t first[] = {
+        LOADI, 1, 0,
+        HALT, 0, 0,
+        LOADI, 2, 1,        // 6: loop(): R1 += 1
+        ADD3, 1, 0x12,
+        RET, 0, 0
+    };
+    const uint8_t second[] = {
+        LOADI, 1, 100,
+        HALT, 0, 0,
+        LOADI, 2, 10,       // 6: loop(): R1 += 10
+        ADD3, 1, 0x12,
+        RET, 0, 0
+    };
+    const uint8_t broken[] = { LOADI, 9, 0, HALT, 0, 0 };
+
+    TinyVM vm;
+    vm.setLoopStart(6);
+    assert(vm.loadProgram(first, sizeof(first)));
+    vm.run();
+    vm.runLoop();
+    vm.runLoop();
+    assert(vm.registers[1] == 2);
+
+    // Staged mid-iteration: the rest of it still runs the first program
+    assert(vm.beginLoop());
+    assert(vm.runFor(1) == TinyVM::RUN_YIELDED);
+    assert(vm.stageProgram(second, sizeof(second), 6, true) && vm.swapPending());
+    vm.runFor(100);
+    assert(vm.registers[1] == 3 && vm.program == first);
+    vm.runLoop();
+    assert(vm.registers[1] == 13 && vm.program == second && vm.swaps == 1 && !vm.swapPending());
+
+    // Without keepRegisters the new setup code runs before its first loop
+    assert(vm.stageProgram(second, sizeof(second), 6, false));
+    vm.runLoop();
+    assert(vm.registers[1] == 110 && vm.swaps == 2);
+
+    // Rejected updates: bad code, no loop entry, loop entry mid-instruction
+    assert(!vm.stageProgram(broken, sizeof(broken), 0, true) && !vm.swapPending());
+    assert(!vm.stageProgram(first, sizeof(first), -1, true));
+    assert(!vm.stageProgram(first, sizeof(first), 7, true));
+    vm.runLoop();
+    assert(vm.registers[1] == 120 && vm.program == second);
+
+    // Containers bring their own loop entry; a full load drops a staged swap
+    std::vector<uint8_t> image = build_a3b(std::vector<uint8_t>(first, first + sizeof(first)), 6);
+    assert(vm.stageImage(image.data(), image.size(), false));
+    vm.runLoop();
+    assert(vm.registers[1] == 1 && vm.swaps == 3);
+    assert(vm.stageProgram(second, sizeof(second), 6, true));
+    assert(vm.loadProgram(first, sizeof(first)) && !vm.swapPending());
+
+    std::cout << "test_hot_swap completed successfully" << std::endl;
+}
+
+struct UploadBoard {
+    TinyVM* vm;
+    std::vector<uint8_t> code, functions, pool;
+    std::vector<std::string> replies;
+};
+
+static void collect_reply(void* user, const char* line) {
+    static_cast<UploadBoard*>(user)->replies.push_back(line);
+}
+
+static const char* stage_upload(void* user, const A3bHeader& h) {
+    UploadBoard* board = static_cast<UploadBoard*>(user);
+    bool staged = board->vm->stageProgram(board->code.data(), h.code_size, h.loop_entry, false,
+                                          board->pool.data(), h.const_count, h.setup_entry);
+    return staged ? nullptr : "rejected by verifier";
+}
+
+// A delta upload copies the functions the board already runs, relocating
+// them, and sends only the rest; damaged uploads are refused.
+void test_delta_update() {
+    // The update adds h in front and changes g: f and loop only move, and
+    // their CALL targets with them
+    const uint8_t first[] = {
+        JMP, 24, 0,
+        LOADI, 1, 5, CALL, 12, 0, RET, 0, 0,    // f
+        LOADI, 2, 7, RET, 0, 0,                 // g
+        CALL, 3, 0, RET, 0, 0,                  // loop
+        LOADI, 3, 1, HALT, 0, 0
+    };
+    const uint8_t second[] = {
+        JMP, 30, 0,
+        LOADI, 4, 9, RET, 0, 0,                 // h
+        LOADI, 1, 5, CALL, 18, 0, RET, 0, 0,    // f
+        LOADI, 2, 8, RET, 0, 0,                 // g
+        CALL, 9, 0, RET, 0, 0,                  // loop
+        LOADI, 3, 1, HALT, 0, 0
+    };
+    std::vector<uint8_t> first_table(3 * A3B_FUNCTION_SIZE), second_table(4 * A3B_FUNCTION_SIZE);
+    a3b_write_function(&first_table[0], 3, 9, "f");
+    a3b_write_function(&first_table[16], 12, 6, "g");
+    a3b_write_function(&first_table[32], 18, 6, "loop");
+    a3b_write_function(&second_table[0], 3, 6, "h");
+    a3b_write_function(&second_table[16], 9, 9, "f");
+    a3b_write_function(&second_table[32], 18, 6, "g");
+    a3b_write_function(&second_table[48], 24, 6, "loop");
+    DeltaProgram running = { first, sizeof(first), first_table.data(), 3 };
+    DeltaProgram next = { second, sizeof(second), second_table.data(), 4 };
+    assert(deltaFunctionHash(running, 0) == deltaFunctionHash(next, 1));
+    assert(deltaFunctionHash(running, 2) == deltaFunctionHash(next, 3));
+    assert(deltaFunctionHash(running, 1) != deltaFunctionHash(next, 2));
+
+    TinyVM vm;
+    vm.setLoopStart(18);
+    assert(vm.loadProgram(first, sizeof(first)));
+    vm.run();
+    vm.runLoop();
+    assert(vm.registers[1] == 5 && vm.registers[2] == 7);
+
+    static UploadBoard board;
+    board.vm = &vm;
+    board.code.assign(VM_MAX_PROGRAM_SIZE, 0);
+    board.functions.assign(8 * A3B_FUNCTION_SIZE, 0);
+    board.pool.assign(A3B_MAX_CONSTS * 4, 0);
+    DeltaReceiver receiver;
+    receiver.begin(collect_reply, stage_upload, &board);
+    receiver.setCurrent(running);
+    receiver.setTarget(board.code.data(), VM_MAX_PROGRAM_SIZE, board.functions.data(), 8, board.pool.data());
+    receiver.feed("HASHES\r\n", 8);
+    assert(board.replies.size() == 4 && board.replies.back() == "OK 30");
+    std::vector<RunningFunction> functions(3);
+    for (int i = 0; i < 3; i++) assert(parse_running_function(board.replies[i], functions[i]));
+    assert(functions[2].name == "loop" && functions[2].start == 18);
+
+    A3bHeader h = {};
+    h.loop_entry = 24;
+    UploadPlan plan = plan_upload(h, next, nullptr, functions);
+    assert(plan.copied == 2 && plan.sent == sizeof(second) - 9 - 6);
+    for (const std::string& command : plan.commands) {
+        std::string line = command + "\n";
+        receiver.feed(line.data(), line.size());
+        assert(board.replies.back().compare(0, 2, "OK") == 0);
+    }
+    assert(board.replies.back() == "OK 2 copied, 21 bytes sent");
+    assert(memcmp(board.code.data(), second, sizeof(second)) == 0 && vm.swapPending());
+    vm.runLoop();
+    assert(vm.swaps == 1 && vm.program == board.code.data());
+    assert(vm.registers[1] == 5 && vm.registers[2] == 8 && vm.registers[3] == 1);
+
+    // A damaged DATA line fails the CRC; commands outside an upload, long
+    // lines and oversized programs are refused
+    std::vector<uint8_t> spare(VM_MAX_PROGRAM_SIZE);
+    receiver.setTarget(spare.data(), VM_MAX_PROGRAM_SIZE, board.functions.data(), 8, board.pool.data());
+    for (std::string command : plan.commands) {
+        if (command.compare(0, 5, "DATA ") == 0) command.back() = command.back() == '0' ? '1' : '0';
+        command += "\n";
+        receiver.feed(command.data(), command.size());
+    }
+    assert(board.replies.back() == "ERR CRC mismatch" && vm.swapPending() == false);
+    // So does a damaged FN entry: the CRC covers the header, function table
+    // and pool as well as the code
+    for (std::string command : plan.commands) {
+        if (command == "FN 3 24 6 loop") command.back() = 'q';
+        command += "\n";
+        receiver.feed(command.data(), command.size());
+    }
+    assert(board.replies.back() == "ERR CRC mismatch" && vm.swapPending() == false);
+
+    // The buffers are pinned at BEGIN; retargeting mid-upload has no effect
+    std::fill(spare.begin(), spare.end(), 0);
+    for (size_t i = 0; i < plan.commands.size(); i++) {
+        std::string command = plan.commands[i] + "\n";
+        receiver.feed(command.data(), command.size());
+        if (i == 0) {
+            assert(receiver.busy());
+            receiver.setTarget(nullptr, 0, nullptr, 0, nullptr);
+        }
+    }
+    assert(!receiver.busy() && board.replies.back() == "OK 2 copied, 21 bytes sent");
+    assert(memcmp(spare.data(), second, sizeof(second)) == 0);
+    receiver.feed("COPY 0 0\n", 9);
+    assert(board.replies.back() == "ERR no upload in progress");
+    std::string line(DELTA_LINE_MAX + 1, 'x');
+    line += '\n';
+    receiver.feed(line.data(), line.size());
+    assert(board.replies.back() == "ERR line too long");
+    line = "BEGIN 4000 0 0 0 0 0\n";
+    receiver.feed(line.data(), line.size());
+    assert(board.replies.back() == "ERR program too large");
+
+    std::cout << "test_delta_update completed successfully" << std::endl;
+}
+
+void test_fusion_matches_step(const std::string& vmcode_path) {
+    int loop_start = -1;
+    std::vector<uint8_t> pool;
+    std::vector<uint8_t> program = parse_vmcode_file(vmcode_path, &loop_start, &pool);
+    assert(!program.empty());
+
+    static TinyVM fast, slow;
+    fast.reset();
+    fast.setConstPool(pool.data(), (uint16_t)(pool.size() / 4));
+    slow.reset();
+    slow.setConstPool(pool.data(), (uint16_t)(pool.size() / 4));
+    assert(fast.loadProgram(program.data(), program.size()));
+    assert(slow.loadProgram(program.data(), program.size()));
+
+    size_t sites = 0;
+    for (size_t i = 0; i < FUSION_PATTERN_COUNT; i++) sites += fast.fusionSites[i];
+
+    for (int pass = 0; pass < 5; pass++) {
+        // Pass 0 runs main, passes 1-4 run loop() with each sensor pattern
+        if (pass > 0 && loop_start < 0) break;
+        mock_set_analog_read(sensorIzqPin, (pass & 1) ? 4095 : 0);
+        mock_set_analog_read(sensorDerPin, (pass & 2) ? 4095 : 0);
+        fast.pc = slow.pc = (uint16_t)(pass == 0 ? 0 : loop_start);
+        fast.sp = slow.sp = 0;
+        fast.running = slow.running = true;
+        // Both runs start from the same robot speed (getSpeed/setSpeed)
+        int speed = speed_global;
+        fast.execute();
+        int fast_speed = speed_global;
+        speed_global = speed;
+        while (slow.running) slow.step();
+        assert(speed_global == fast_speed);
+
+        for (int r = 0; r < NUM_REGISTERS; r++) assert(fast.registers[r] == slow.registers[r]);
+        assert(fast.flags.valid == slow.flags.valid && fast.flags.lhs == slow.flags.lhs &&
+               fast.flags.rhs == slow.flags.rhs);
+        assert(fast.sp == slow.sp);
+        assert(memcmp(fast.heap, slow.heap, sizeof(fast.heap)) == 0);
+    }
+
+    std::cout << "test_fusion_matches_step(" << vmcode_path << ") completed successfully, "
+              << sites << " fused sites" << std::endl;
+}
+
 int main() {
     std::cout << "Starting VM Test with program.vmcode..." << std::endl;
     test_program_vmcode();
+    test_verifier();
+    test_compare_branch();
+    test_flags_before_compare();
+    test_indexed_words();
+    test_heap_arena();
+    test_stack_frames();
+    test_return_stack();
+    test_time_slicing();
+    test_vm_policies();
+    test_fusion_matches_step("../../language/program.vmcode");
+    test_fusion_matches_step("../../sigue-lineas.vmcode");
+    test_fusion_matches_step("../../cont-lineas.vmcode");
+    test_trace_cache("../../sigue-lineas.vmcode");
+    test_snapshot_fork("../../sigue-lineas.vmcode");
+    test_snapshot_fork("../../cont-lineas.vmcode");
+    test_paged_code("../../sigue-lineas.vmcode");
+    test_mapped_image("../../cont-lineas.vmcode");
+    test_a3b_container("../../sigue-lineas.vmcode");
+    test_compressed_container("../../sigue-lineas.vmcode");
+    test_constant_pool();
+    test_mnemonic_hash();
+    test_vmcode_loader("../../sigue-lineas.vmcode");
+    test_hot_swap();
+    test_delta_update();
+#ifdef VM_JIT_AVAILABLE
+    test_jit_edge_cases();
+    test_jit_matches_interpreter("../../language/program.vmcode");
+    test_jit_matches_interpreter("../../sigue-lineas.vmcode");
+    test_jit_matches_interpreter("../../cont-lineas.vmcode");
+#endif
     std::cout << "Test completed!" << std::endl;
     return 0;
 }
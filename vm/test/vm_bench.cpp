@@ -0,0 +1,329 @@
+#define UNIT_TESTING
+#include "mock_arduino.h"
+#include "../vm_complete.ino"
+#include "listing_file.h"
+#include <iostream>
+#include <vector>
+#include <string>
+#include <chrono>
+
+MockSerial Serial;
+
+// Host benchmark for the TinyVM dispatch engine. The same source is built
+// once per engine (see Makefile "bench" target): the default threaded engine,
+// -DVM_DISPATCH_SWITCH and -DVM_TRACE_CACHE, so the runs execute identical
+// code paths apart from instruction dispatch. "make fusion-stats" builds it with
+// VM_FUSION_STATS to also report how often each superinstruction executed.
+
+#if defined(VM_EAGER_FLAGS) && defined(VM_DISPATCH_THREADED)
+static const char* ENGINE_NAME = "threaded+eager-flags";
+#elif defined(VM_EAGER_FLAGS)
+static const char* ENGINE_NAME = "switch+eager-flags";
+#elif defined(VM_DISPATCH_THREADED) && defined(VM_TRACE_CACHE)
+static const char* ENGINE_NAME = "threaded+trace";
+#elif defined(VM_DISPATCH_THREADED)
+static const char* ENGINE_NAME = "threaded";
+#else
+static const char* ENGINE_NAME = "switch";
+#endif
+
+static const int BENCH_ITERATIONS = 200000;
+
+// Counts the instructions executed by one loop() iteration using step().
+static long count_loop_instructions(TinyVM& vm) {
+    long count = 0;
+    vm.beginLoop();
+    while (vm.running) {
+        vm.step();
+        count++;
+    }
+    return count;
+}
+
+// Times loop() of one listing. With stub_io, TRAP and PRINT become NOPs
+// (same length, operands ignored) so the timing is dispatch and not the
+// mock Serial/analogRead behind call_trap; the sensor registers then keep
+// whatever main() left in them, and the loop takes that path every time.
+static bool bench_file(const std::string& path, bool stub_io) {
+    Listing listing;
+    if (!assemble_listing(path, listing) || listing.program.empty()) {
+        std::cerr << "Failed to load " << path << ": " << listing.error << std::endl;
+        return false;
+    }
+    std::vector<uint8_t> program = listing.program;
+    const std::vector<uint8_t>& pool = listing.pool;
+    if (stub_io) {
+        for (size_t at = 0; at < program.size(); at += TinyVM::instructionLength(program[at])) {
+            if (program[at] == TRAP || program[at] == PRINT) program[at] = NOP;
+        }
+    }
+    int loop_start = listing.loop_start;
+    if (loop_start < 0) {
+        std::cerr << path << " has no loop function" << std::endl;
+        return false;
+    }
+
+    // Silence Serial output from PRINT and the IR traps while timing
+    std::streambuf* saved = std::cout.rdbuf(nullptr);
+
+    static TinyVM vm;
+    vm.reset();
+    vm.setLoopStart((size_t)loop_start);
+    vm.setConstPool(pool.data(), (uint16_t)(pool.size() / 4));
+    if (!vm.loadProgram(program.data(), program.size())) {
+        std::cout.rdbuf(saved);
+        std::cerr << path << " rejected by verifier" << std::endl;
+        return false;
+    }
+    vm.run();
+
+    long per_iteration = count_loop_instructions(vm);
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        vm.runLoop();
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    std::cout.rdbuf(saved);
+    std::cout.clear();
+
+    double total_ns = std::chrono::duration<double, std::nano>(end - start).count();
+    double ns_per_iter = total_ns / BENCH_ITERATIONS;
+    double ns_per_instr = ns_per_iter / (double)per_iteration;
+
+    std::cout << ENGINE_NAME << "  " << path << (stub_io ? " (I/O stubbed)" : "") << ": "
+              << per_iteration << " instr/loop, "
+              << ns_per_iter << " ns/loop, "
+              << ns_per_instr << " ns/instr" << std::endl;
+    if (!stub_io) {
+        vm.dumpFusionStats();
+        vm.dumpTraceStats();
+    }
+    return true;
+}
+
+// Runs a trap-free synthetic program that counts R1 up to 60000 and
+// reports the time per executed instruction
+static bool bench_loop(const char* name, const uint8_t* program, size_t size, long per_run) {
+    const int repeats = 20;
+    std::streambuf* saved = std::cout.rdbuf(nullptr);
+    static TinyVM vm;
+    vm.reset();
+    bool ok = vm.loadProgram(program, size);
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; ok && i < repeats; i++) {
+        vm.pc = 0;
+        vm.running = true;
+        vm.run();
+    }
+    auto end = std::chrono::steady_clock::now();
+    std::cout.rdbuf(saved);
+    std::cout.clear();
+    if (!ok || vm.status() != TinyVM::RUN_HALTED || vm.registers[1] != 60000) {
+        std::cerr << name << " failed" << std::endl;
+        return false;
+    }
+
+    double total_ns = std::chrono::duration<double, std::nano>(end - start).count();
+    std::cout << ENGINE_NAME << "  " << name << ": "
+              << per_run << " instr/run, "
+              << total_ns / ((double)per_run * repeats) << " ns/instr" << std::endl;
+    return true;
+}
+
+// Compare-heavy synthetic loop: every iteration runs two CMP+Jcc pairs,
+// one of which only reads one condition of the five CMP defines.
+static bool bench_compare_loop() {
+    static const uint8_t program[] = {
+        LOADI, 1, 0,
+        LOADI16, 2, 0, 0x60, 0xEA,      // R2 = 60000
+        LOADI, 3, 1,
+        LOADI, 4, 100,
+        ADD3, 1, 0x13,                  // 14: R1 = R1 + R3
+        CMP, 1, 4,
+        JLE, 26, 0,                     // skip once past 100
+        LOADI, 5, 1,
+        CMP, 1, 2,                      // 26
+        JLT, 14, 0,
+        HALT, 0, 0
+    };
+    return bench_loop("compare loop", program, sizeof(program), 4 + 100 * 5 + 59900L * 6 + 1);
+}
+
+// Dispatch-bound mix without I/O: arithmetic, a call with a push/pop pair,
+// a heap word round trip and a compare-branch back edge per iteration.
+static bool bench_mixed_loop() {
+    static const uint8_t program[] = {
+        LOADI, 1, 0,
+        LOADI16, 2, 0, 0x60, 0xEA,      // R2 = 60000
+        LOADI, 3, 1,
+        LOADI, 6, 0,
+        ADD3, 1, 0x13,                  // 14: R1 = R1 + R3
+        MUL3, 4, 0x11,                  // R4 = R1 * R1
+        CALL, 37, 0,
+        STOREX, 4, 0x66,                // word[0] = R4
+        LOADX, 5, 0x66,                 // R5 = word[0]
+        BLT, 1, 2, 14, 0,
+        HALT, 0, 0,                     // 34
+        PUSH, 4, 0,                     // 37
+        XOR3, 5, 0x45,                  // R5 = R4 ^ R5
+        POP, 4, 0,
+        RET, 0, 0
+    };
+    return bench_loop("mixed loop", program, sizeof(program), 4 + 60000L * 10 + 1);
+}
+
+// Assembles a generated 100k-instruction listing with VmcodeLoader, once
+// from a single span (a mapped file on the host) and once in 512-byte
+// chunks the way the firmware reads SD sectors.
+static bool bench_listing_load() {
+    static const char* const lines[] = {
+        "LOADI     1   7\n", "ADD3      2  18\n", "LOADI16   3   0 1500\n",
+        "CMP       2   3\n", "BLT       2   3 96\n", "LOADK     4   0\n",
+        "CALL     48   0\n", "STOREX    4  35\n", "JMP       0   0\n",
+        "# BLOCK\n"
+    };
+    const long instructions = 100000;
+    std::string text = "# CONST 0 100000\n# FUNCTION loop\n";
+    long emitted = 0;
+    for (size_t i = 0; emitted < instructions; i++) {
+        const char* line = lines[i % (sizeof(lines) / sizeof(lines[0]))];
+        text += line;
+        if (line[0] != '#') emitted++;
+    }
+
+    std::vector<uint8_t> program(text.size());
+    VmcodeLoader loader;
+    const int repeats = 20;
+    bool ok = true;
+    for (size_t chunk : { text.size(), (size_t)512 }) {
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; ok && i < repeats; i++) {
+            loader.begin(emit_to_vector, &program);
+            for (size_t at = 0; ok && at < text.size(); at += chunk) {
+                ok = loader.feed(text.data() + at, std::min(chunk, text.size() - at));
+            }
+            ok = ok && loader.finish();
+        }
+        auto end = std::chrono::steady_clock::now();
+        if (!ok || loader.line < instructions) {
+            std::cerr << "listing load failed at line " << loader.line << ": "
+                      << (loader.error ? loader.error : "short") << std::endl;
+            return false;
+        }
+        double ms = std::chrono::duration<double, std::milli>(end - start).count() / repeats;
+        std::cout << "listing load (" << (chunk == text.size() ? "span" : "512-byte chunks")
+                  << "): " << instructions << " instr, " << text.size() / 1024 << " KB, "
+                  << loader.size << " bytes, " << ms << " ms, "
+                  << ms * 1e6 / instructions << " ns/instr" << std::endl;
+    }
+    return true;
+}
+
+// Serves a file from memory no faster than an SD card on SPI, which moves
+// roughly 500 KB/s once FAT overhead is counted
+static const long SLOW_READ_NS_PER_BYTE = 2000;
+
+struct SlowReader {
+    const uint8_t* data;
+    size_t size;
+    size_t at;
+
+    size_t read(uint8_t* dst, size_t len) {
+        len = std::min(len, size - at);
+        auto until = std::chrono::steady_clock::now() + std::chrono::nanoseconds(len * SLOW_READ_NS_PER_BYTE);
+        memcpy(dst, data + at, len);
+        at += len;
+        while (std::chrono::steady_clock::now() < until) {
+        }
+        return len;
+    }
+};
+
+static int read_slow(void* user, uint8_t* dst, uint16_t len) {
+    return static_cast<SlowReader*>(user)->read(dst, len) == len;
+}
+
+static int emit_to_program(void* user, uint32_t at, uint8_t b) {
+    return emit_to_vector(user, at, b) ? 1 : 0;
+}
+
+// Boot-time load of one program through SlowReader: the text listing in
+// 512-byte blocks as loadListingFromSD() reads it, then the .a3b container
+// stored and compressed, streamed like loadImageFromSD().
+static bool bench_image_load(const std::string& path) {
+    Listing listing;
+    MappedImage text;
+    if (!assemble_listing(path, listing) || !text.open(path.c_str())) {
+        std::cerr << "Failed to load " << path << ": " << listing.error << std::endl;
+        return false;
+    }
+    const int repeats = 10;
+    std::vector<uint8_t> program(listing.program.size());
+    std::cout << "load " << path << " (" << 1e6 / SLOW_READ_NS_PER_BYTE << " KB/s reader):";
+
+    double listing_ms = 0;
+    for (int i = 0; i < repeats; i++) {
+        SlowReader reader = { text.data(), text.size(), 0 };
+        auto start = std::chrono::steady_clock::now();
+        VmcodeLoader loader;
+        loader.begin(emit_to_vector, &program);
+        char block[512];
+        size_t got;
+        while ((got = reader.read(reinterpret_cast<uint8_t*>(block), sizeof(block))) > 0 &&
+               loader.feed(block, got)) {
+        }
+        bool ok = loader.finish();
+        listing_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        if (!ok || program != listing.program) {
+            std::cerr << " listing load failed" << std::endl;
+            return false;
+        }
+    }
+    std::cout << " listing " << text.size() << " B " << listing_ms / repeats << " ms";
+
+    for (bool compress : { false, true }) {
+        std::vector<uint8_t> image = listing_container(listing, compress);
+        std::vector<uint8_t> pool(A3B_MAX_CONSTS * 4);
+        double ms = 0;
+        for (int i = 0; i < repeats; i++) {
+            SlowReader reader = { image.data(), image.size(), 0 };
+            std::fill(program.begin(), program.end(), 0);
+            auto start = std::chrono::steady_clock::now();
+            A3bStream stream;
+            const char* error = a3b_stream_begin(&stream, read_slow, &reader);
+            if (error == nullptr) error = a3b_stream_body(&stream, nullptr, pool.data(), emit_to_program, &program);
+            ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            if (error != nullptr || program != listing.program) {
+                std::cerr << " container load failed: " << (error ? error : "code differs") << std::endl;
+                return false;
+            }
+        }
+        std::cout << (compress ? ", a3b compressed " : ", a3b ") << image.size() << " B " << ms / repeats << " ms";
+    }
+    std::cout << std::endl;
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    std::vector<std::string> files;
+    for (int i = 1; i < argc; i++) files.push_back(argv[i]);
+    if (files.empty()) {
+        files.push_back("../../sigue-lineas.vmcode");
+        files.push_back("../../cont-lineas.vmcode");
+    }
+
+    bool ok = true;
+    for (const std::string& f : files) {
+        ok = bench_file(f, false) && ok;
+        ok = bench_file(f, true) && ok;
+    }
+    ok = bench_compare_loop() && ok;
+    ok = bench_mixed_loop() && ok;
+    ok = bench_listing_load() && ok;
+    for (const std::string& f : files) {
+        ok = bench_image_load(f) && ok;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,500 @@
+#pragma once
+
+// Host-only x86-64 JIT for TinyVM, used by `vm_runner --jit` for offline
+// simulation runs. Include after ../vm_complete.ino.
+//
+// compile() translates a verified program block by block into native code
+// in an mmap'd buffer. Register, flag and branch instructions are emitted
+// inline and operate directly on TinyVM's registers and flags. Everything
+// that can fail, touches the stack or heap, or reaches the outside world
+// (TRAP, PRINT, HALT, CALL, RET, ...) calls a helper that repeats the
+// execute() body for that opcode, so results match the interpreter bit for
+// bit, including the final pc and error messages.
+//
+// Generated code keeps the TinyVM* in rbx, the register file in r12 and the
+// bytecode-offset -> native-address table (used by RET) in r13.
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define VM_JIT_AVAILABLE
+
+#include <sys/mman.h>
+#include <vector>
+
+class TinyJit {
+public:
+    explicit TinyJit(TinyVM& vm) : vm(vm) {}
+
+    ~TinyJit() { release(); }
+
+    TinyJit(const TinyJit&) = delete;
+    TinyJit& operator=(const TinyJit&) = delete;
+
+    // Compiles the program currently loaded in the VM. Returns false if no
+    // program is loaded or executable memory cannot be mapped.
+    bool compile() {
+        release();
+        if (vm.program == nullptr || vm.programSize == 0) return false;
+
+        code.clear();
+        fixups.clear();
+        nativeOffset.assign(vm.programSize, 0);
+        emitPrologue();
+        for (size_t addr = 0; addr < vm.programSize;
+             addr += TinyVM::instructionLength(vm.program[addr])) {
+            nativeOffset[addr] = code.size();
+            emitInstruction(addr);
+        }
+        emitExits();
+
+        for (const Fixup& f : fixups) {
+            size_t target = f.toExit ? f.target : nativeOffset[f.target];
+            patch32(f.at, (uint32_t)(target - (f.at + 4)));
+        }
+
+        size_t len = code.size();
+        void* mem = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) return false;
+        memcpy(mem, code.data(), len);
+        if (mprotect(mem, len, PROT_READ | PROT_EXEC) != 0) {
+            munmap(mem, len);
+            return false;
+        }
+        native = (uint8_t*)mem;
+        nativeSize = len;
+
+        table.assign(vm.programSize, nullptr);
+        for (size_t addr = 0; addr < vm.programSize; addr++) {
+            if (vm.isInstructionStart(addr)) table[addr] = native + nativeOffset[addr];
+        }
+        return true;
+    }
+
+    // Same contract as TinyVM::run(): runs from vm.pc until the program stops
+    void run() {
+        if (!vm.running || native == nullptr) return;
+        if (vm.pc >= table.size() || table[vm.pc] == nullptr) {
+            vm.running = false;
+            return;
+        }
+        typedef uint32_t (*Entry)(TinyVM*, int32_t*, void**, void*);
+        Entry entry = (Entry)(void*)native;
+        uint32_t stop = entry(&vm, vm.registers, table.data(), table[vm.pc]);
+        vm.running = false;
+        vm.pc = (uint16_t)stop;
+    }
+
+    // Same contract as TinyVM::runLoop()
+    void runLoop() {
+        if (!vm.beginLoop()) return;
+        run();
+    }
+
+private:
+    // Helpers return 0 to continue, or STOP | pc to stop with vm.pc = pc.
+    // RET returns the bytecode address to continue at instead of 0.
+    static const uint32_t STOP = 0x10000;
+
+    typedef uint32_t (*Helper)(TinyVM*, uint32_t arg1, uint32_t arg2, uint32_t ip);
+
+    struct Fixup {
+        size_t at;       // offset of the rel32 field in code
+        size_t target;   // bytecode address, or code offset when toExit
+        bool toExit;
+    };
+
+    TinyVM& vm;
+    std::vector<uint8_t> code;
+    std::vector<Fixup> fixups;
+    std::vector<size_t> nativeOffset;
+    std::vector<void*> table;
+    size_t exitOffset = 0;
+    uint8_t* native = nullptr;
+    size_t nativeSize = 0;
+
+    void release() {
+        if (native != nullptr) munmap(native, nativeSize);
+        native = nullptr;
+        nativeSize = 0;
+    }
+
+    // --- Helpers: mirror the execute() bodies of the same opcodes ---
+
+    static uint32_t helperDiv(TinyVM* v, uint32_t a, uint32_t b, uint32_t) {
+        int32_t* R = v->registers;
+        R[0] = R[b] != 0 ? R[a] / R[b] : 0;
+        return 0;
+    }
+    static uint32_t helperMod(TinyVM* v, uint32_t a, uint32_t b, uint32_t) {
+        int32_t* R = v->registers;
+        R[0] = R[b] != 0 ? R[a] % R[b] : 0;
+        return 0;
+    }
+    static uint32_t helperDiv3(TinyVM* v, uint32_t a, uint32_t b, uint32_t) {
+        int32_t* R = v->registers;
+        R[a] = R[SRC_B(b)] != 0 ? R[SRC_A(b)] / R[SRC_B(b)] : 0;
+        return 0;
+    }
+    static uint32_t helperMod3(TinyVM* v, uint32_t a, uint32_t b, uint32_t) {
+        int32_t* R = v->registers;
+        R[a] = R[SRC_B(b)] != 0 ? R[SRC_A(b)] % R[SRC_B(b)] : 0;
+        return 0;
+    }
+    static uint32_t helperStore(TinyVM* v, uint32_t a, uint32_t b, uint32_t) {
+        int idx = v->registers[a];
+        if (idx >= 0 && idx < (int)TinyVM::kHeapSize) v->storeByte(idx, v->registers[b]);
+        return 0;
+    }
+    static uint32_t helperLoadAddr(TinyVM* v, uint32_t a, uint32_t b, uint32_t) {
+        v->registers[a] = (int32_t)(v->heap_top + b);
+        return 0;
+    }
+    static uint32_t helperPush(TinyVM* v, uint32_t a, uint32_t, uint32_t ip) {
+        if (v->sp >= TinyVM::kStackSize) {
+            TinyVM::PolicyType::error("Error: Stack Overflow");
+            v->faulted = true;
+            return STOP | ip;
+        }
+        v->stack[v->sp++] = v->registers[a];
+        return 0;
+    }
+    static uint32_t helperPop(TinyVM* v, uint32_t a, uint32_t, uint32_t ip) {
+        if (v->sp == 0) {
+            TinyVM::PolicyType::error("Error: Stack Underflow");
+            v->faulted = true;
+            return STOP | ip;
+        }
+        v->registers[a] = v->stack[--v->sp];
+        return 0;
+    }
+    static uint32_t helperPeek(TinyVM* v, uint32_t a, uint32_t b, uint32_t ip) {
+        uint16_t idx = v->sp + b;
+        if (idx >= TinyVM::kStackSize) {
+            TinyVM::PolicyType::error("Error: PEEK out of bounds");
+            v->faulted = true;
+            return STOP | ip;
+        }
+        v->registers[a] = v->stack[idx];
+        return 0;
+    }
+    static uint32_t helperLoadM(TinyVM* v, uint32_t a, uint32_t b, uint32_t ip) {
+        int idx = v->registers[b];
+        if (idx < 0 || idx >= (int)TinyVM::kHeapSize) {
+            TinyVM::PolicyType::error("Error: LOADM out of bounds");
+            v->faulted = true;
+            return STOP | ip;
+        }
+        v->registers[a] = v->heap[idx];
+        return 0;
+    }
+    static uint32_t helperLoadX(TinyVM* v, uint32_t a, uint32_t b, uint32_t ip) {
+        uint32_t idx = (uint32_t)(v->registers[SRC_A(b)] + v->registers[SRC_B(b)]);
+        if (idx >= TinyVM::kHeapWords) {
+            TinyVM::PolicyType::error("Error: LOADX out of bounds");
+            v->faulted = true;
+            return STOP | ip;
+        }
+        v->registers[a] = v->loadWord(idx);
+        return 0;
+    }
+    static uint32_t helperStoreX(TinyVM* v, uint32_t a, uint32_t b, uint32_t ip) {
+        uint32_t idx = (uint32_t)(v->registers[SRC_A(b)] + v->registers[SRC_B(b)]);
+        if (idx >= TinyVM::kHeapWords) {
+            TinyVM::PolicyType::error("Error: STOREX out of bounds");
+            v->faulted = true;
+            return STOP | ip;
+        }
+        v->storeWord(idx, v->registers[a]);
+        return 0;
+    }
+    static uint32_t helperAlloc(TinyVM* v, uint32_t a, uint32_t b, uint32_t ip) {
+        int32_t base = v->allocWords((uint8_t)b);
+        if (base < 0) {
+            TinyVM::PolicyType::error("Error: Heap exhausted");
+            v->faulted = true;
+            return STOP | ip;
+        }
+        v->registers[a] = base;
+        return 0;
+    }
+    static uint32_t helperFree(TinyVM* v, uint32_t a, uint32_t, uint32_t ip) {
+        if (!v->freeWords(v->registers[a])) {
+            TinyVM::PolicyType::error("Error: FREE of unallocated block");
+            v->faulted = true;
+            return STOP | ip;
+        }
+        return 0;
+    }
+    static uint32_t helperEnter(TinyVM* v, uint32_t, uint32_t b, uint32_t ip) {
+        if (!v->enterFrame((uint8_t)b)) {
+            TinyVM::PolicyType::error("Error: Stack overflow on ENTER");
+            v->faulted = true;
+            return STOP | ip;
+        }
+        return 0;
+    }
+    static uint32_t helperLeave(TinyVM* v, uint32_t, uint32_t, uint32_t ip) {
+        if (!v->leaveFrame()) {
+            TinyVM::PolicyType::error("Error: LEAVE without a frame");
+            v->faulted = true;
+            return STOP | ip;
+        }
+        return 0;
+    }
+    static uint32_t helperLoadLocal(TinyVM* v, uint32_t a, uint32_t b, uint32_t ip) {
+        uint32_t idx = (uint32_t)v->fp + b;
+        if (idx >= v->sp) {
+            TinyVM::PolicyType::error("Error: local outside the frame");
+            v->faulted = true;
+            return STOP | ip;
+        }
+        v->registers[a] = v->stack[idx];
+        return 0;
+    }
+    static uint32_t helperStoreLocal(TinyVM* v, uint32_t a, uint32_t b, uint32_t ip) {
+        uint32_t idx = (uint32_t)v->fp + b;
+        if (idx >= v->sp) {
+            TinyVM::PolicyType::error("Error: local outside the frame");
+            v->faulted = true;
+            return STOP | ip;
+        }
+        v->stack[idx] = v->registers[a];
+        return 0;
+    }
+    static uint32_t helperCall(TinyVM* v, uint32_t, uint32_t, uint32_t ip) {
+        if (v->rsp >= TinyVM::kReturnDepth) {
+            TinyVM::PolicyType::error("Error: Return stack overflow");
+            v->faulted = true;
+            return STOP | ip;
+        }
+        v->retStack[v->rsp++] = (uint16_t)ip;
+        return 0;
+    }
+    static uint32_t helperRet(TinyVM* v, uint32_t, uint32_t, uint32_t ip) {
+        if (v->rsp == 0) return STOP | ip;
+        return v->retStack[--v->rsp];
+    }
+    static uint32_t helperHalt(TinyVM*, uint32_t, uint32_t, uint32_t ip) {
+        TinyVM::PolicyType::message("HALT encountered.");
+        return STOP | ip;
+    }
+    static uint32_t helperPrint(TinyVM* v, uint32_t a, uint32_t, uint32_t) {
+        Serial.println(v->registers[a]);
+        return 0;
+    }
+    static uint32_t helperTrap(TinyVM* v, uint32_t a, uint32_t, uint32_t) {
+        v->call_trap((uint8_t)a);
+        return 0;
+    }
+
+    // --- x86-64 encoding ---
+
+    void emit(std::initializer_list<uint8_t> bytes) {
+        code.insert(code.end(), bytes);
+    }
+    void emit32(uint32_t v) {
+        for (int i = 0; i < 4; i++) code.push_back((uint8_t)(v >> (8 * i)));
+    }
+    void emit64(uint64_t v) {
+        for (int i = 0; i < 8; i++) code.push_back((uint8_t)(v >> (8 * i)));
+    }
+    void patch32(size_t at, uint32_t v) {
+        for (int i = 0; i < 4; i++) code[at + i] = (uint8_t)(v >> (8 * i));
+    }
+
+    // <op> eax, dword [r12 + 4*reg] (or the store form for 0x89)
+    void regOp(std::initializer_list<uint8_t> op, uint8_t reg) {
+        code.push_back(0x41);
+        code.insert(code.end(), op);
+        emit({0x44, 0x24, (uint8_t)(reg * 4)});
+    }
+    void loadReg(uint8_t reg)  { regOp({0x8B}, reg); }
+    void storeReg(uint8_t reg) { regOp({0x89}, reg); }
+    void storeImm(uint8_t reg, uint32_t imm) {
+        emit({0x41, 0xC7, 0x44, 0x24, (uint8_t)(reg * 4)});
+        emit32(imm);
+    }
+
+    uint32_t vmOffset(const void* field) const {
+        return (uint32_t)((const uint8_t*)field - (const uint8_t*)&vm);
+    }
+    // CMP only records its operands in vm.flags (see Flags)
+    void emitRecordCompare(uint8_t a, uint8_t b) {
+        loadReg(a);
+        emit({0x89, 0x83}); emit32(vmOffset(&vm.flags.lhs));   // mov [rbx + lhs], eax
+        loadReg(b);
+        emit({0x89, 0x83}); emit32(vmOffset(&vm.flags.rhs));   // mov [rbx + rhs], eax
+        emit({0xC6, 0x83}); emit32(vmOffset(&vm.flags.valid)); // mov byte [rbx + valid], 1
+        code.push_back(0x01);
+    }
+    // Jcc: evaluates the one condition it needs from the recorded operands.
+    // Before any CMP every condition is false, so only JNZ is taken.
+    void emitFlagJump(uint8_t cc, size_t target, bool takenIfInvalid) {
+        emit({0x80, 0xBB}); emit32(vmOffset(&vm.flags.valid));  // cmp byte [rbx + valid], 0
+        code.push_back(0x00);
+        if (takenIfInvalid) {
+            jumpIf(0x84, target);                               // je target
+        } else {
+            emit({0x74, 18});                                   // je over the compare
+        }
+        emit({0x8B, 0x83}); emit32(vmOffset(&vm.flags.lhs));    // mov eax, [rbx + lhs]
+        emit({0x3B, 0x83}); emit32(vmOffset(&vm.flags.rhs));    // cmp eax, [rbx + rhs]
+        jumpIf(cc, target);
+    }
+
+    void jumpTo(size_t target) {
+        code.push_back(0xE9);
+        fixups.push_back({code.size(), target, false});
+        emit32(0);
+    }
+    // cc is the second byte of the 0F 8x rel32 form
+    void jumpIf(uint8_t cc, size_t target) {
+        emit({0x0F, cc});
+        fixups.push_back({code.size(), target, false});
+        emit32(0);
+    }
+    void jumpIfToExit(uint8_t cc) {
+        emit({0x0F, cc});
+        fixups.push_back({code.size(), 0, true});
+        emit32(0);
+    }
+
+    // Calls helper(vm, arg1, arg2, ip) and leaves through the exit path when
+    // it asks to stop. eax holds the helper result afterwards.
+    void callHelper(Helper fn, uint8_t arg1, uint8_t arg2, uint32_t ip) {
+        emit({0x48, 0x89, 0xDF});                      // mov rdi, rbx
+        code.push_back(0xBE); emit32(arg1);            // mov esi, arg1
+        code.push_back(0xBA); emit32(arg2);            // mov edx, arg2
+        code.push_back(0xB9); emit32(ip);              // mov ecx, ip
+        emit({0x48, 0xB8}); emit64((uint64_t)(uintptr_t)fn);      // mov rax, fn
+        emit({0xFF, 0xD0});                            // call rax
+        code.push_back(0xA9); emit32(STOP);            // test eax, STOP
+        jumpIfToExit(0x85);                            // jnz exit
+    }
+
+    void emitPrologue() {
+        emit({0x53, 0x41, 0x54, 0x41, 0x55});          // push rbx, r12, r13
+        emit({0x48, 0x89, 0xFB});                      // mov rbx, rdi
+        emit({0x49, 0x89, 0xF4});                      // mov r12, rsi
+        emit({0x49, 0x89, 0xD5});                      // mov r13, rdx
+        emit({0xFF, 0xE1});                            // jmp rcx
+    }
+
+    // Shared exit: eax = STOP | pc, return pc to run()
+    void emitExits() {
+        exitOffset = code.size();
+        code.push_back(0x25); emit32(0xFFFF);          // and eax, 0xFFFF
+        emit({0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3});    // pop r13, r12, rbx; ret
+        for (Fixup& f : fixups) {
+            if (f.toExit) f.target = exitOffset;
+        }
+    }
+
+    void emitAlu(std::initializer_list<uint8_t> op, uint8_t dst, uint8_t a, uint8_t b) {
+        loadReg(a);
+        regOp(op, b);
+        storeReg(dst);
+    }
+
+    void emitCompare(uint8_t a, uint8_t b) {
+        loadReg(a);
+        regOp({0x3B}, b);                              // cmp eax, R[b]
+    }
+
+    void emitInstruction(size_t addr) {
+        const uint8_t* p = &vm.program[addr];
+        uint8_t op = p[0], arg1 = p[1], arg2 = p[2];
+        uint32_t ip = (uint32_t)(addr + 3);
+        size_t target = ((size_t)arg1) | ((size_t)arg2 << 8);
+        size_t wideTarget = TinyVM::isWideOpcode(op) ? ((size_t)p[3]) | ((size_t)p[4] << 8) : 0;
+
+        switch (op) {
+            case NOP: break;
+            case ADD: emitAlu({0x03}, 0, arg1, arg2); break;
+            case SUB: emitAlu({0x2B}, 0, arg1, arg2); break;
+            case MUL: emitAlu({0x0F, 0xAF}, 0, arg1, arg2); break;
+            case AND: emitAlu({0x23}, 0, arg1, arg2); break;
+            case OR:  emitAlu({0x0B}, 0, arg1, arg2); break;
+            case XOR: emitAlu({0x33}, 0, arg1, arg2); break;
+            case ADD3: emitAlu({0x03}, arg1, SRC_A(arg2), SRC_B(arg2)); break;
+            case SUB3: emitAlu({0x2B}, arg1, SRC_A(arg2), SRC_B(arg2)); break;
+            case MUL3: emitAlu({0x0F, 0xAF}, arg1, SRC_A(arg2), SRC_B(arg2)); break;
+            case AND3: emitAlu({0x23}, arg1, SRC_A(arg2), SRC_B(arg2)); break;
+            case OR3:  emitAlu({0x0B}, arg1, SRC_A(arg2), SRC_B(arg2)); break;
+            case XOR3: emitAlu({0x33}, arg1, SRC_A(arg2), SRC_B(arg2)); break;
+            case NOT:
+                loadReg(arg1); emit({0xF7, 0xD0}); storeReg(0);          // not eax
+                break;
+            case NOT3:
+                loadReg(SRC_A(arg2)); emit({0xF7, 0xD0}); storeReg(arg1);
+                break;
+            case SHL:
+                loadReg(arg1); emit({0xC1, 0xE0, (uint8_t)(arg2 & 31)}); storeReg(0);
+                break;
+            case SHR:
+                loadReg(arg1); emit({0xC1, 0xF8, (uint8_t)(arg2 & 31)}); storeReg(0);
+                break;
+            case DIV:  callHelper(helperDiv, arg1, arg2, ip); break;
+            case MOD:  callHelper(helperMod, arg1, arg2, ip); break;
+            case DIV3: callHelper(helperDiv3, arg1, arg2, ip); break;
+            case MOD3: callHelper(helperMod3, arg1, arg2, ip); break;
+            case CMP:
+                emitRecordCompare(arg1, arg2);
+                break;
+            case LOAD:
+                loadReg(arg2); storeReg(arg1);
+                break;
+            case LOADI:
+                storeImm(arg1, arg2);
+                break;
+            case LOADK:
+                // The pool is fixed once the program is loaded
+                storeImm(arg1, (uint32_t)vm.loadConst(arg2));
+                break;
+            case LOADI16:
+                storeImm(arg1, (uint32_t)wideTarget);
+                break;
+            case STORE:     callHelper(helperStore, arg1, arg2, ip); break;
+            case LOAD_ADDR: callHelper(helperLoadAddr, arg1, arg2, ip); break;
+            case PUSH:      callHelper(helperPush, arg1, arg2, ip); break;
+            case POP:       callHelper(helperPop, arg1, arg2, ip); break;
+            case PEEK:      callHelper(helperPeek, arg1, arg2, ip); break;
+            case LOADM:     callHelper(helperLoadM, arg1, arg2, ip); break;
+            case LOADX:     callHelper(helperLoadX, arg1, arg2, ip); break;
+            case STOREX:    callHelper(helperStoreX, arg1, arg2, ip); break;
+            case ALLOC:     callHelper(helperAlloc, arg1, arg2, ip); break;
+            case FREE:      callHelper(helperFree, arg1, arg2, ip); break;
+            case ENTER:     callHelper(helperEnter, arg1, arg2, ip); break;
+            case LEAVE:     callHelper(helperLeave, arg1, arg2, ip); break;
+            case LDL:       callHelper(helperLoadLocal, arg1, arg2, ip); break;
+            case STL:       callHelper(helperStoreLocal, arg1, arg2, ip); break;
+            case JMP: jumpTo(target); break;
+            case JZ:  emitFlagJump(0x84, target, false); break;   // je
+            case JNZ: emitFlagJump(0x85, target, true); break;    // jne
+            case JLT: emitFlagJump(0x8C, target, false); break;   // jl
+            case JGT: emitFlagJump(0x8F, target, false); break;   // jg
+            case JLE: emitFlagJump(0x8E, target, false); break;   // jle
+            case JGE: emitFlagJump(0x8D, target, false); break;   // jge
+            case BEQ: emitCompare(arg1, arg2); jumpIf(0x84, wideTarget); break;
+            case BNE: emitCompare(arg1, arg2); jumpIf(0x85, wideTarget); break;
+            case BLT: emitCompare(arg1, arg2); jumpIf(0x8C, wideTarget); break;
+            case BGE: emitCompare(arg1, arg2); jumpIf(0x8D, wideTarget); break;
+            case CALL:
+                callHelper(helperCall, arg1, arg2, ip);
+                jumpTo(target);
+                break;
+            case RET:
+                callHelper(helperRet, arg1, arg2, ip);
+                // The helper returns uint32_t; the upper half of rax is undefined
+                emit({0x89, 0xC0});                    // mov eax, eax
+                emit({0x49, 0x8B, 0x44, 0xC5, 0x00});  // mov rax, [r13 + rax*8]
+                emit({0xFF, 0xE0});                    // jmp rax
+                break;
+            case HALT:  callHelper(helperHalt, arg1, arg2, ip); break;
+            case PRINT: callHelper(helperPrint, arg1, arg2, ip); break;
+            case TRAP:  callHelper(helperTrap, arg1, arg2, ip); break;
+        }
+    }
+};
+
+#endif
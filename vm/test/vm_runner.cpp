@@ -1,80 +1,253 @@
 #define UNIT_TESTING
 #include "mock_arduino.h"
 #include "../vm_complete.ino"
+#include "vm_jit.h"
+#include "listing_file.h"
+#include <csignal>
 #include <iostream>
-#include <fstream>
 #include <vector>
 #include <string>
-#include <sstream>
-#include <map>
 
 MockSerial Serial;
 
-static void print_registers(TinyVM &vm) {
-    std::cout << "Regs: ";
+static void print_registers(TinyVM &vm, std::ostream& out = std::cout) {
+    out << "Regs: ";
     for (int i = 0; i < NUM_REGISTERS; ++i) {
-        std::cout << "R" << i << "=" << vm.registers[i];
-        if (i + 1 < NUM_REGISTERS) std::cout << ", ";
+        out << "R" << i << "=" << vm.registers[i];
+        if (i + 1 < NUM_REGISTERS) out << ", ";
     }
-    std::cout << std::endl;
+    out << std::endl;
 }
 
-// Map mnemonic string to Opcode enum
-static std::map<std::string, uint8_t> opcode_map = {
-    {"NOP", NOP}, {"ADD", ADD}, {"SUB", SUB}, {"MUL", MUL}, {"DIV", DIV},
-    {"MOD", MOD}, {"AND", AND}, {"OR", OR}, {"XOR", XOR}, {"NOT", NOT},
-    {"CMP", CMP}, {"SHL", SHL}, {"SHR", SHR},
-    {"LOAD", LOAD}, {"LOADI", LOADI}, {"LOADI16", LOADI16}, {"STORE", STORE},
-    {"LOAD_ADDR", LOAD_ADDR}, {"PUSH", PUSH}, {"POP", POP}, {"PEEK", PEEK},
-    {"LOADM", LOADM},
-    {"JMP", JMP}, {"JZ", JZ}, {"JNZ", JNZ}, {"JLT", JLT}, {"JGT", JGT},
-    {"JLE", JLE}, {"JGE", JGE}, {"CALL", CALL}, {"RET", RET}, {"HALT", HALT},
-    {"PRINT", PRINT}, {"TRAP", TRAP}
+// A program named on the command line. Images and containers are mapped
+// and run in place; listings are assembled first and compressed
+// containers inflated into unpacked.
+struct ProgramFile {
+    MappedImage image;
+    Listing listing;
+    std::vector<uint8_t> unpacked;
+    const uint8_t* code = nullptr;
+    size_t size = 0;
+    bool container = false;
 };
 
+static bool open_program(const char* path, ProgramFile& file) {
+    if (is_image_path(path)) {
+        if (!file.image.open(path)) {
+            std::cerr << "Failed to map image: " << path << std::endl;
+            return false;
+        }
+        file.code = file.image.data();
+        file.size = file.image.size();
+    } else {
+        if (!assemble_listing(path, file.listing)) {
+            std::cerr << file.listing.error << std::endl;
+            return false;
+        }
+        file.code = file.listing.program.data();
+        file.size = file.listing.program.size();
+    }
+    file.container = file.size >= 4 && memcmp(file.code, A3B_MAGIC, 4) == 0;
+    A3bHeader h;
+    if (file.container && file.size >= A3B_HEADER_SIZE && a3b_read_header(file.code, &h) == nullptr &&
+        h.packed_size != 0) {
+        file.unpacked.resize(h.code_size);
+    }
+    return true;
+}
+
+// Stands in for the board's end of a3_upload: stdin and stdout are the
+// serial line. Uploads are built in two alternating buffer sets, like the
+// firmware's spare pair, and staged when committed.
+struct SerialBoard {
+    TinyVM* vm;
+    bool keep_registers;
+    std::vector<uint8_t> code[2], functions[2], pool[2];
+    uint16_t function_count[2] = { 0, 0 };
+};
+
+static const uint16_t SERIAL_MAX_FUNCTIONS = 256;
+
+static void reply_stdout(void*, const char* line) {
+    std::cout << line << std::endl;
+}
+
+static const char* commit_upload(void* user, const A3bHeader& h) {
+    SerialBoard* board = static_cast<SerialBoard*>(user);
+    int next = board->vm->swaps % 2;
+    int loop_start = (h.flags & A3B_FLAG_HAS_LOOP) ? (int)h.loop_entry : -1;
+    if (!board->vm->stageProgram(board->code[next].data(), h.code_size, loop_start, board->keep_registers,
+                                 board->pool[next].data(), h.const_count, h.setup_entry)) {
+        return "rejected by verifier";
+    }
+    board->function_count[next] = h.function_count;
+    return nullptr;
+}
+
+// Serves uploads until stdin closes. After each one, a loop() iteration
+// swaps it in before more input is read, as on the board.
+static bool serve_uploads(TinyVM& vm, const ProgramFile& file, bool keep_registers) {
+    // Whoever is at the other end may hang up first
+    signal(SIGPIPE, SIG_IGN);
+    static SerialBoard board;
+    board.vm = &vm;
+    board.keep_registers = keep_registers;
+    for (int i = 0; i < 2; i++) {
+        board.code[i].resize(VM_MAX_PROGRAM_SIZE);
+        board.functions[i].resize(SERIAL_MAX_FUNCTIONS * A3B_FUNCTION_SIZE);
+        board.pool[i].resize(A3B_MAX_CONSTS * 4);
+    }
+    A3bHeader h;
+    bool table = file.container && file.size >= A3B_HEADER_SIZE && a3b_read_header(file.code, &h) == nullptr;
+    DeltaReceiver receiver;
+    receiver.begin(reply_stdout, commit_upload, &board);
+    std::string line;
+    while (std::getline(std::cin, line)) {
+        uint16_t swaps = vm.swaps;
+        int running = (swaps + 1) % 2, next = swaps % 2;
+        DeltaProgram current = { vm.program, (uint32_t)vm.programSize, nullptr, 0 };
+        if (swaps > 0) {
+            current.functions = board.functions[running].data();
+            current.functionCount = board.function_count[running];
+        } else if (table) {
+            current.functions = file.code + A3B_HEADER_SIZE;
+            current.functionCount = h.function_count;
+        }
+        receiver.setCurrent(current);
+        receiver.setTarget(board.code[next].data(), VM_MAX_PROGRAM_SIZE, board.functions[next].data(),
+                           SERIAL_MAX_FUNCTIONS, board.pool[next].data());
+        line += '\n';
+        receiver.feed(line.data(), line.size());
+        if (vm.swapPending()) {
+            vm.runLoop();
+            if (vm.status() == TinyVM::RUN_ERROR) return false;
+        }
+    }
+    std::cerr << "Uploads swapped in: " << vm.swaps << std::endl;
+    return true;
+}
+
 int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        std::cerr << "Usage: " << argv[0] << " <bytecode_file>" << std::endl;
+    const char* path = nullptr;
+    const char* image_out = nullptr;
+    const char* swap_path = nullptr;
+    bool use_jit = false;
+    bool fusion_stats = false;
+    bool keep_registers = false;
+    bool serial = false;
+    long loops = 0;
+    long swap_after = 0;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--jit") {
+            use_jit = true;
+        } else if (arg == "--fusion-stats") {
+            fusion_stats = true;
+        } else if (arg == "--write-image" && i + 1 < argc) {
+            image_out = argv[++i];
+        } else if (arg == "--loops" && i + 1 < argc) {
+            loops = atol(argv[++i]);
+        } else if (arg == "--swap" && i + 1 < argc) {
+            swap_path = argv[++i];
+        } else if (arg == "--swap-after" && i + 1 < argc) {
+            swap_after = atol(argv[++i]);
+        } else if (arg == "--keep-registers") {
+            keep_registers = true;
+        } else if (arg == "--serial") {
+            serial = true;
+        } else {
+            path = argv[i];
+        }
+    }
+    if (path == nullptr || (use_jit && (loops > 0 || swap_path != nullptr || serial)) ||
+        (serial && swap_path != nullptr)) {
+        std::cerr << "Usage: " << argv[0]
+                  << " [--jit] [--fusion-stats] [--write-image <out.vmimg>] <listing | image.vmimg | program.a3b>\n"
+                  << "       " << argv[0]
+                  << " --loops <n> [--swap <program> [--swap-after <k>] [--keep-registers]] <program>\n"
+                  << "       " << argv[0]
+                  << " --serial [--loops <n>] [--keep-registers] <program>   (uploads from a3_upload on stdin)"
+                  << std::endl;
         return 1;
     }
 
-    std::ifstream file(argv[1]);
-    if (!file) {
-        std::cerr << "Failed to open file: " << argv[1] << std::endl;
+    ProgramFile file;
+    if (!open_program(path, file)) return 1;
+
+    TinyVM vm;
+    vm.setConstPool(file.listing.pool.data(), (uint16_t)(file.listing.pool.size() / 4));
+    if (file.listing.loop_start >= 0) vm.setLoopStart((size_t)file.listing.loop_start);
+    if (file.container ? !vm.loadImage(file.code, file.size, file.unpacked.data(), file.unpacked.size()) : !vm.loadProgram(file.code, file.size)) {
+        std::cerr << "Program rejected by verifier: " << path << std::endl;
         return 1;
     }
 
-    std::vector<uint8_t> program;
-    std::string line;
-    while (std::getline(file, line)) {
-        // Skip comments and empty lines
-        if (line.empty() || line[0] == '#') continue;
-
-        std::stringstream ss(line);
-        std::string mnemonic;
-        int arg1, arg2;
-
-        if (!(ss >> mnemonic >> arg1 >> arg2)) {
-            // Try parsing without args if it failed (though format says 3 columns)
-            // Actually format is "%-7s %3u %3u\n" so it should always have 3 parts
-            // But let's be safe.
-            continue; 
+    // The verified bytecode, without a container's header and tables. Raw
+    // images have nowhere to keep constants.
+    if (image_out != nullptr) {
+        if (vm.constCount > 0) {
+            std::cerr << "Program uses a constant pool; run its .a3b container instead" << std::endl;
+            return 1;
         }
+        if (!write_image(image_out, std::vector<uint8_t>(vm.program, vm.program + vm.programSize))) {
+            std::cerr << "Failed to write image: " << image_out << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+    if (use_jit) {
+#ifdef VM_JIT_AVAILABLE
+        TinyJit jit(vm);
+        if (!jit.compile()) {
+            std::cerr << "JIT compilation failed: " << path << std::endl;
+            return 1;
+        }
+        jit.run();
+#else
+        std::cerr << "--jit is only supported on x86-64 hosts" << std::endl;
+        return 1;
+#endif
+    } else {
+        vm.run();
+    }
 
-        if (opcode_map.find(mnemonic) == opcode_map.end()) {
-            std::cerr << "Unknown mnemonic: " << mnemonic << std::endl;
+    // Loop iterations as the firmware's loop() runs them. The second
+    // program is staged after swap_after of them and takes over at the next
+    // iteration boundary, as a hot update does on the board.
+    ProgramFile next;
+    if (swap_path != nullptr && !open_program(swap_path, next)) return 1;
+    for (long i = 0; i < loops; i++) {
+        if (swap_path != nullptr && i == swap_after) {
+            bool staged = next.container
+                ? vm.stageImage(next.code, next.size, keep_registers, next.unpacked.data(), next.unpacked.size())
+                : vm.stageProgram(next.code, next.size, next.listing.loop_start, keep_registers,
+                                  next.listing.pool.data(), (uint16_t)(next.listing.pool.size() / 4));
+            if (!staged) {
+                std::cerr << "Program rejected for hot swap: " << swap_path << std::endl;
+                return 1;
+            }
+        }
+        vm.runLoop();
+        if (vm.status() == TinyVM::RUN_ERROR) {
+            std::cerr << "Runtime error in loop iteration " << i << std::endl;
             return 1;
         }
+    }
+    if (vm.swaps > 0) std::cout << "Swapped to " << swap_path << " before iteration " << swap_after << std::endl;
 
-        program.push_back(opcode_map[mnemonic]);
-        program.push_back((uint8_t)arg1);
-        program.push_back((uint8_t)arg2);
+    // The --loops iterations above ran before the first upload; stdout is
+    // the serial line from here on, so the result goes to stderr
+    if (serial) {
+        if (!serve_uploads(vm, file, keep_registers)) {
+            std::cerr << "Runtime error after an upload" << std::endl;
+            return 1;
+        }
+        print_registers(vm, std::cerr);
+        return 0;
     }
 
-    TinyVM vm;
-    vm.loadProgram(program.data(), program.size());
-    vm.run();
-    
+    // Sites fuseProgram() rewrote in the loaded program, per pattern
+    if (fusion_stats) vm.dumpFusionStats();
     print_registers(vm);
 
     return 0;
@@ -7,11 +7,108 @@
 // --- SD Card Configuration ---
 #define CS_PIN 5
 #define VMCODE_FILE "/program.vmcode"
+#define A3B_FILE "/program.a3b"        // binary container, preferred when present
+#define VMIMAGE_FILE "/program.vmimg"   // assembled bytes of a paged program
+#define UPDATE_FILE "/update.a3b"       // hot update, swapped in between loop() runs
+#define DELTA_FILE "/delta.a3b"         // Serial upload being saved for the next boot
 
 // --- VM Configuration ---
+// Sizes of the default TinyVM; other sizes can be instantiated from
+// BasicTinyVM directly (see VM CLASS).
+#ifndef VM_STACK_SIZE
 #define VM_STACK_SIZE 1024  // 1KB Stack for local variables/expressions
+#endif
+#ifndef VM_HEAP_SIZE
 #define VM_HEAP_SIZE  2048  // 2KB Heap for dynamic data
-#define NUM_REGISTERS 8     // R0-R7
+#endif
+#define VM_HEAP_WORDS (VM_HEAP_SIZE / 4)  // 32-bit words seen by LOADX/STOREX
+#define NUM_REGISTERS 8     // R0-R7, fixed by the instruction encoding
+#ifndef VM_MAX_PROGRAM_SIZE
+#define VM_MAX_PROGRAM_SIZE 2048  // Bytecode buffer filled from SD
+#endif
+#ifndef VM_RETURN_DEPTH
+#define VM_RETURN_DEPTH 64  // Nested CALLs, one uint16_t return address each
+#endif
+
+// --- Dispatch Engine ---
+// GCC/Clang builds (including the ESP32 toolchain) use direct threading via
+// computed goto. Define VM_DISPATCH_SWITCH to force the portable switch loop.
+#if !defined(VM_DISPATCH_SWITCH) && defined(__GNUC__)
+#define VM_DISPATCH_THREADED
+#endif
+
+// Superinstruction fusion runs at load time unless VM_DISABLE_FUSION is
+// defined. VM_FUSION_STATS additionally counts fused executions per pattern.
+
+// --- Trace Cache ---
+// With VM_TRACE_CACHE defined, execute() predecodes each basic block into
+// micro-ops the first time it is entered and runs later visits from the
+// cache instead of decoding opTable/program per instruction. Each block's
+// exit links to the block it went to last, so a warm loop only looks a
+// block up when a branch changes direction. On the host that is level with
+// or slightly ahead of the plain engine; it costs SRAM, so it is off by
+// default and its storage is not compiled in. Sized to sit next to
+// programBuffer in ESP32 SRAM (6 bytes per micro-op, 6 per block slot).
+#ifndef VM_TRACE_CACHE_UOPS
+#define VM_TRACE_CACHE_UOPS   256  // micro-op pool shared by all blocks
+#endif
+#ifndef VM_TRACE_CACHE_BLOCKS
+#define VM_TRACE_CACHE_BLOCKS 32   // direct-mapped block slots, keyed by pc
+#endif
+#ifndef VM_TRACE_BLOCK_MAX
+#define VM_TRACE_BLOCK_MAX    32   // longer blocks are split
+#endif
+
+// --- Time Slicing ---
+// runUntil() runs the program in slices of this many instructions and reads
+// micros() between slices, so a deadline is overshot by at most one slice.
+#ifndef VM_SLICE_STEPS
+#define VM_SLICE_STEPS 64
+#endif
+
+// --- Paged Code ---
+// Programs larger than programBuffer run from an assembled image on SD
+// through a CodePager, an LRU cache of VM_CODE_PAGES pages of
+// VM_CODE_PAGE_SIZE bytes. Paged programs execute on step(), which checks
+// every instruction, so they skip the load-time verifier, fusion and the
+// trace cache. Branch targets are 16-bit, which caps an image at 64KB.
+#ifndef VM_CODE_PAGE_SIZE
+#define VM_CODE_PAGE_SIZE 256
+#endif
+#ifndef VM_CODE_PAGES
+#define VM_CODE_PAGES 8    // 2KB of cached code, as much as programBuffer
+#endif
+
+// --- Hot Updates ---
+// The firmware looks for UPDATE_FILE every VM_UPDATE_POLL_MS and swaps a
+// valid one in between two loop() iterations. By default the new program's
+// setup code runs first; set VM_HOT_SWAP_KEEP_REGISTERS to 1 to keep the
+// registers (and so the globals) of the running program instead.
+#ifndef VM_UPDATE_POLL_MS
+#define VM_UPDATE_POLL_MS 1000
+#endif
+#ifndef VM_HOT_SWAP_KEEP_REGISTERS
+#define VM_HOT_SWAP_KEEP_REGISTERS 0
+#endif
+// Uploads over Serial (see delta_update.h) are swapped in the same way.
+// They copy unchanged functions from the running program, so the function
+// table of up to VM_MAX_FUNCTIONS functions is kept; programs with more
+// are resent whole.
+#ifndef VM_MAX_FUNCTIONS
+#define VM_MAX_FUNCTIONS 32
+#endif
+
+// --- Program Container ---
+// Layout of the .a3b files a3c writes next to program.vmcode
+#include "a3b.h"
+
+// --- Ahead-of-Time Programs ---
+// With VM_AOT defined, the firmware is linked with a translation unit
+// produced by `a3c --cpp` and setup()/loop() call the compiled program
+// instead of loading program.vmcode from SD.
+#ifdef VM_AOT
+#include "a3_aot.h"
+#endif
 
 // --- Opcodes ---
 enum Opcode {
@@ -21,11 +118,131 @@ enum Opcode {
     SHL   = 0x0B, SHR   = 0x0C,
     LOAD   = 0x10, LOADI  = 0x11, LOADI16= 0x12, STORE  = 0x13,
     LOAD_ADDR = 0x14, PUSH   = 0x15, POP    = 0x16, PEEK   = 0x17, LOADM  = 0x18,
+    // Indexed word access: heap word R[ARG2 >> 4] + R[ARG2 & 0x0F]
+    LOADX  = 0x19, STOREX = 0x1A,
     JMP   = 0x20, JZ    = 0x21, JNZ   = 0x22, JLT   = 0x23, JGT   = 0x24,
     JLE   = 0x25, JGE   = 0x26, CALL  = 0x27, RET   = 0x28, HALT  = 0x29,
-    PRINT = 0x30, TRAP  = 0x31
+    // Compare-and-branch (wide): if (R[ARG1] cond R[ARG2]) pc = <trailing word>
+    BEQ   = 0x2A, BNE   = 0x2B, BLT   = 0x2C, BGE   = 0x2D,
+    PRINT = 0x30, TRAP  = 0x31,
+    // Heap arena: ALLOC R[ARG1] = base word of a new ARG2-word block,
+    // FREE releases the block at R[ARG1] and everything allocated after it
+    ALLOC = 0x32, FREE  = 0x33,
+    // Stack frames: ENTER pushes fp and reserves ARG2 slots, LEAVE drops
+    // them; LDL/STL move R[ARG1] from/to slot ARG2 of the current frame
+    ENTER = 0x34, LEAVE = 0x35, LDL   = 0x36, STL   = 0x37,
+    // R[ARG1] = constant ARG2 of the program's constant pool
+    LOADK = 0x38,
+    // Three-operand ALU: R[ARG1] = R[ARG2 >> 4] op R[ARG2 & 0x0F]
+    ADD3  = 0x41, SUB3  = 0x42, MUL3  = 0x43, DIV3  = 0x44, MOD3  = 0x45,
+    AND3  = 0x46, OR3   = 0x47, XOR3  = 0x48, NOT3  = 0x49
 };
 
+// --- Mnemonics ---
+// Listing name of every opcode, spelled as its enumerator
+#define VM_MNEMONICS(X)                                                     \
+    X(NOP) X(ADD) X(SUB) X(MUL) X(DIV) X(MOD) X(AND) X(OR) X(XOR) X(NOT)   \
+    X(CMP) X(SHL) X(SHR) X(LOAD) X(LOADI) X(LOADI16) X(STORE) X(LOAD_ADDR) \
+    X(PUSH) X(POP) X(PEEK) X(LOADM) X(LOADX) X(STOREX)                     \
+    X(JMP) X(JZ) X(JNZ) X(JLT) X(JGT) X(JLE) X(JGE) X(CALL) X(RET) X(HALT) \
+    X(BEQ) X(BNE) X(BLT) X(BGE) X(PRINT) X(TRAP) X(ALLOC) X(FREE)          \
+    X(ENTER) X(LEAVE) X(LDL) X(STL) X(LOADK)                               \
+    X(ADD3) X(SUB3) X(MUL3) X(DIV3) X(MOD3) X(AND3) X(OR3) X(XOR3) X(NOT3)
+
+// Perfect hash of the mnemonics into 0..127 from their first, second and
+// last characters and length. Each mnemonic is a case label in
+// opcodeForMnemonic(), so a collision is a compile error.
+constexpr uint8_t mnemonicHash(const char* s, size_t len) {
+    return (uint8_t)((s[0] + s[1] * 8 + s[len - 1] * 63 + (int)len * 62) & 127);
+}
+
+// Opcode named by s[0..len), or 0xFF for anything that is not a mnemonic
+inline uint8_t opcodeForMnemonic(const char* s, size_t len) {
+    if (len < 2) return 0xFF;
+    const char* name;
+    uint8_t op;
+    switch (mnemonicHash(s, len)) {
+#define VM_MNEMONIC_CASE(m) case mnemonicHash(#m, sizeof(#m) - 1): name = #m; op = m; break;
+    VM_MNEMONICS(VM_MNEMONIC_CASE)
+#undef VM_MNEMONIC_CASE
+    default: return 0xFF;
+    }
+    return strncmp(name, s, len) == 0 && name[len] == '\0' ? op : 0xFF;
+}
+
+// Source register nibbles of the three-operand ALU forms
+#define SRC_A(arg) ((arg) >> 4)
+#define SRC_B(arg) ((arg) & 0x0F)
+
+// --- Superinstructions ---
+// Internal opcodes produced by the load-time fusion pass. They never appear in
+// bytecode (the verifier rejects them) and only live in TinyVM::opTable. The
+// order must match fusionPatterns[].
+enum FusedOpcode {
+    F_LOADI_BEQ = 0x80, F_LOADI_BNE, F_LOADI_BLT, F_LOADI_BGE,
+    F_LOADK_BEQ, F_LOADK_BNE, F_LOADK_BLT, F_LOADK_BGE,
+    F_ADD3_MOV, F_SUB3_MOV, F_MUL3_MOV,
+    F_LOADI_MOV, F_MOV_MOV,
+    F_FIRST = F_LOADI_BEQ
+};
+
+// A fused sequence is matched on opcodes alone; its handler performs every
+// instruction's effects, so operands need no constraints
+struct FusionPattern {
+    uint8_t ops[2];
+    uint8_t fused;
+    const char* name;
+};
+
+// Idioms emitted by language/translator.c
+static const FusionPattern fusionPatterns[] = {
+    {{LOADI, BEQ},  F_LOADI_BEQ, "LOADI+BEQ"},  // comparisons against a
+    {{LOADI, BNE},  F_LOADI_BNE, "LOADI+BNE"},  // small literal
+    {{LOADI, BLT},  F_LOADI_BLT, "LOADI+BLT"},
+    {{LOADI, BGE},  F_LOADI_BGE, "LOADI+BGE"},
+    {{LOADK, BEQ},  F_LOADK_BEQ, "LOADK+BEQ"},  // ... or a pooled constant
+    {{LOADK, BNE},  F_LOADK_BNE, "LOADK+BNE"},
+    {{LOADK, BLT},  F_LOADK_BLT, "LOADK+BLT"},
+    {{LOADK, BGE},  F_LOADK_BGE, "LOADK+BGE"},
+    {{ADD3, LOAD},  F_ADD3_MOV,  "ADD3+LOAD"},  // result moved to a variable
+    {{SUB3, LOAD},  F_SUB3_MOV,  "SUB3+LOAD"},
+    {{MUL3, LOAD},  F_MUL3_MOV,  "MUL3+LOAD"},
+    {{LOADI, LOAD}, F_LOADI_MOV, "LOADI+LOAD"}, // literal assigned to a variable
+    {{LOAD, LOAD},  F_MOV_MOV,   "LOAD+LOAD"},  // builtin results moved out of R0
+};
+
+#define FUSION_PATTERN_COUNT (sizeof(fusionPatterns) / sizeof(FusionPattern))
+
+// --- Trace Cache Entries ---
+// One predecoded instruction: the opcode execute() dispatches on (fused
+// heads included) with its operands already fetched. Each cached block is
+// closed by a T_BLOCK_EXIT micro-op that links to the block's last
+// successor: its pc is that block's address (0xFFFF while unlinked) and
+// arg1/arg2 the byte offset of its first micro-op, kept halfword aligned.
+struct MicroOp {
+    uint16_t pc;
+    uint8_t arg1;
+    uint8_t arg2;
+    uint8_t op;
+};
+
+// Internal opcode of the block exit micro-op. Like the fused opcodes it
+// never appears in bytecode.
+enum TraceOpcode { T_BLOCK_EXIT = 0xFF };
+
+// A cached basic block: traceOps[first .. first + count), entered at pc,
+// followed by its exit micro-op. count == 0 marks an empty slot.
+struct TraceBlock {
+    uint16_t pc;
+    uint16_t first;
+    uint16_t count;
+};
+
+static_assert(VM_TRACE_BLOCK_MAX > 0 && VM_TRACE_CACHE_UOPS > VM_TRACE_BLOCK_MAX,
+              "trace cache must hold at least one full block and its exit");
+static_assert(VM_TRACE_CACHE_UOPS * sizeof(MicroOp) <= 0x10000,
+              "exit links are 16-bit byte offsets into the micro-op pool");
+
 // --- Instruction Format ---
 struct Instruction {
     uint8_t opcode;
@@ -33,13 +250,123 @@ struct Instruction {
     uint8_t arg2;
 };
 
-// Flags set by CMP
+// Flags set by CMP. Only the operands are recorded; each conditional jump
+// evaluates the one condition it needs. Before the first CMP every
+// condition reads false.
+#ifndef VM_EAGER_FLAGS
+struct Flags {
+    int32_t lhs = 0;
+    int32_t rhs = 0;
+    bool valid = false;
+
+    void set(int32_t a, int32_t b) { lhs = a; rhs = b; valid = true; }
+    bool zero() const { return valid && lhs == rhs; }
+    bool lt() const   { return valid && lhs < rhs; }
+    bool gt() const   { return valid && lhs > rhs; }
+    bool le() const   { return valid && lhs <= rhs; }
+    bool ge() const   { return valid && lhs >= rhs; }
+};
+#else
+// Benchmark baseline (vm_bench_eager): CMP computes all five conditions up
+// front, as before the lazy flags. The operands are still recorded for
+// snapshots and runCompiled(); the test JIT writes them directly, so it is
+// not built with this define.
 struct Flags {
-    bool zero = false;
-    bool lt = false;
-    bool gt = false;
-    bool le = false;
-    bool ge = false;
+    int32_t lhs = 0;
+    int32_t rhs = 0;
+    bool valid = false;
+    bool isZero = false, isLt = false, isGt = false, isLe = false, isGe = false;
+
+    void set(int32_t a, int32_t b) {
+        lhs = a; rhs = b; valid = true;
+        isZero = (a == b);
+        isLt   = (a < b);
+        isGt   = (a > b);
+        isLe   = (a <= b);
+        isGe   = (a >= b);
+    }
+    bool zero() const { return isZero; }
+    bool lt() const   { return isLt; }
+    bool gt() const   { return isGt; }
+    bool le() const   { return isLe; }
+    bool ge() const   { return isGe; }
+};
+#endif
+
+// --- Paged Code Store ---
+// Code pages cached over an image kept in slower storage. read() fills one
+// page; the image's last page may be short. A hit is a page lookup served
+// from the cache, a miss one that had to read the page (evicting the least
+// recently used one).
+struct CodePager {
+    typedef bool (*ReadFn)(void* user, uint32_t offset, uint8_t* dst, uint16_t len);
+
+    uint8_t pages[VM_CODE_PAGES][VM_CODE_PAGE_SIZE];
+    int32_t pageNo[VM_CODE_PAGES];  // image page held by each slot, -1 if empty
+    uint32_t lastUse[VM_CODE_PAGES];
+    uint32_t clock;
+    uint8_t current;                // slot of the last lookup
+    uint32_t size;
+    ReadFn read;
+    void* user;
+    uint32_t hits, misses;
+
+    void begin(ReadFn fn, void* context, uint32_t imageSize) {
+        read = fn; user = context; size = imageSize;
+        flush();
+        hits = 0; misses = 0;
+    }
+
+    void flush() {
+        for (uint8_t i = 0; i < VM_CODE_PAGES; i++) {
+            pageNo[i] = -1;
+            lastUse[i] = 0;
+        }
+        clock = 0; current = 0;
+    }
+
+    // Copies len image bytes at addr, across a page boundary if needed.
+    // False past the end of the image or when a page cannot be read.
+    bool fetch(uint32_t addr, uint8_t* dst, uint8_t len) {
+        if (addr + len > size) return false;
+        while (len > 0) {
+            const uint8_t* page = lookup(addr / VM_CODE_PAGE_SIZE);
+            if (page == nullptr) return false;
+            uint16_t offset = addr % VM_CODE_PAGE_SIZE;
+            uint8_t n = VM_CODE_PAGE_SIZE - offset < len ? VM_CODE_PAGE_SIZE - offset : len;
+            memcpy(dst, page + offset, n);
+            dst += n; addr += n; len -= n;
+        }
+        return true;
+    }
+
+    const uint8_t* lookup(uint32_t page) {
+        // Straight-line code stays on one page; check it before scanning
+        if (pageNo[current] == (int32_t)page) {
+            hits++;
+            lastUse[current] = ++clock;
+            return pages[current];
+        }
+        uint8_t victim = 0;
+        for (uint8_t i = 0; i < VM_CODE_PAGES; i++) {
+            if (pageNo[i] == (int32_t)page) {
+                hits++;
+                current = i;
+                lastUse[i] = ++clock;
+                return pages[i];
+            }
+            if (lastUse[i] < lastUse[victim]) victim = i;
+        }
+        misses++;
+        uint32_t start = page * VM_CODE_PAGE_SIZE;
+        uint16_t len = size - start < VM_CODE_PAGE_SIZE ? size - start : VM_CODE_PAGE_SIZE;
+        pageNo[victim] = -1;
+        if (!read(user, start, pages[victim], len)) return nullptr;
+        pageNo[victim] = (int32_t)page;
+        current = victim;
+        lastUse[victim] = ++clock;
+        return pages[victim];
+    }
 };
 
 // =========================
@@ -91,18 +418,30 @@ int umbralIzq = 1500;
 int umbralDer = 2100;
 
 // Global program storage
-uint8_t programBuffer[2048];
+uint8_t programBuffer[VM_MAX_PROGRAM_SIZE];
 size_t programSize = 0;
+// Constant pool of the loaded program, little-endian int32s for LOADK
+uint8_t constBuffer[A3B_MAX_CONSTS * 4];
+uint16_t constCount = 0;
+// Second code/pool pair: a hot update is read into whichever pair the VM
+// is not running from
+uint8_t spareProgramBuffer[VM_MAX_PROGRAM_SIZE];
+uint8_t spareConstBuffer[A3B_MAX_CONSTS * 4];
+// Function tables of the two pairs, raw .a3b entries, for delta uploads
+uint8_t functionBuffer[VM_MAX_FUNCTIONS * A3B_FUNCTION_SIZE];
+uint16_t functionCount = 0;
+uint8_t spareFunctionBuffer[VM_MAX_FUNCTIONS * A3B_FUNCTION_SIZE];
+uint16_t spareFunctionCount = 0;
 
 // =========================
 // === FUNCTION IMPLEMENTATIONS ===
 // =========================
 
 #ifndef UNIT_TESTING
-
 void pwm_write_pin(int pin, int pwmValue) {
     analogWrite(pin, pwmValue);
 }
+#endif
 
 void stop_motors()
 {
@@ -232,45 +571,623 @@ void initSensors() {
     
     // Setup PWM channels for ESP32 if needed (using ledc)
 }
-#endif
 
 // =========================
 // === VM CLASS ===
 // =========================
 
-class TinyVM {
+// Policy for BasicTinyVM: what execute() does besides running instructions.
+// Hooks are only called when their flag is set, so a disabled feature
+// compiles to nothing. Derive from this struct and override what you need.
+struct DefaultVMPolicy {
+    // Runtime stack, heap and call-depth checks in execute(). Without
+    // them an out-of-range access is undefined behaviour, so only disable
+    // them for programs known to stay in bounds. step() always checks.
+    static const bool kBoundsChecks = true;
+    // trace(pc, op, arg1, arg2) before each dispatched instruction;
+    // superinstructions are reported once, with their F_* opcode
+    static const bool kTrace = false;
+    static void trace(uint16_t, uint8_t, uint8_t, uint8_t) {}
+    // profile(op) once per dispatched instruction
+    static const bool kProfile = false;
+    static void profile(uint8_t) {}
+    // Runtime errors (the VM stops right after reporting) and programs or
+    // containers the loaders reject
+    static void error(const char* message) { Serial.println(message); }
+    // Status lines: a program was loaded, HALT was reached
+    static void message(const char* text) { Serial.println(text); }
+};
+
+template <uint16_t StackSize = VM_STACK_SIZE, uint16_t HeapSize = VM_HEAP_SIZE,
+          uint16_t MaxProgramSize = VM_MAX_PROGRAM_SIZE, uint16_t ReturnDepth = VM_RETURN_DEPTH,
+          class Policy = DefaultVMPolicy>
+class BasicTinyVM {
 public:
+    static_assert(HeapSize % 4 == 0, "heap must hold whole 32-bit words");
+    static_assert(StackSize > 0 && ReturnDepth > 0, "stacks must not be empty");
+    static const uint16_t kStackSize = StackSize;
+    static const uint16_t kHeapSize = HeapSize;
+    static const uint16_t kHeapWords = HeapSize / 4;
+    static const uint16_t kMaxProgramSize = MaxProgramSize;
+    static const uint16_t kReturnDepth = ReturnDepth;
+    typedef Policy PolicyType;
+
     int32_t registers[NUM_REGISTERS];
-    int32_t stack[VM_STACK_SIZE];
-    uint8_t heap[VM_HEAP_SIZE];
+    int32_t stack[StackSize];
+    uint8_t heap[HeapSize];
     uint16_t sp, pc;
+    uint16_t fp;    // stack index of the current frame's first slot
+    // CALL return addresses, apart from the data stack: only CALL writes
+    // them and the verifier proves the instruction after a CALL exists, so
+    // RET needs no address check and PUSH/POP cannot redirect it
+    uint16_t retStack[ReturnDepth];
+    uint16_t rsp;
     bool running;
+    bool faulted;   // the last stop was a runtime error, not HALT/RET
     const uint8_t* program;
     size_t programSize;
+    CodePager* pager;   // set instead of program while running a paged program
+    // Constant pool LOADK reads: constCount little-endian int32s. Set with
+    // setConstPool() before loading the program that uses it.
+    const uint8_t* constPool;
+    uint16_t constCount;
     Flags flags;
-    size_t heap_top;
+    size_t heap_top;    // arena bump pointer in bytes, always word aligned
+    // heap_top at the first loop() entry: each iteration restarts the arena
+    // there, so blocks main() allocated stay and loop() scratch is reused
+    int loop_arena_base;
+    // Heap bytes past heapUsed are still zero; snapshots copy only the rest
+    uint16_t heapUsed;
     int loop_start_pc;
-
-    TinyVM() { reset(); }
+    // Bitmap of instruction boundaries proven by verifyProgram()
+    uint8_t instrStart[MaxProgramSize / 8];
+    // Opcode execute() dispatches on, one slot per instruction (indexed by
+    // pc / 3, unique because instructions are at least 3 bytes long). Fused
+    // heads hold an F_* opcode; all other slots mirror program[pc].
+    uint8_t opTable[MaxProgramSize / 3 + 1];
+    // Sites rewritten at load, per pattern
+    uint16_t fusionSites[FUSION_PATTERN_COUNT];
+#ifdef VM_FUSION_STATS
+    // Executions of each superinstruction
+    uint32_t fusionHits[FUSION_PATTERN_COUNT];
+#endif
+#ifdef VM_TRACE_CACHE
+    // Predecoded basic blocks (see VM_TRACE_CACHE_*). A hit is a block found
+    // through its slot, a miss one that had to be decoded first; entries
+    // through a linked exit count as neither.
+    MicroOp traceOps[VM_TRACE_CACHE_UOPS];
+    TraceBlock traceBlocks[VM_TRACE_CACHE_BLOCKS];
+    uint16_t traceUsed;
+    // Exit execute() enters through, linked to the block it started at last
+    MicroOp traceEntry;
+    uint32_t traceHits, traceMisses;
+#endif
+    // Program waiting for the next loop iteration (see stageProgram()),
+    // with the boundaries verified for it
+    const uint8_t* stagedProgram;
+    size_t stagedSize;
+    const uint8_t* stagedPool;
+    uint16_t stagedConstCount;
+    uint16_t stagedEntry;
+    int stagedLoopStart;
+    bool stagedKeepRegisters;
+    uint8_t stagedStart[MaxProgramSize / 8];
+    uint16_t swaps;     // hot swaps since reset()
+
+    BasicTinyVM() { reset(); }
 
     void reset() {
-        for(int i=0; i<NUM_REGISTERS; i++) registers[i] = 0;
-        for(int i=0; i<VM_STACK_SIZE; i++) stack[i] = 0;
-        for(int i=0; i<VM_HEAP_SIZE; i++) heap[i] = 0;
-        sp = 0; pc = 0; running = false; program = nullptr; programSize = 0;
-        flags = Flags(); heap_top = 0;
-        loop_start_pc = -1;
+        memset(registers, 0, sizeof(registers));
+        memset(stack, 0, sizeof(stack));
+        memset(heap, 0, sizeof(heap));
+        memset(retStack, 0, sizeof(retStack));
+        sp = 0; pc = 0; fp = 0; rsp = 0; running = false; faulted = false;
+        program = nullptr; programSize = 0; pager = nullptr;
+        constPool = nullptr; constCount = 0;
+        flags = Flags(); heap_top = 0; heapUsed = 0;
+        loop_start_pc = -1; loop_arena_base = -1;
+        memset(instrStart, 0, sizeof(instrStart));
+        memset(fusionSites, 0, sizeof(fusionSites));
+#ifdef VM_FUSION_STATS
+        memset(fusionHits, 0, sizeof(fusionHits));
+#endif
+        clearTraceCache();
+        stagedProgram = nullptr; swaps = 0;
+    }
+
+    // Verifies the program once and makes it current. Rejected programs
+    // leave the VM stopped with no program loaded.
+    bool loadProgram(const uint8_t* code, size_t size) {
+        program = nullptr; programSize = 0; pager = nullptr; stagedProgram = nullptr;
+        pc = 0; running = false; faulted = false;
+        if (!verifyProgram(code, size)) {
+            Policy::error("Program rejected by verifier.");
+            return false;
+        }
+        if (loop_start_pc != -1 && !isInstructionStart((size_t)loop_start_pc)) {
+            Policy::error("Verify error: loop entry is not an instruction boundary");
+            return false;
+        }
+        program = code; programSize = size; running = true;
+        fuseProgram();
+        clearTraceCache();
+        Policy::message("Program Loaded.");
+        return true;
+    }
+
+    // Loads an .a3b container held in memory (see a3b.h): the code is
+    // verified and run in place, and the loop entry comes from the header.
+    // Compressed code is inflated into unpack, which must then hold
+    // capacity >= the code size bytes and outlive the program.
+    bool loadImage(const uint8_t* data, size_t size, uint8_t* unpack = nullptr, size_t capacity = 0) {
+        program = nullptr; programSize = 0; pager = nullptr; running = false;
+        A3bImage image;
+        const uint8_t* code = openImage(data, size, unpack, capacity, image);
+        if (code == nullptr) return false;
+        const A3bHeader& h = image.header;
+        loop_start_pc = (h.flags & A3B_FLAG_HAS_LOOP) ? (int)h.loop_entry : -1;
+        setConstPool(image.constants, h.const_count);
+        if (!loadProgram(code, h.code_size)) return false;
+        return setEntry(h.setup_entry);
+    }
+
+    // Parses a container and returns its runnable code, or null after
+    // reporting why it was rejected
+    static const uint8_t* openImage(const uint8_t* data, size_t size, uint8_t* unpack, size_t capacity,
+                                    A3bImage& image) {
+        const char* error = a3b_parse(data, size, &image);
+        if (error == nullptr && image.header.packed_size != 0) {
+            error = unpack != nullptr ? a3b_unpack(&image, unpack, capacity)
+                                      : "compressed code needs an unpack buffer";
+        }
+        if (error != nullptr) {
+            char text[80];
+            snprintf(text, sizeof(text), "Container rejected: %s", error);
+            Policy::error(text);
+            return nullptr;
+        }
+        return image.header.packed_size != 0 ? unpack : image.code;
+    }
+
+    // The pool must outlive the program; it is not copied
+    void setConstPool(const uint8_t* pool, uint16_t count) {
+        constPool = count > 0 ? pool : nullptr;
+        constCount = count;
+    }
+
+    int32_t loadConst(uint8_t idx) const {
+        int32_t value;
+        memcpy(&value, constPool + idx * 4, sizeof(value));
+        return value;
+    }
+
+    // Moves pc to where run() should start, a verified instruction boundary
+    bool setEntry(uint16_t addr) {
+        if (program != nullptr && !isInstructionStart(addr)) {
+            Policy::error("Verify error: setup entry is not an instruction boundary");
+            program = nullptr; programSize = 0; running = false;
+            return false;
+        }
+        pc = addr;
+        return true;
+    }
+
+    // Makes a paged program current. Nothing is verified up front: paged
+    // programs run on step(), which checks each instruction as it fetches
+    // it, and pages are only read once execution reaches them.
+    bool loadPaged(CodePager& code) {
+        program = nullptr; programSize = 0; pager = nullptr; stagedProgram = nullptr;
+        pc = 0; running = false; faulted = false;
+        if (code.size == 0 || code.size > 0xFFFF) {
+            Policy::error("Paged program must be 1..65535 bytes.");
+            return false;
+        }
+        pager = &code; programSize = code.size; running = true;
+        flushTraceCache();
+        Policy::message("Program Loaded (paged).");
+        return true;
+    }
+
+    bool hasProgram() const {
+        return program != nullptr || pager != nullptr;
+    }
+
+    // --- Hot swap ---
+    // stageProgram() verifies a new program next to the running one, and
+    // beginLoop() switches to it before the next loop iteration, so an
+    // update waits at most one iteration and never lands mid-iteration.
+    // With keepRegisters the new loop starts from the current registers,
+    // heap and loop arena (an update that keeps the same globals);
+    // otherwise the machine state is cleared and the new program's setup
+    // code runs from entry first. Nothing is copied: code and pool must
+    // stay valid, and the old program's buffers are only free once
+    // swapPending() is false.
+    bool stageProgram(const uint8_t* code, size_t size, int loopStart, bool keepRegisters,
+                      const uint8_t* pool = nullptr, uint16_t poolCount = 0, uint16_t entry = 0) {
+        stagedProgram = nullptr;
+        if (!verifyProgram(code, size, poolCount, stagedStart)) {
+            Policy::error("Staged program rejected by verifier.");
+            return false;
+        }
+        if (loopStart < 0 || (size_t)loopStart >= size || (size_t)entry >= size ||
+            !(stagedStart[loopStart >> 3] & (1 << (loopStart & 7))) ||
+            !(stagedStart[entry >> 3] & (1 << (entry & 7)))) {
+            Policy::error("Verify error: staged program needs loop and setup entries on instruction boundaries");
+            return false;
+        }
+        stagedSize = size;
+        stagedPool = poolCount > 0 ? pool : nullptr;
+        stagedConstCount = poolCount;
+        stagedEntry = entry;
+        stagedLoopStart = loopStart;
+        stagedKeepRegisters = keepRegisters;
+        stagedProgram = code;   // last: the swap is armed once all is set
+        return true;
+    }
+
+    // Stages an .a3b container held in memory; it must have a loop
+    // function. unpack is as for loadImage().
+    bool stageImage(const uint8_t* data, size_t size, bool keepRegisters,
+                    uint8_t* unpack = nullptr, size_t capacity = 0) {
+        stagedProgram = nullptr;
+        A3bImage image;
+        const uint8_t* code = openImage(data, size, unpack, capacity, image);
+        if (code == nullptr) return false;
+        const A3bHeader& h = image.header;
+        int loopStart = (h.flags & A3B_FLAG_HAS_LOOP) ? (int)h.loop_entry : -1;
+        return stageProgram(code, h.code_size, loopStart, keepRegisters,
+                            image.constants, h.const_count, h.setup_entry);
+    }
+
+    bool swapPending() const {
+        return stagedProgram != nullptr;
     }
 
-    void loadProgram(const uint8_t* code, size_t size) {
-        program = code; programSize = size; pc = 0; running = true;
-        Serial.println("Program Loaded.");
+    void cancelSwap() {
+        stagedProgram = nullptr;
+    }
+
+    // Makes the staged program current; beginLoop() calls it between
+    // iterations
+    void swapStaged() {
+        program = stagedProgram; programSize = stagedSize; pager = nullptr;
+        constPool = stagedPool; constCount = stagedConstCount;
+        loop_start_pc = stagedLoopStart;
+        memcpy(instrStart, stagedStart, sizeof(instrStart));
+        stagedProgram = nullptr;
+        fuseProgram();
+        clearTraceCache();
+        swaps++;
+        if (stagedKeepRegisters) return;
+
+        memset(registers, 0, sizeof(registers));
+        memset(heap, 0, heapUsed);
+        heapUsed = 0; heap_top = 0; loop_arena_base = -1;
+        flags = Flags();
+        sp = 0; fp = 0; rsp = 0;
+        pc = stagedEntry;
+        running = true; faulted = false;
+        execute();
+    }
+
+    // Instruction bytes at addr, from program or through the page cache
+    bool fetchCode(size_t addr, uint8_t* dst, uint8_t len) {
+        if (pager != nullptr) return pager->fetch((uint32_t)addr, dst, len);
+        memcpy(dst, program + addr, len);
+        return true;
+    }
+
+    // Fills opTable for the current (verified) program and rewrites the head
+    // of every known idiom into a superinstruction. Only the head slot
+    // changes, so jumping into the middle of a fused sequence still runs the
+    // original instructions.
+    void fuseProgram() {
+        memset(fusionSites, 0, sizeof(fusionSites));
+#ifdef VM_FUSION_STATS
+        memset(fusionHits, 0, sizeof(fusionHits));
+#endif
+
+        for (size_t addr = 0; addr < programSize; addr += instructionLength(program[addr])) {
+            opTable[addr / 3] = program[addr];
+#ifndef VM_DISABLE_FUSION
+            for (size_t p = 0; p < FUSION_PATTERN_COUNT; p++) {
+                if (matchFusion(fusionPatterns[p], addr)) {
+                    opTable[addr / 3] = fusionPatterns[p].fused;
+                    fusionSites[p]++;
+                    break;
+                }
+            }
+#endif
+        }
+    }
+
+    bool matchFusion(const FusionPattern& pat, size_t addr) const {
+        if (program[addr] != pat.ops[0]) return false;
+        size_t next = addr + instructionLength(pat.ops[0]);
+        return next < programSize && program[next] == pat.ops[1];
+    }
+
+    // Bytes covered by a fused head: both instructions of its sequence
+    static size_t fusedLength(uint8_t op) {
+        const FusionPattern& pat = fusionPatterns[op - F_FIRST];
+        return instructionLength(pat.ops[0]) + instructionLength(pat.ops[1]);
+    }
+
+    // Drops every cached block; without VM_TRACE_CACHE there is nothing to
+    // drop and the calls compile away
+    void flushTraceCache() {
+#ifdef VM_TRACE_CACHE
+        for (size_t i = 0; i < VM_TRACE_CACHE_BLOCKS; i++) traceBlocks[i].count = 0;
+        traceUsed = 0;
+        traceEntry.pc = 0xFFFF;
+#endif
+    }
+
+    // Flush for a new program, which also restarts the hit/miss counters
+    void clearTraceCache() {
+        flushTraceCache();
+#ifdef VM_TRACE_CACHE
+        traceHits = 0; traceMisses = 0;
+#endif
+    }
+
+#ifdef VM_TRACE_CACHE
+    // True for instructions after which execution may not continue at the
+    // next sequential address. A fused head ends a block if its sequence does.
+    static bool endsBlock(uint8_t op) {
+        if (op >= F_FIRST) op = fusionPatterns[op - F_FIRST].ops[1];
+        return (op >= JMP && op <= HALT) || (op >= BEQ && op <= BGE);
+    }
+
+    // Decodes the block starting at addr into out[], stopping after the first
+    // block-ending instruction or after `max` micro-ops. A fused head covers
+    // its whole sequence, so the instructions it absorbs get no micro-op.
+    uint16_t decodeBlock(size_t addr, MicroOp* out, uint16_t max) const {
+        uint16_t n = 0;
+        while (n < max && addr < programSize) {
+            uint8_t op = opTable[addr / 3];
+            MicroOp& u = out[n++];
+            u.pc = (uint16_t)addr;
+            u.op = op;
+            u.arg1 = program[addr + 1];
+            u.arg2 = program[addr + 2];
+            if (endsBlock(op)) break;
+            addr += op >= F_FIRST ? fusedLength(op) : instructionLength(op);
+        }
+        return n;
+    }
+
+    static size_t traceSlot(size_t addr) {
+        return (addr / 3) % VM_TRACE_CACHE_BLOCKS;
+    }
+
+    // Miss path of traceEnter(): decodes the block entered at addr into its
+    // slot and closes it with an unlinked exit. When the pool cannot take
+    // another full block the whole cache is dropped first.
+    const TraceBlock& fillBlock(size_t addr) {
+        TraceBlock& slot = traceBlocks[traceSlot(addr)];
+        traceMisses++;
+        if (VM_TRACE_CACHE_UOPS - traceUsed <= VM_TRACE_BLOCK_MAX) flushTraceCache();
+        slot.pc = (uint16_t)addr;
+        slot.first = traceUsed;
+        slot.count = decodeBlock(addr, &traceOps[traceUsed], VM_TRACE_BLOCK_MAX);
+        MicroOp& exit = traceOps[traceUsed + slot.count];
+        exit.pc = 0xFFFF;
+        exit.op = T_BLOCK_EXIT;
+        exit.arg1 = 0;
+        exit.arg2 = 0;
+        traceUsed += slot.count + 1;
+        return slot;
+    }
+
+    // First micro-op of the block entered at addr, through its slot
+    MicroOp* traceEnter(size_t addr) {
+        const TraceBlock* blk = &traceBlocks[traceSlot(addr)];
+        if (blk->pc == addr && blk->count != 0) {
+            traceHits++;
+        } else {
+            blk = &fillBlock(addr);
+        }
+        return &traceOps[blk->first];
+    }
+
+    // Slow path of a block exit whose link does not match addr: enters the
+    // block through its slot and links the exit to it if it was already
+    // cached. A miss may have flushed the pool under the exit, so it stays
+    // unlinked until a later pass finds the block cached.
+    MicroOp* traceFollow(MicroOp* exit, size_t addr) {
+        uint32_t misses = traceMisses;
+        MicroOp* next = traceEnter(addr);
+        if (traceMisses == misses) {
+            uint16_t offset = (uint16_t)((uint8_t*)next - (uint8_t*)traceOps);
+            exit->pc = (uint16_t)addr;
+            exit->arg1 = (uint8_t)offset;
+            exit->arg2 = (uint8_t)(offset >> 8);
+        }
+        return next;
+    }
+
+    // Block a linked exit leads to
+    MicroOp* traceLink(const MicroOp* exit) {
+        return (MicroOp*)((uint8_t*)traceOps + (exit->arg1 | (exit->arg2 << 8)));
+    }
+#endif
+
+    void dumpTraceStats() {
+#ifdef VM_TRACE_CACHE
+        Serial.println("--- Trace cache ---");
+        Serial.print("hits: "); Serial.println((int)traceHits);
+        Serial.print("misses: "); Serial.println((int)traceMisses);
+        Serial.print("micro-ops used: "); Serial.print((int)traceUsed);
+        Serial.print("/"); Serial.println((int)VM_TRACE_CACHE_UOPS);
+        Serial.println("-------------------");
+#endif
+    }
+
+    void dumpPagerStats() {
+        if (pager == nullptr) return;
+        Serial.println("--- Code pages ---");
+        Serial.print("hits: "); Serial.println((int)pager->hits);
+        Serial.print("misses: "); Serial.println((int)pager->misses);
+        Serial.print("image bytes: "); Serial.println((int)pager->size);
+        Serial.println("------------------");
+    }
+
+    void dumpFusionStats() {
+        Serial.println("--- Superinstructions ---");
+        for (size_t i = 0; i < FUSION_PATTERN_COUNT; i++) {
+            Serial.print(fusionPatterns[i].name); Serial.print(": ");
+            Serial.print((int)fusionSites[i]); Serial.print(" sites");
+#ifdef VM_FUSION_STATS
+            Serial.print(", "); Serial.print((int)fusionHits[i]); Serial.print(" hits");
+#endif
+            Serial.println();
+        }
+        Serial.println("-------------------------");
     }
 
     void setLoopStart(size_t addr) {
+        if (program != nullptr && !isInstructionStart(addr)) {
+            Policy::error("Verify error: loop entry is not an instruction boundary");
+            return;
+        }
         loop_start_pc = (int)addr;
     }
 
+    bool isInstructionStart(size_t addr) const {
+        return addr < MaxProgramSize && (instrStart[addr >> 3] & (1 << (addr & 7)));
+    }
+
+    // Wide instructions are the usual 3-byte head plus a 16-bit trailing word
+    static bool isWideOpcode(uint8_t op) {
+        return op == LOADI16 || (op >= BEQ && op <= BGE);
+    }
+
+    static size_t instructionLength(uint8_t op) {
+        return isWideOpcode(op) ? 5 : 3;
+    }
+
+    // Which operands of op name registers: arg1, arg2, or the two source
+    // nibbles packed in arg2. False for unknown opcodes.
+    static bool registerOperands(uint8_t op, bool& regs1, bool& regs2, bool& packed) {
+        regs1 = regs2 = packed = false;
+        switch (op) {
+            case ADD: case SUB: case MUL: case DIV: case MOD:
+            case AND: case OR: case XOR: case CMP:
+            case LOAD: case STORE: case LOADM:
+            case BEQ: case BNE: case BLT: case BGE:
+                regs1 = regs2 = true;
+                return true;
+            case NOT: case SHL: case SHR: case LOADI: case LOADI16:
+            case LOAD_ADDR: case PUSH: case POP: case PEEK: case PRINT:
+            case ALLOC: case FREE: case LDL: case STL: case LOADK:
+                regs1 = true;
+                return true;
+            case ADD3: case SUB3: case MUL3: case DIV3: case MOD3:
+            case AND3: case OR3: case XOR3: case NOT3:
+            case LOADX: case STOREX:
+                regs1 = packed = true;
+                return true;
+            case NOP: case JMP: case JZ: case JNZ: case JLT: case JGT:
+            case JLE: case JGE: case CALL: case RET: case HALT: case TRAP:
+            case ENTER: case LEAVE:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // Checked by checkProgram() for execute() and by step() per instruction
+    static bool registersInRange(uint8_t op, uint8_t arg1, uint8_t arg2) {
+        bool regs1, regs2, packed;
+        registerOperands(op, regs1, regs2, packed);
+        return !((regs1 && arg1 >= NUM_REGISTERS) || (regs2 && arg2 >= NUM_REGISTERS) ||
+                 (packed && (SRC_A(arg2) >= NUM_REGISTERS || SRC_B(arg2) >= NUM_REGISTERS)));
+    }
+
+    // Proves every property execute() relies on instead of checking it per
+    // instruction: known opcodes, register operands in range, complete
+    // trailing words, jump/CALL/branch targets on instruction boundaries
+    // (3-byte aligned unless a wide instruction precedes them) and no way to
+    // run off the end of the program.
+    bool verifyProgram(const uint8_t* code, size_t size) {
+        return verifyProgram(code, size, constCount, instrStart);
+    }
+
+    // Same checks, bounding LOADK by poolCount and recording boundaries in
+    // starts, so a staged program can be verified while another one runs
+    bool verifyProgram(const uint8_t* code, size_t size, uint16_t poolCount, uint8_t* starts) {
+        if (checkProgram(code, size, poolCount, starts)) return true;
+        memset(starts, 0, MaxProgramSize / 8);
+        return false;
+    }
+
+    bool checkProgram(const uint8_t* code, size_t size, uint16_t poolCount, uint8_t* starts) {
+        memset(starts, 0, MaxProgramSize / 8);
+
+        if (code == nullptr || size == 0) {
+            Policy::error("Verify error: empty program");
+            return false;
+        }
+        if (size > MaxProgramSize) {
+            Policy::error("Verify error: program exceeds MaxProgramSize");
+            return false;
+        }
+
+        // Pass 1: walk instruction boundaries and check operands
+        size_t addr = 0;
+        uint8_t last = NOP;
+        while (addr < size) {
+            uint8_t op = code[addr];
+            uint8_t arg1 = addr + 1 < size ? code[addr + 1] : 0;
+            uint8_t arg2 = addr + 2 < size ? code[addr + 2] : 0;
+            bool regs1, regs2, packed;
+            if (!registerOperands(op, regs1, regs2, packed)) {
+                return verifyFail("unknown opcode", addr);
+            }
+
+            size_t len = instructionLength(op);
+            if (addr + len > size) {
+                return verifyFail(isWideOpcode(op) ? "truncated trailing word" : "truncated instruction", addr);
+            }
+            if (!registersInRange(op, arg1, arg2)) {
+                return verifyFail("register operand out of range", addr);
+            }
+            if (op == LOADK && arg2 >= poolCount) {
+                return verifyFail("constant index out of range", addr);
+            }
+
+            starts[addr >> 3] |= (1 << (addr & 7));
+            last = op;
+            addr += len;
+        }
+
+        if (last != HALT && last != RET && last != JMP) {
+            return verifyFail("program can run past its last instruction", size);
+        }
+
+        // Pass 2: every branch target must be an instruction boundary
+        for (addr = 0; addr < size; addr += instructionLength(code[addr])) {
+            uint8_t op = code[addr];
+            size_t at;
+            if (op >= JMP && op <= CALL) at = addr + 1;
+            else if (op >= BEQ && op <= BGE) at = addr + 3;
+            else continue;
+            size_t target = ((size_t)code[at]) | ((size_t)code[at + 1] << 8);
+            if (target >= size || !(starts[target >> 3] & (1 << (target & 7)))) {
+                return verifyFail("jump target is not an instruction boundary", addr);
+            }
+        }
+        return true;
+    }
+
+    bool verifyFail(const char* reason, size_t addr) {
+        char text[80];
+        snprintf(text, sizeof(text), "Verify error at byte %u: %s", (unsigned)addr, reason);
+        Policy::error(text);
+        return false;
+    }
+
     void call_trap(uint8_t id) {
         switch (id) {
             case B_DIGITAL_READ: {
@@ -359,269 +1276,496 @@ public:
         }
     }
 
+    // Word view of the heap for LOADX/STOREX: word i is bytes 4i..4i+3,
+    // little-endian, so byte and word accesses see the same memory.
+    int32_t loadWord(uint32_t idx) const {
+        int32_t value;
+        memcpy(&value, &heap[idx * 4], sizeof(value));
+        return value;
+    }
+    void storeByte(uint32_t idx, int32_t value) {
+        heap[idx] = (uint8_t)value;
+        if (idx + 1 > heapUsed) heapUsed = (uint16_t)(idx + 1);
+    }
+
+    void storeWord(uint32_t idx, int32_t value) {
+        memcpy(&heap[idx * 4], &value, sizeof(value));
+        if (idx * 4 + 4 > heapUsed) heapUsed = (uint16_t)(idx * 4 + 4);
+    }
+
+    // Bump allocation for ALLOC: returns the block's base word, or -1 when
+    // the arena cannot hold it. Blocks are not cleared.
+    int32_t allocWords(uint8_t words) {
+        if (heap_top + words * 4u > HeapSize) return -1;
+        int32_t base = (int32_t)(heap_top / 4);
+        heap_top += words * 4u;
+        return base;
+    }
+
+    // LIFO release for FREE: base must be a live block (or the arena top)
+    bool freeWords(int32_t base) {
+        if (base < 0 || (uint32_t)base * 4u > heap_top) return false;
+        heap_top = (uint32_t)base * 4u;
+        return true;
+    }
+
+    // Frame operations shared by step() and execute(); false means the
+    // instruction would leave the stack or the current frame.
+    bool enterFrame(uint8_t slots) {
+        if (sp + 1u + slots > StackSize) return false;
+        stack[sp++] = fp;
+        fp = sp;
+        sp += slots;
+        return true;
+    }
+
+    bool leaveFrame() {
+        if (fp == 0 || fp > sp) return false;
+        sp = fp;
+        uint32_t saved = (uint32_t)stack[--sp];
+        if (saved > sp) return false;
+        fp = (uint16_t)saved;
+        return true;
+    }
+
+    void resetLoopArena() {
+        if (loop_arena_base < 0) loop_arena_base = (int)heap_top;
+        heap_top = (size_t)loop_arena_base;
+    }
+
+    // Checked one-instruction path, used for paged code and debugging. It
+    // runs the opcode bodies execute() runs (vm_opcodes.h) and makes the
+    // checks verifyProgram() proves for execute() before each instruction.
     void step() {
         if (!running || pc >= programSize) {
             running = false;
             return;
         }
 
-        if (pc + 3 > programSize) {
-            Serial.println("Error: Unexpected end of program");
-            running = false;
+        int32_t* R = registers;
+        size_t ip = pc;
+        // ins[3..4] hold the trailing word of wide instructions
+        uint8_t ins[5];
+        uint8_t op, arg1, arg2;
+
+#define VM_OP(name)     case name:
+#define VM_OP_INVALID   default:
+#define VM_NEXT()       break
+#define VM_NEXT_BLOCK() break
+#define VM_FAIL(message) do { Policy::error(message); goto fault; } while (0)
+#define VM_CHECKS       true
+#define VM_CHECK(failed, message) if (failed) VM_FAIL(message)
+#define VM_TARGET() (((size_t)arg1) | ((size_t)arg2 << 8))
+#define VM_WORD() (((size_t)ins[3]) | ((size_t)ins[4] << 8))
+
+        if ((size_t)pc + 3 > programSize) VM_FAIL("Error: Unexpected end of program");
+        if (!fetchCode(pc, ins, 3)) VM_FAIL("Error: Code page read failed");
+        op = ins[0];
+        arg1 = ins[1];
+        arg2 = ins[2];
+        if ((size_t)pc + instructionLength(op) > programSize) VM_FAIL("Error: Unexpected end of program");
+        if (isWideOpcode(op) && !fetchCode(pc + 3, ins + 3, 2)) VM_FAIL("Error: Code page read failed");
+        if (!registersInRange(op, arg1, arg2)) VM_FAIL("Error: register operand out of range");
+        if (op == LOADK && arg2 >= constCount) VM_FAIL("Error: constant index out of range");
+        ip += 3;
+
+        switch (op) {
+#include "vm_opcodes.h"
+            VM_OP_INVALID
+                VM_FAIL("Error: Unknown Opcode");
+        }
+        pc = (uint16_t)ip;
+        return;
+
+    fault:
+        faulted = true;
+    stop:
+        running = false;
+        pc = (uint16_t)ip;
+
+#undef VM_OP
+#undef VM_OP_INVALID
+#undef VM_NEXT
+#undef VM_NEXT_BLOCK
+#undef VM_FAIL
+#undef VM_CHECKS
+#undef VM_CHECK
+#undef VM_TARGET
+#undef VM_WORD
+    }
+
+    // Tight interpreter loop behind run()/runLoop(). Opcode bodies live in
+    // vm_opcodes.h, shared with step(); VM_OP/VM_NEXT expand either to
+    // computed-goto labels (threaded engine) or to switch cases (portable
+    // engine).
+    //
+    // Only programs accepted by verifyProgram() get here, so operands, branch
+    // targets and the end of the program are not re-checked per instruction.
+    // What remains are data-dependent checks: stack and call depth and heap
+    // indices.
+    template <bool Budgeted = false>
+    void execute(uint32_t budget = 0) {
+        if (!running) return;
+        if (pager != nullptr) {
+            // Paged code is fetched one checked instruction at a time
+            for (uint32_t n = 0; running && (!Budgeted || n < budget); n++) step();
             return;
         }
 
-        uint8_t op = program[pc];
-        uint8_t arg1 = program[pc + 1];
-        uint8_t arg2 = program[pc + 2];
-        pc += 3;
+        const uint8_t* code = program;
+        const uint8_t* ops = opTable;
+        int32_t* R = registers;
+        size_t ip = pc;
+        uint8_t op, arg1, arg2;
+
+#ifdef VM_TRACE_CACHE
+        // Micro-ops run in program order, so ip advances exactly as it does
+        // over the bytecode. Blocks end on every control transfer, where
+        // VM_NEXT_BLOCK() moves u to the next block; a split block runs into
+        // its T_BLOCK_EXIT, which does the same. The fetch itself never
+        // checks for the end of a block.
+        MicroOp* u = traceEntry.pc == ip ? traceLink(&traceEntry) : traceFollow(&traceEntry, ip);
+        (void)ops;
+#define VM_FETCH()              \
+        op = u->op;             \
+        arg1 = u->arg1;         \
+        arg2 = u->arg2;         \
+        ip += 3;                \
+        u++
+// After a control transfer u is at the block's exit; a block that goes
+// where it went last time follows the exit's link without a lookup.
+#define VM_FOLLOW()                                             \
+        if (u->pc == ip) {                                      \
+            u = traceLink(u);                                   \
+        } else {                                                \
+            u = traceFollow(u, ip);                             \
+        }
+#else
+#define VM_FETCH()              \
+        op = ops[ip / 3];       \
+        arg1 = code[ip + 1];    \
+        arg2 = code[ip + 2];    \
+        ip += 3
+#endif
+#define VM_TARGET() (((size_t)arg1) | ((size_t)arg2 << 8))
+#define VM_TARGET_AT(at) (((size_t)code[(at)]) | ((size_t)code[(at) + 1] << 8))
+// Runtime errors go to the policy's reporter; range checks compile away
+// when the policy disables them.
+#define VM_FAIL(message) do { Policy::error(message); goto fault; } while (0)
+#define VM_CHECKS Policy::kBoundsChecks
+#define VM_CHECK(failed, message) if (VM_CHECKS && (failed)) VM_FAIL(message)
+#define VM_WORD() VM_TARGET_AT(ip)
+// Hooks run after each fetch, with ip already past the instruction's head.
+// A block exit is not an instruction and skips them.
+#ifdef VM_TRACE_CACHE
+#define VM_HOOKED() (op != T_BLOCK_EXIT)
+#else
+#define VM_HOOKED() true
+#endif
+#define VM_HOOKS()                                                          \
+        if (Policy::kTrace && VM_HOOKED()) Policy::trace((uint16_t)(ip - 3), op, arg1, arg2); \
+        if (Policy::kProfile && VM_HOOKED()) Policy::profile(op)
+// Budgeted runs (runFor) stop before fetching once the budget is spent;
+// for run()/runLoop() the check compiles away.
+#define VM_BUDGET() if (Budgeted && budget-- == 0) goto yield
+#ifdef VM_FUSION_STATS
+#define VM_FUSED_HIT() fusionHits[op - F_FIRST]++
+#else
+#define VM_FUSED_HIT() ((void)0)
+#endif
 
-        switch (op) {
-            case NOP: break;
-            case ADD:
-                if (arg1 < NUM_REGISTERS && arg2 < NUM_REGISTERS) {
-                    registers[0] = registers[arg1] + registers[arg2];
-                }
-                break;
-            case SUB:
-                if (arg1 < NUM_REGISTERS && arg2 < NUM_REGISTERS) {
-                    registers[0] = registers[arg1] - registers[arg2];
-                }
-                break;
-            case MUL:
-                if (arg1 < NUM_REGISTERS && arg2 < NUM_REGISTERS) {
-                    registers[0] = registers[arg1] * registers[arg2];
-                }
-                break;
-            case DIV:
-                if (arg1 < NUM_REGISTERS && arg2 < NUM_REGISTERS) {
-                    if (registers[arg2] != 0)
-                        registers[0] = registers[arg1] / registers[arg2];
-                    else
-                        registers[0] = 0;
-                }
-                break;
-            case MOD:
-                if (arg1 < NUM_REGISTERS && arg2 < NUM_REGISTERS) {
-                    if (registers[arg2] != 0)
-                        registers[0] = registers[arg1] % registers[arg2];
-                    else
-                        registers[0] = 0;
-                }
-                break;
-            case AND:
-                if (arg1 < NUM_REGISTERS && arg2 < NUM_REGISTERS) {
-                    registers[0] = registers[arg1] & registers[arg2];
-                }
-                break;
-            case OR:
-                if (arg1 < NUM_REGISTERS && arg2 < NUM_REGISTERS) {
-                    registers[0] = registers[arg1] | registers[arg2];
-                }
-                break;
-            case XOR:
-                if (arg1 < NUM_REGISTERS && arg2 < NUM_REGISTERS) {
-                    registers[0] = registers[arg1] ^ registers[arg2];
-                }
-                break;
-            case NOT:
-                if (arg1 < NUM_REGISTERS) {
-                    registers[0] = ~registers[arg1];
-                }
-                break;
-            case CMP:
-                if (arg1 < NUM_REGISTERS && arg2 < NUM_REGISTERS) {
-                    int32_t a = registers[arg1];
-                    int32_t b = registers[arg2];
-                    flags.zero = (a == b);
-                    flags.lt   = (a < b);
-                    flags.gt   = (a > b);
-                    flags.le   = (a <= b);
-                    flags.ge   = (a >= b);
-                }
-                break;
-            case SHL:
-                if (arg1 < NUM_REGISTERS) {
-                    registers[0] = registers[arg1] << (arg2 & 31);
-                }
-                break;
-            case SHR:
-                if (arg1 < NUM_REGISTERS) {
-                    registers[0] = registers[arg1] >> (arg2 & 31);
-                }
-                break;
-            case LOAD:
-                if (arg1 < NUM_REGISTERS && arg2 < NUM_REGISTERS) {
-                    registers[arg1] = registers[arg2];
-                }
-                break;
-            case LOADI:
-                if (arg1 < NUM_REGISTERS) {
-                    registers[arg1] = (int32_t)arg2;
-                }
-                break;
-            case LOADI16:
-                if (arg1 < NUM_REGISTERS) {
-                    if (pc + 2 <= programSize) {
-                        uint16_t word = program[pc] | (program[pc+1] << 8);
-                        pc += 2;
-                        registers[arg1] = (int32_t)word;
-                    } else {
-                        Serial.println("Error: LOADI16 requires 2 more bytes");
-                        running = false;
-                    }
-                }
-                break;
-            case STORE:
-                if (arg1 < NUM_REGISTERS && arg2 < NUM_REGISTERS) {
-                    int idx = registers[arg1];
-                    if (idx >= 0 && idx < (int)VM_HEAP_SIZE) {
-                        heap[idx] = (uint8_t)registers[arg2];
-                    }
-                }
-                break;
-            case LOAD_ADDR:
-                if (arg1 < NUM_REGISTERS) {
-                    registers[arg1] = (int32_t)(heap_top + arg2);
-                }
-                break;
-            case PUSH:
-                if (arg1 < NUM_REGISTERS) {
-                    if (sp < VM_STACK_SIZE) {
-                        stack[sp++] = registers[arg1];
-                    } else {
-                        Serial.println("Error: Stack Overflow");
-                        running = false;
-                    }
-                }
-                break;
-            case POP:
-                if (arg1 < NUM_REGISTERS) {
-                    if (sp > 0) {
-                        registers[arg1] = stack[--sp];
-                    } else {
-                        Serial.println("Error: Stack Underflow");
-                        running = false;
-                    }
-                }
-                break;
-            case PEEK:
-                if (arg1 < NUM_REGISTERS) {
-                    uint16_t idx = sp + arg2;
-                    if (idx < VM_STACK_SIZE) {
-                        registers[arg1] = stack[idx];
-                    } else {
-                        Serial.println("Error: PEEK out of bounds");
-                        running = false;
-                    }
-                }
-                break;
-            case LOADM:
-                if (arg1 < NUM_REGISTERS && arg2 < NUM_REGISTERS) {
-                    int idx = registers[arg2];
-                    if (idx >= 0 && idx < (int)VM_HEAP_SIZE) {
-                        registers[arg1] = heap[idx];
-                    } else {
-                        Serial.println("Error: LOADM out of bounds");
-                        running = false;
-                    }
-                }
-                break;
-            case JMP:
-                pc = ((uint16_t)arg1) | ((uint16_t)arg2 << 8);
-                break;
-            case JZ:
-                if (flags.zero) {
-                    pc = ((uint16_t)arg1) | ((uint16_t)arg2 << 8);
-                }
-                break;
-            case JNZ:
-                if (!flags.zero) {
-                    pc = ((uint16_t)arg1) | ((uint16_t)arg2 << 8);
-                }
-                break;
-            case JLT:
-                if (flags.lt) {
-                    pc = ((uint16_t)arg1) | ((uint16_t)arg2 << 8);
-                }
-                break;
-            case JGT:
-                if (flags.gt) {
-                    pc = ((uint16_t)arg1) | ((uint16_t)arg2 << 8);
-                }
-                break;
-            case JLE:
-                if (flags.le) {
-                    pc = ((uint16_t)arg1) | ((uint16_t)arg2 << 8);
-                }
-                break;
-            case JGE:
-                if (flags.ge) {
-                    pc = ((uint16_t)arg1) | ((uint16_t)arg2 << 8);
-                }
-                break;
-            case CALL:
-                if (sp + 2 < VM_STACK_SIZE) {
-                    uint16_t ret = pc;
-                    stack[sp++] = ret & 0xFFFF;
-                    stack[sp++] = (ret >> 16);
-                    pc = ((uint16_t)arg1) | ((uint16_t)arg2 << 8);
-                } else {
-                    Serial.println("Error: Stack overflow on CALL");
-                    running = false;
-                }
-                break;
-            case RET:
-                // pop return address
-                if (sp >= 2) {
-                    sp -= 2;
-                    uint32_t low = (uint32_t)stack[sp];
-                    uint32_t high = (uint32_t)stack[sp+1];
-                    uint32_t ret = (high << 16) | (low & 0xFFFF);
-                    pc = (uint16_t)ret;
-                } else {
-                    // If stack is empty, we assume we returned from the main loop function
-                    // Clean exit from the loop iteration
-                    running = false;
-                }
-                break;
-            case HALT:
-                running = false;
-                Serial.println("HALT encountered.");
-                break;
-            case PRINT:
-                if (arg1 < NUM_REGISTERS) {
-                    Serial.println(registers[arg1]);
-                }
-                break;
-            case TRAP:
-                call_trap(arg1);
-                break;
-            default:
-                Serial.print("Unknown Opcode: ");
-                Serial.println(op, HEX);
-                running = false;
-                break;
+#ifdef VM_DISPATCH_THREADED
+        static void* dispatch[256];
+        static bool dispatchReady = false;
+        if (!dispatchReady) {
+            for (int i = 0; i < 256; i++) dispatch[i] = &&op_INVALID;
+            dispatch[NOP] = &&op_NOP;
+            dispatch[ADD] = &&op_ADD;     dispatch[SUB] = &&op_SUB;
+            dispatch[MUL] = &&op_MUL;     dispatch[DIV] = &&op_DIV;
+            dispatch[MOD] = &&op_MOD;     dispatch[AND] = &&op_AND;
+            dispatch[OR] = &&op_OR;       dispatch[XOR] = &&op_XOR;
+            dispatch[NOT] = &&op_NOT;     dispatch[CMP] = &&op_CMP;
+            dispatch[SHL] = &&op_SHL;     dispatch[SHR] = &&op_SHR;
+            dispatch[LOAD] = &&op_LOAD;   dispatch[LOADI] = &&op_LOADI;
+            dispatch[LOADI16] = &&op_LOADI16;
+            dispatch[STORE] = &&op_STORE; dispatch[LOAD_ADDR] = &&op_LOAD_ADDR;
+            dispatch[PUSH] = &&op_PUSH;   dispatch[POP] = &&op_POP;
+            dispatch[PEEK] = &&op_PEEK;   dispatch[LOADM] = &&op_LOADM;
+            dispatch[LOADX] = &&op_LOADX; dispatch[STOREX] = &&op_STOREX;
+            dispatch[JMP] = &&op_JMP;     dispatch[JZ] = &&op_JZ;
+            dispatch[JNZ] = &&op_JNZ;     dispatch[JLT] = &&op_JLT;
+            dispatch[JGT] = &&op_JGT;     dispatch[JLE] = &&op_JLE;
+            dispatch[JGE] = &&op_JGE;     dispatch[CALL] = &&op_CALL;
+            dispatch[RET] = &&op_RET;     dispatch[HALT] = &&op_HALT;
+            dispatch[BEQ] = &&op_BEQ;     dispatch[BNE] = &&op_BNE;
+            dispatch[BLT] = &&op_BLT;     dispatch[BGE] = &&op_BGE;
+            dispatch[PRINT] = &&op_PRINT; dispatch[TRAP] = &&op_TRAP;
+            dispatch[ALLOC] = &&op_ALLOC; dispatch[FREE] = &&op_FREE;
+            dispatch[ENTER] = &&op_ENTER; dispatch[LEAVE] = &&op_LEAVE;
+            dispatch[LDL] = &&op_LDL; dispatch[STL] = &&op_STL;
+            dispatch[LOADK] = &&op_LOADK;
+            dispatch[ADD3] = &&op_ADD3;   dispatch[SUB3] = &&op_SUB3;
+            dispatch[MUL3] = &&op_MUL3;   dispatch[DIV3] = &&op_DIV3;
+            dispatch[MOD3] = &&op_MOD3;   dispatch[AND3] = &&op_AND3;
+            dispatch[OR3] = &&op_OR3;     dispatch[XOR3] = &&op_XOR3;
+            dispatch[NOT3] = &&op_NOT3;
+            dispatch[F_LOADI_BEQ] = &&op_F_LOADI_BEQ; dispatch[F_LOADI_BNE] = &&op_F_LOADI_BNE;
+            dispatch[F_LOADI_BLT] = &&op_F_LOADI_BLT; dispatch[F_LOADI_BGE] = &&op_F_LOADI_BGE;
+            dispatch[F_LOADK_BEQ] = &&op_F_LOADK_BEQ; dispatch[F_LOADK_BNE] = &&op_F_LOADK_BNE;
+            dispatch[F_LOADK_BLT] = &&op_F_LOADK_BLT; dispatch[F_LOADK_BGE] = &&op_F_LOADK_BGE;
+            dispatch[F_ADD3_MOV] = &&op_F_ADD3_MOV;   dispatch[F_SUB3_MOV] = &&op_F_SUB3_MOV;
+            dispatch[F_MUL3_MOV] = &&op_F_MUL3_MOV;   dispatch[F_LOADI_MOV] = &&op_F_LOADI_MOV;
+            dispatch[F_MOV_MOV] = &&op_F_MOV_MOV;
+#ifdef VM_TRACE_CACHE
+            dispatch[T_BLOCK_EXIT] = &&op_T_BLOCK_EXIT;
+#endif
+            dispatchReady = true;
         }
+#define VM_OP(name)     op_##name:
+#define VM_OP_INVALID   op_INVALID:
+#define VM_NEXT()       do { VM_BUDGET(); VM_FETCH(); VM_HOOKS(); goto *dispatch[op]; } while (0)
+#ifdef VM_TRACE_CACHE
+#define VM_NEXT_BLOCK() do { VM_FOLLOW(); VM_NEXT(); } while (0)
+#else
+#define VM_NEXT_BLOCK() VM_NEXT()
+#endif
+
+        VM_NEXT();
+#else
+#define VM_OP(name)     case name:
+#define VM_OP_INVALID   default:
+#define VM_NEXT()       continue
+#ifdef VM_TRACE_CACHE
+#define VM_NEXT_BLOCK() do { VM_FOLLOW(); continue; } while (0)
+#else
+#define VM_NEXT_BLOCK() continue
+#endif
+
+        for (;;) {
+            VM_BUDGET();
+            VM_FETCH();
+            VM_HOOKS();
+            switch (op) {
+#endif
+#include "vm_opcodes.h"
+
+            // --- Superinstructions (see fusionPatterns) ---
+            // Each one has exactly the effects of the sequence it replaces,
+            // including the intermediate register writes and flags.
+// LOADI/LOADK t x ; Bcc a b addr, with ip at the Bcc
+#define VM_FUSED_LOAD_BCC(name, value, cmp)                 \
+            VM_OP(name)                                     \
+                VM_FUSED_HIT();                             \
+                R[arg1] = (value);                          \
+                ip = R[code[ip + 1]] cmp R[code[ip + 2]]    \
+                     ? VM_TARGET_AT(ip + 3) : ip + 5;       \
+                VM_NEXT_BLOCK();
+// ALU3 d ab ; LOAD x y, with ip at the LOAD
+#define VM_FUSED_ALU3_MOV(name, alu)                        \
+            VM_OP(name)                                     \
+                VM_FUSED_HIT();                             \
+                R[arg1] = R[SRC_A(arg2)] alu R[SRC_B(arg2)];\
+                R[code[ip + 1]] = R[code[ip + 2]];          \
+                ip += 3;                                    \
+                VM_NEXT();
+
+            VM_FUSED_LOAD_BCC(F_LOADI_BEQ, (int32_t)arg2, ==)
+            VM_FUSED_LOAD_BCC(F_LOADI_BNE, (int32_t)arg2, !=)
+            VM_FUSED_LOAD_BCC(F_LOADI_BLT, (int32_t)arg2, <)
+            VM_FUSED_LOAD_BCC(F_LOADI_BGE, (int32_t)arg2, >=)
+            VM_FUSED_LOAD_BCC(F_LOADK_BEQ, loadConst(arg2), ==)
+            VM_FUSED_LOAD_BCC(F_LOADK_BNE, loadConst(arg2), !=)
+            VM_FUSED_LOAD_BCC(F_LOADK_BLT, loadConst(arg2), <)
+            VM_FUSED_LOAD_BCC(F_LOADK_BGE, loadConst(arg2), >=)
+            VM_FUSED_ALU3_MOV(F_ADD3_MOV, +)
+            VM_FUSED_ALU3_MOV(F_SUB3_MOV, -)
+            VM_FUSED_ALU3_MOV(F_MUL3_MOV, *)
+            VM_OP(F_LOADI_MOV)
+                VM_FUSED_HIT();
+                R[arg1] = (int32_t)arg2;
+                R[code[ip + 1]] = R[code[ip + 2]];
+                ip += 3;
+                VM_NEXT();
+            VM_OP(F_MOV_MOV)
+                VM_FUSED_HIT();
+                R[arg1] = R[arg2];
+                R[code[ip + 1]] = R[code[ip + 2]];
+                ip += 3;
+                VM_NEXT();
+#undef VM_FUSED_LOAD_BCC
+#undef VM_FUSED_ALU3_MOV
+
+#ifdef VM_TRACE_CACHE
+            // Exit of a block that was split or runs into the next one
+            // without a control transfer. It is not an instruction: undo the
+            // fetch's advance and give back the budget it took.
+            VM_OP(T_BLOCK_EXIT)
+                ip -= 3;
+                u--;
+                if (Budgeted) budget++;
+                VM_NEXT_BLOCK();
+#endif
+
+            VM_OP_INVALID
+                VM_FAIL("Error: Unknown Opcode");
+#ifndef VM_DISPATCH_THREADED
+            }
+        }
+#endif
+
+    fault:
+        faulted = true;
+    stop:
+        running = false;
+        pc = (uint16_t)ip;
+        return;
+    yield:
+        // Still running: pc and the rest of the state resume the program
+        pc = (uint16_t)ip;
+
+#undef VM_BUDGET
+#undef VM_FAIL
+#undef VM_CHECKS
+#undef VM_CHECK
+#undef VM_WORD
+#undef VM_HOOKS
+#undef VM_HOOKED
+#undef VM_FETCH
+#undef VM_FOLLOW
+#undef VM_TARGET
+#undef VM_TARGET_AT
+#undef VM_FUSED_HIT
+#undef VM_OP
+#undef VM_OP_INVALID
+#undef VM_NEXT
+    }
+
+    // Machine state between two instructions. The scalars live in the
+    // struct; the live stack slots [0, sp), return addresses [0, rsp) and
+    // the written heap prefix [0, heapUsed) are packed back to back into a
+    // caller-provided buffer of snapshotSize() bytes, so a snapshot takes
+    // as much memory as the program used. Stack slots above sp are not
+    // part of the state (PEEK past sp reads garbage).
+    struct Snapshot {
+        int32_t registers[NUM_REGISTERS];
+        Flags flags;
+        uint16_t pc, sp, fp, rsp, heapUsed;
+        size_t heap_top;
+        int loop_arena_base;
+        bool running, faulted;
+        const uint8_t* data;    // the buffer passed to snapshot()
+    };
+
+    // Buffer bytes snapshot() needs for the current state
+    size_t snapshotSize() const {
+        return sp * sizeof(stack[0]) + rsp * sizeof(retStack[0]) + heapUsed;
+    }
+
+    // Records the state into s and buffer; false, leaving s untouched, when
+    // capacity is below snapshotSize(). The buffer must outlive s.
+    bool snapshot(Snapshot& s, uint8_t* buffer, size_t capacity) const {
+        if (capacity < snapshotSize()) return false;
+        memcpy(s.registers, registers, sizeof(registers));
+        s.flags = flags;
+        s.pc = pc; s.sp = sp; s.fp = fp; s.rsp = rsp; s.heapUsed = heapUsed;
+        s.heap_top = heap_top;
+        s.loop_arena_base = loop_arena_base;
+        s.running = running; s.faulted = faulted;
+        s.data = buffer;
+        memcpy(buffer, stack, sp * sizeof(stack[0]));
+        buffer += sp * sizeof(stack[0]);
+        memcpy(buffer, retStack, rsp * sizeof(retStack[0]));
+        buffer += rsp * sizeof(retStack[0]);
+        memcpy(buffer, heap, heapUsed);
+        return true;
+    }
+
+    // Puts the VM back in the snapshot's state. The program is not part of
+    // the snapshot: restore into a VM running the program it was taken on.
+    void restore(const Snapshot& s) {
+        const uint8_t* returns = s.data + s.sp * sizeof(stack[0]);
+        copyState(s, s.data, returns, returns + s.rsp * sizeof(retStack[0]));
+    }
+
+    // Turns child into a copy of this VM: same verified program (shared,
+    // not re-verified), same machine state. The child's trace cache starts
+    // empty and fills on its own.
+    void fork(BasicTinyVM& child) const {
+        child.program = program; child.programSize = programSize;
+        child.pager = pager;
+        child.constPool = constPool; child.constCount = constCount;
+        child.loop_start_pc = loop_start_pc;
+        memcpy(child.instrStart, instrStart, sizeof(instrStart));
+        memcpy(child.opTable, opTable, sizeof(opTable));
+        memcpy(child.fusionSites, fusionSites, sizeof(fusionSites));
+        child.flushTraceCache();
+        child.copyState(*this, stack, retStack, heap);
+    }
+
+    // Shared by restore() and fork(): State is a Snapshot or another VM for
+    // the scalars, and the live ranges are read from the other pointers
+    template <class State>
+    void copyState(const State& s, const void* liveStack, const void* liveReturns, const void* liveHeap) {
+        memcpy(registers, s.registers, sizeof(registers));
+        flags = s.flags;
+        pc = s.pc; sp = s.sp; fp = s.fp; rsp = s.rsp;
+        heap_top = s.heap_top;
+        loop_arena_base = s.loop_arena_base;
+        running = s.running; faulted = s.faulted;
+        memcpy(stack, liveStack, s.sp * sizeof(stack[0]));
+        memcpy(retStack, liveReturns, s.rsp * sizeof(retStack[0]));
+        memcpy(heap, liveHeap, s.heapUsed);
+        if (heapUsed > s.heapUsed) memset(heap + s.heapUsed, 0, heapUsed - s.heapUsed);
+        heapUsed = s.heapUsed;
     }
 
     void run() {
-        while (running) {
-            step();
-        }
+        execute();
     }
 
     // Execute one iteration of the user's loop function
     void runLoop() {
-        if (loop_start_pc == -1) return;
-        
+        if (!beginLoop()) return;
+        execute();
+    }
+
+    // --- Time-sliced execution ---
+    // runFor()/runUntil() execute part of the current program and return,
+    // leaving pc, sp, registers and flags in place so the next call resumes
+    // it. A superinstruction counts as one step.
+    enum RunStatus : uint8_t { RUN_YIELDED, RUN_HALTED, RUN_ERROR };
+
+    RunStatus status() const {
+        if (running) return RUN_YIELDED;
+        return faulted ? RUN_ERROR : RUN_HALTED;
+    }
+
+    RunStatus runFor(uint32_t maxSteps) {
+        if (running && hasProgram() && maxSteps > 0) execute<true>(maxSteps);
+        return status();
+    }
+
+    // deadline is a micros() timestamp; wraparound-safe
+    RunStatus runUntil(uint32_t deadline) {
+        while (running && (int32_t)(deadline - (uint32_t)micros()) > 0) {
+            runFor(VM_SLICE_STEPS);
+        }
+        return status();
+    }
+
+    // Starts one iteration of the user's loop function without running it,
+    // for firmware that drives it with runFor()/runUntil(). Each iteration
+    // gets empty stacks and the arena as it was when loop() first ran. A
+    // staged program (see stageProgram()) becomes current here.
+    bool beginLoop() {
+        if (stagedProgram != nullptr) swapStaged();
+        if (loop_start_pc == -1 || !hasProgram()) return false;
         pc = (uint16_t)loop_start_pc;
-        sp = 0; // Reset stack for new iteration
+        sp = 0; fp = 0; rsp = 0;
+        resetLoopArena();
         running = true;
-        
-        while (running) {
-            step();
-        }
+        faulted = false;
+        return true;
     }
 
     void dumpRegisters() {
@@ -632,8 +1776,70 @@ public:
         }
         Serial.println("-----------------");
     }
+
+#ifdef VM_AOT
+    // Runs compiled code on this VM's registers, stack and heap. Builtins
+    // go through call_trap exactly as the TRAP opcode does.
+    void runCompiled(void (*entry)(A3Context&)) {
+        A3Context c;
+        c.registers = registers;
+        c.stack = stack;
+        c.sp = &sp;
+        c.fp = &fp;
+        c.rsp = &rsp;
+        c.heap = heap;
+        c.heap_top = &heap_top;
+        c.stack_size = StackSize;
+        c.heap_size = HeapSize;
+        c.return_depth = ReturnDepth;
+        c.running = true;
+        c.cmp_lhs = flags.lhs; c.cmp_rhs = flags.rhs; c.compared = flags.valid;
+        c.user = this;
+        c.trap = aotTrap;
+        c.print = aotPrint;
+        c.fail = aotFail;
+        running = true;
+        faulted = false;
+        entry(c);
+        heapUsed = HeapSize;    // compiled stores are not tracked
+        if (c.compared) flags.set(c.cmp_lhs, c.cmp_rhs); else flags = Flags();
+        running = false;
+    }
+
+    void runAot() {
+        runCompiled(a3_main);
+    }
+
+    void runLoopAot() {
+        if (!a3_has_loop) return;
+        sp = 0; fp = 0; rsp = 0; // Reset stacks and arena for new iteration, as runLoop() does
+        resetLoopArena();
+        runCompiled(a3_loop);
+    }
+
+    static void aotTrap(void* user, uint8_t id) {
+        static_cast<BasicTinyVM*>(user)->call_trap(id);
+    }
+
+    static void aotPrint(void*, int32_t value) {
+        Serial.println(value);
+    }
+
+    static void aotFail(void* user, const char* message) {
+        Policy::error(message);
+        static_cast<BasicTinyVM*>(user)->faulted = true;
+    }
+#endif
 };
 
+// The VM the firmware and host tools use
+typedef BasicTinyVM<> TinyVM;
+
+// Text listing assembler shared with the host tools
+#include "vmcode_loader.h"
+// Function-level program uploads over Serial, shared with a3_upload
+#include "delta_update.h"
+
 TinyVM vm;
 
 #ifndef UNIT_TESTING
@@ -649,33 +1855,114 @@ bool initializeSD() {
     return true;
 }
 
-struct OpcodeMapping {
-    const char* name;
-    uint8_t opcode;
-};
+// Image of a program too large for programBuffer, run through codePager
+File codeImage;
+CodePager codePager;
+// Where the code starts in codeImage: 0 for VMIMAGE_FILE, past the header,
+// function table and constant pool for a paged A3B_FILE
+uint32_t codeImageBase = 0;
+// Where run() starts, from the container header (listings start at 0)
+uint16_t programEntry = 0;
+
+bool readCodeImage(void*, uint32_t offset, uint8_t* dst, uint16_t len) {
+    return codeImage.seek(codeImageBase + offset) && codeImage.read(dst, len) == len;
+}
 
-const OpcodeMapping opcodeMap[] = {
-    {"NOP", 0x00}, {"ADD", 0x01}, {"SUB", 0x02}, {"MUL", 0x03}, {"DIV", 0x04}, {"MOD", 0x05},
-    {"AND", 0x06}, {"OR", 0x07}, {"XOR", 0x08}, {"NOT", 0x09}, {"CMP", 0x0A},
-    {"SHL", 0x0B}, {"SHR", 0x0C}, {"LOAD", 0x10}, {"LOADI", 0x11}, {"LOADI16", 0x12}, {"STORE", 0x13},
-    {"LOAD_ADDR", 0x14}, {"PUSH", 0x15}, {"POP", 0x16}, {"PEEK", 0x17}, {"LOADM", 0x18},
-    {"JMP", 0x20}, {"JZ", 0x21}, {"JNZ", 0x22}, {"JLT", 0x23}, {"JGT", 0x24},
-    {"JLE", 0x25}, {"JGE", 0x26}, {"CALL", 0x27}, {"RET", 0x28}, {"HALT", 0x29},
-    {"PRINT", 0x30}, {"TRAP", 0x31}
-};
+// Appends one assembled byte. When programBuffer fills up, the bytes so
+// far move to VMIMAGE_FILE and the rest of the program follows them there.
+bool emitCode(uint8_t b) {
+    if (!codeImage) {
+        if (programSize < sizeof(programBuffer)) {
+            programBuffer[programSize++] = b;
+            return true;
+        }
+        Serial.println("Programa mayor que el búfer, paginando desde SD...");
+        SD.remove(VMIMAGE_FILE);
+        codeImage = SD.open(VMIMAGE_FILE, FILE_WRITE);
+        if (!codeImage) return false;
+        codeImage.write(programBuffer, programSize);
+    }
+    if (codeImage.write(b) != 1) return false;
+    programSize++;
+    return true;
+}
 
-const int OPCODE_COUNT = sizeof(opcodeMap) / sizeof(OpcodeMapping);
+// VmcodeLoader output. 16-bit branch targets cap a program at 64KB.
+bool emitListingByte(void*, uint32_t at, uint8_t b) {
+    return at <= 0xFFFF && emitCode(b);
+}
 
-uint8_t findOpcode(const char* name) {
-    for (int i = 0; i < OPCODE_COUNT; i++) {
-        if (strcmp(opcodeMap[i].name, name) == 0) {
-            return opcodeMap[i].opcode;
-        }
+// A3bStream input: the container is read front to back from a File
+int readImageChunk(void* user, uint8_t* dst, uint16_t len) {
+    return static_cast<File*>(user)->read(dst, len) == len;
+}
+
+// A3bStream output for the boot image, inflated or stored
+int emitImageByte(void*, uint32_t, uint8_t b) {
+    return emitCode(b);
+}
+
+// Loads A3B_FILE in one pass with no text parsing, checking its CRC on
+// the way. The code goes to programBuffer; when it does not fit, stored
+// code is paged from the container itself and compressed code is
+// inflated to VMIMAGE_FILE and paged from there.
+bool loadImageFromSD() {
+    File file = SD.open(A3B_FILE);
+    if (!file) return false;
+    Serial.println("--- CARGANDO CONTENEDOR A3B DESDE SD ---");
+
+    A3bStream stream;
+    const A3bHeader& h = stream.header;
+    const char* error = a3b_stream_begin(&stream, readImageChunk, &file);
+    bool inPlace = error == nullptr && h.packed_size == 0 && h.code_size > sizeof(programBuffer);
+    programSize = 0;
+    if (error == nullptr) {
+        bool table = h.function_count <= VM_MAX_FUNCTIONS;
+        error = a3b_stream_body(&stream, table ? functionBuffer : nullptr, constBuffer,
+                                inPlace ? nullptr : emitImageByte, nullptr);
+        functionCount = table ? h.function_count : 0;
+    }
+    file.close();
+    if (error != nullptr) {
+        if (codeImage) codeImage.close();
+        Serial.print("ADVERTENCIA: contenedor inválido (");
+        Serial.print(error);
+        Serial.println("), se usa el listado");
+        return false;
+    }
+
+    programSize = h.code_size;
+    programEntry = h.setup_entry;
+    constCount = h.const_count;
+    if (h.flags & A3B_FLAG_HAS_LOOP) vm.setLoopStart(h.loop_entry);
+    if (inPlace) {
+        codeImage = SD.open(A3B_FILE);
+        codeImageBase = a3b_code_offset(&h);
+    } else if (codeImage) {
+        codeImage.close();
+        codeImage = SD.open(VMIMAGE_FILE);
+        codeImageBase = 0;
     }
-    return 0xFF;
+    bool paged = inPlace || codeImage;
+    if (paged) {
+        if (!codeImage) return false;
+        codePager.begin(readCodeImage, nullptr, programSize);
+    }
+    Serial.print("Contenedor cargado: ");
+    Serial.print(programSize);
+    if (h.packed_size != 0) {
+        Serial.print(" bytes de código (");
+        Serial.print((int)h.packed_size);
+        Serial.print(" comprimidos)");
+    } else {
+        Serial.print(" bytes de código");
+    }
+    Serial.println(paged ? " (paginado)" : "");
+    return true;
 }
 
-bool loadProgramFromSD() {
+// Assembles the VMCODE_FILE listing
+bool loadListingFromSD() {
     Serial.println("--- CARGANDO PROGRAMA DESDE SD ---");
     
     File file = SD.open(VMCODE_FILE);
@@ -688,63 +1975,210 @@ bool loadProgramFromSD() {
     Serial.println("Archivo encontrado, parseando instrucciones...");
     
     programSize = 0;
-    char line[128];
-    int lineNum = 0;
-    
-    while (file.available() && programSize < sizeof(programBuffer) - 3) {
-        int pos = 0;
-        while (file.available() && pos < sizeof(line) - 1) {
-            char c = file.read();
-            if (c == '\n' || c == '\r') break;
-            line[pos++] = c;
-        }
-        line[pos] = '\0';
-        lineNum++;
-        
-        // Check for loop label marker (supports "# .loop" or "# FUNCTION loop")
-        if (strstr(line, "# .loop") != NULL || strstr(line, "# FUNCTION loop") != NULL) {
-            vm.setLoopStart(programSize);
-            continue;
-        }
-
-        if (pos == 0 || line[0] == '#') continue;
-        
-        char opcode_str[16];
-        int arg1, arg2;
-        
-        if (sscanf(line, "%s %d %d", opcode_str, &arg1, &arg2) == 3) {
-            uint8_t opcode = findOpcode(opcode_str);
-            if (opcode != 0xFF) {
-                programBuffer[programSize++] = opcode;
-                programBuffer[programSize++] = (uint8_t)arg1;
-                programBuffer[programSize++] = (uint8_t)arg2;
-            } else {
-                Serial.print("ADVERTENCIA: Opcode desconocido en línea ");
-                Serial.print(lineNum);
-                Serial.print(": ");
-                Serial.println(opcode_str);
-            }
-        }
+    // One SD sector per read; lines may straddle blocks
+    VmcodeLoader listing;
+    listing.begin(emitListingByte, nullptr, constBuffer);
+    uint8_t block[512];
+    int got;
+    while ((got = file.read(block, sizeof(block))) > 0 &&
+           listing.feed((const char*)block, got)) {
     }
-    
+    listing.finish();
     file.close();
+
+    if (listing.error != nullptr) {
+        Serial.print("ERROR en línea ");
+        Serial.print((int)listing.line);
+        Serial.print(": ");
+        Serial.println(listing.error);
+        if (codeImage) codeImage.close();
+        return false;
+    }
+    constCount = listing.constCount;
+    if (listing.loopEntry != VMCODE_NO_ENTRY) vm.setLoopStart(listing.loopEntry);
+    if (codeImage) {
+        // Reopen the image for reading; pages are read on demand from now on
+        codeImage.close();
+        codeImage = SD.open(VMIMAGE_FILE);
+        if (!codeImage) return false;
+        codePager.begin(readCodeImage, nullptr, programSize);
+    }
     
     Serial.print("Programa cargado: ");
     Serial.print(programSize);
-    Serial.println(" bytes");
+    Serial.println(codeImage ? " bytes (paginado)" : " bytes");
     
     return programSize > 0;
 }
 
+// Loads the container, or the listing when there is none, and reports how
+// long it took
+bool loadProgramFromSD() {
+    unsigned long start = millis();
+    if (!loadImageFromSD() && !loadListingFromSD()) return false;
+    Serial.print("Tiempo de carga: ");
+    Serial.print(millis() - start);
+    Serial.println(" ms");
+    return true;
+}
+
+// An update staged by pollProgramUpdate() that runLoop() has not swapped in
+bool updateStaged = false;
+// The same for an upload over Serial
+bool uploadStaged = false;
+DeltaReceiver serialUpload;
+
+// Looks for UPDATE_FILE every VM_UPDATE_POLL_MS. A valid update is read
+// into the code/pool pair the VM is not running from and staged, so the
+// current program keeps running until the next loop boundary. Once it has
+// been swapped in, it replaces A3B_FILE for the next boot.
+void pollProgramUpdate() {
+    // A Serial upload owns the spare buffers from BEGIN to COMMIT
+    if (uploadStaged || serialUpload.busy()) return;
+    if (updateStaged) {
+        if (vm.swapPending()) return;
+        updateStaged = false;
+        // The previous program may have been paged from A3B_FILE
+        if (codeImage) codeImage.close();
+        SD.remove(A3B_FILE);
+        SD.rename(UPDATE_FILE, A3B_FILE);
+        Serial.println("--- PROGRAMA ACTUALIZADO ---");
+        return;
+    }
+    static unsigned long lastPoll = 0;
+    if (millis() - lastPoll < VM_UPDATE_POLL_MS) return;
+    lastPoll = millis();
+    if (!SD.exists(UPDATE_FILE)) return;
+    File file = SD.open(UPDATE_FILE);
+    if (!file) return;
+    Serial.println("--- ACTUALIZACIÓN DETECTADA ---");
+
+    bool spare = vm.program != spareProgramBuffer;
+    uint8_t* code = spare ? spareProgramBuffer : programBuffer;
+    uint8_t* pool = spare ? spareConstBuffer : constBuffer;
+    uint8_t* functions = spare ? spareFunctionBuffer : functionBuffer;
+    uint16_t& count = spare ? spareFunctionCount : functionCount;
+    A3bStream stream;
+    const A3bHeader& h = stream.header;
+    A3bBuffer out = { code, VM_MAX_PROGRAM_SIZE };
+    const char* error = a3b_stream_begin(&stream, readImageChunk, &file);
+    bool table = error == nullptr && h.function_count <= VM_MAX_FUNCTIONS;
+    if (error == nullptr && h.code_size > VM_MAX_PROGRAM_SIZE) error = "too large for a hot swap";
+    if (error == nullptr) error = a3b_stream_body(&stream, table ? functions : nullptr, pool, a3b_emit_to_buffer, &out);
+    file.close();
+    if (error == nullptr && !(h.flags & A3B_FLAG_HAS_LOOP)) error = "no loop function";
+    if (error == nullptr &&
+        !vm.stageProgram(code, h.code_size, h.loop_entry, VM_HOT_SWAP_KEEP_REGISTERS,
+                         pool, h.const_count, h.setup_entry)) {
+        error = "rejected by verifier";
+    }
+    if (error != nullptr) {
+        Serial.print("ADVERTENCIA: actualización descartada (");
+        Serial.print(error);
+        Serial.println(")");
+        SD.remove(UPDATE_FILE);
+        return;
+    }
+    count = table ? h.function_count : 0;
+    updateStaged = true;
+    Serial.println("Actualización preparada para la próxima iteración de loop()");
+}
+
+void replySerial(void*, const char* line) {
+    Serial.println(line);
+}
+
+// Stages a committed upload from the pair the VM is not running from
+const char* commitUpload(void*, const A3bHeader& h) {
+    bool spare = vm.program != spareProgramBuffer;
+    int loopStart = (h.flags & A3B_FLAG_HAS_LOOP) ? (int)h.loop_entry : -1;
+    if (!vm.stageProgram(spare ? spareProgramBuffer : programBuffer, h.code_size, loopStart,
+                         VM_HOT_SWAP_KEEP_REGISTERS, spare ? spareConstBuffer : constBuffer,
+                         h.const_count, h.setup_entry)) {
+        return "rejected by verifier";
+    }
+    (spare ? spareFunctionCount : functionCount) = h.function_count;
+    uploadStaged = true;
+    return nullptr;
+}
+
+bool writeWithCrc(File& file, const uint8_t* data, uint32_t n, uint32_t& crc) {
+    crc = a3b_crc32_update(crc, data, n);
+    return file.write(data, n) == n;
+}
+
+// Saves the program a Serial upload swapped in as A3B_FILE, so the next
+// boot runs it too
+void saveUpload() {
+    const A3bHeader& h = serialUpload.header;
+    bool spare = vm.program == spareProgramBuffer;
+    uint8_t head[A3B_HEADER_SIZE];
+    uint8_t pad[4] = { 0, 0, 0, 0 };
+    uint8_t tail[4];
+    uint32_t crc = A3B_CRC_INIT;
+    a3b_write_header(head, &h);
+    SD.remove(DELTA_FILE);
+    File file = SD.open(DELTA_FILE, FILE_WRITE);
+    bool ok = file &&
+        writeWithCrc(file, head, sizeof(head), crc) &&
+        writeWithCrc(file, spare ? spareFunctionBuffer : functionBuffer,
+                     (uint32_t)h.function_count * A3B_FUNCTION_SIZE, crc) &&
+        writeWithCrc(file, spare ? spareConstBuffer : constBuffer, (uint32_t)h.const_count * 4, crc) &&
+        writeWithCrc(file, vm.program, h.code_size, crc) &&
+        writeWithCrc(file, pad, (4 - h.code_size % 4) % 4, crc);
+    a3b_put32(tail, a3b_crc32_final(crc));
+    ok = ok && file.write(tail, 4) == 4;
+    if (file) file.close();
+    if (ok) {
+        // The previous program may have been paged from A3B_FILE
+        if (codeImage) codeImage.close();
+        SD.remove(A3B_FILE);
+        ok = SD.rename(DELTA_FILE, A3B_FILE);
+    }
+    Serial.println(ok ? "--- PROGRAMA ACTUALIZADO POR SERIE ---"
+                      : "ADVERTENCIA: no se pudo guardar el programa en la SD");
+}
+
+// Feeds Serial input to the upload receiver, which answers every command
+// before a3_upload sends the next. Nothing is read while an upload or an
+// UPDATE_FILE waits for its swap, so the uploader waits too.
+void pollSerialUpload() {
+    if (uploadStaged) {
+        if (vm.swapPending()) return;
+        uploadStaged = false;
+        saveUpload();
+        return;
+    }
+    if (updateStaged) return;
+    bool spare = vm.program != spareProgramBuffer;
+    DeltaProgram running = { vm.program, (uint32_t)vm.programSize,
+                             spare ? functionBuffer : spareFunctionBuffer,
+                             spare ? functionCount : spareFunctionCount };
+    // Both only take effect between uploads (see DeltaReceiver::busy())
+    serialUpload.setCurrent(running);
+    serialUpload.setTarget(spare ? spareProgramBuffer : programBuffer, VM_MAX_PROGRAM_SIZE,
+                           spare ? spareFunctionBuffer : functionBuffer, VM_MAX_FUNCTIONS,
+                           spare ? spareConstBuffer : constBuffer);
+    char chunk[64];
+    int n;
+    while (!uploadStaged && (n = Serial.available()) > 0) {
+        n = Serial.readBytes(chunk, n < (int)sizeof(chunk) ? n : (int)sizeof(chunk));
+        serialUpload.feed(chunk, n);
+    }
+}
+
 #endif
 
 // =========================
 // === ARDUINO SETUP/LOOP ===
 // =========================
 
+#ifndef UNIT_TESTING
+
 void setup() {
     Serial.begin(115200);
     while(!Serial) delay(10);
+    serialUpload.begin(replySerial, commitUpload, nullptr);
     
     Serial.println("==============================================");
     Serial.println("    TeoCompis VM - Cargador desde SD");
@@ -752,6 +2186,14 @@ void setup() {
 
     initSensors();
 
+#ifdef VM_AOT
+    Serial.println("--- INICIANDO PROGRAMA COMPILADO (SETUP) ---");
+    vm.runAot();
+    Serial.println("--- SETUP COMPLETADO ---");
+    vm.dumpRegisters();
+    return;
+#endif
+
     if (!initializeSD()) {
         Serial.println("ERROR CRÍTICO: No se puede inicializar SD");
         Serial.println("Sistema detenido.");
@@ -765,7 +2207,13 @@ void setup() {
     }
     
     Serial.println("--- INICIANDO EJECUCIÓN (SETUP) ---");
-    vm.loadProgram(programBuffer, programSize);
+    vm.setConstPool(constBuffer, constCount);
+    bool loaded = codeImage ? vm.loadPaged(codePager) : vm.loadProgram(programBuffer, programSize);
+    if (!loaded || !vm.setEntry(programEntry)) {
+        Serial.println("ERROR CRÍTICO: El programa no pasó la verificación");
+        Serial.println("Sistema detenido.");
+        return;
+    }
     
     // Run setup code (everything before the loop or until HALT)
     // If loop_start_pc is set, we might want to stop before it?
@@ -775,13 +2223,21 @@ void setup() {
     
     Serial.println("--- SETUP COMPLETADO ---");
     vm.dumpRegisters();
+    vm.dumpPagerStats();
 }
 
 void loop() {
     // Run the user's loop function if defined
+#ifdef VM_AOT
+    vm.runLoopAot();
+#else
     vm.runLoop();
+    pollProgramUpdate();
+    pollSerialUpload();
+#endif
     
     // Optional: small delay to prevent CPU hogging if loop is empty
     // delay(1); 
 }
 
+#endif
@@ -0,0 +1,216 @@
+// Opcode bodies shared by TinyVM::step() and TinyVM::execute(). This file is
+// included inside both dispatch loops, once per loop, so it has no include
+// guard. The including function provides:
+//
+//   VM_OP(name)        entry of an opcode: a case label or a goto target
+//   VM_NEXT()          leave the handler and go on with the next instruction
+//   VM_NEXT_BLOCK()    VM_NEXT() after a control transfer (jumps, CALL, RET,
+//                      Bcc), where the trace cache moves to the next block
+//   VM_FAIL(message)   report a runtime error and jump to `fault`
+//   VM_CHECKS          whether VM_CHECK and the heap range checks are made
+//   VM_CHECK(c, msg)   VM_FAIL(msg) when c holds and VM_CHECKS is set
+//   VM_TARGET()        16-bit address in arg1/arg2
+//   VM_WORD()          trailing word of a wide instruction (LOADI16, Bcc)
+//
+// plus R (the registers), op/arg1/arg2, ip (just past the 3-byte head) and
+// a `stop` label for HALT and the final RET. Operands, jump targets and
+// trailing words are already in range: execute() runs verified programs and
+// step() checks each instruction before dispatching it.
+
+            VM_OP(NOP)
+                VM_NEXT();
+            VM_OP(ADD)
+                R[0] = R[arg1] + R[arg2];
+                VM_NEXT();
+            VM_OP(SUB)
+                R[0] = R[arg1] - R[arg2];
+                VM_NEXT();
+            VM_OP(MUL)
+                R[0] = R[arg1] * R[arg2];
+                VM_NEXT();
+            VM_OP(DIV)
+                R[0] = R[arg2] != 0 ? R[arg1] / R[arg2] : 0;
+                VM_NEXT();
+            VM_OP(MOD)
+                R[0] = R[arg2] != 0 ? R[arg1] % R[arg2] : 0;
+                VM_NEXT();
+            VM_OP(AND)
+                R[0] = R[arg1] & R[arg2];
+                VM_NEXT();
+            VM_OP(OR)
+                R[0] = R[arg1] | R[arg2];
+                VM_NEXT();
+            VM_OP(XOR)
+                R[0] = R[arg1] ^ R[arg2];
+                VM_NEXT();
+            VM_OP(NOT)
+                R[0] = ~R[arg1];
+                VM_NEXT();
+            VM_OP(ADD3)
+                R[arg1] = R[SRC_A(arg2)] + R[SRC_B(arg2)];
+                VM_NEXT();
+            VM_OP(SUB3)
+                R[arg1] = R[SRC_A(arg2)] - R[SRC_B(arg2)];
+                VM_NEXT();
+            VM_OP(MUL3)
+                R[arg1] = R[SRC_A(arg2)] * R[SRC_B(arg2)];
+                VM_NEXT();
+            VM_OP(DIV3)
+                R[arg1] = R[SRC_B(arg2)] != 0 ? R[SRC_A(arg2)] / R[SRC_B(arg2)] : 0;
+                VM_NEXT();
+            VM_OP(MOD3)
+                R[arg1] = R[SRC_B(arg2)] != 0 ? R[SRC_A(arg2)] % R[SRC_B(arg2)] : 0;
+                VM_NEXT();
+            VM_OP(AND3)
+                R[arg1] = R[SRC_A(arg2)] & R[SRC_B(arg2)];
+                VM_NEXT();
+            VM_OP(OR3)
+                R[arg1] = R[SRC_A(arg2)] | R[SRC_B(arg2)];
+                VM_NEXT();
+            VM_OP(XOR3)
+                R[arg1] = R[SRC_A(arg2)] ^ R[SRC_B(arg2)];
+                VM_NEXT();
+            VM_OP(NOT3)
+                R[arg1] = ~R[SRC_A(arg2)];
+                VM_NEXT();
+            VM_OP(CMP)
+                flags.set(R[arg1], R[arg2]);
+                VM_NEXT();
+            VM_OP(SHL)
+                R[0] = R[arg1] << (arg2 & 31);
+                VM_NEXT();
+            VM_OP(SHR)
+                R[0] = R[arg1] >> (arg2 & 31);
+                VM_NEXT();
+            VM_OP(LOAD)
+                R[arg1] = R[arg2];
+                VM_NEXT();
+            VM_OP(LOADI)
+                R[arg1] = (int32_t)arg2;
+                VM_NEXT();
+            VM_OP(LOADK)
+                R[arg1] = loadConst(arg2);
+                VM_NEXT();
+            VM_OP(LOADI16)
+                R[arg1] = (int32_t)(uint16_t)VM_WORD();
+                ip += 2;
+                VM_NEXT();
+            VM_OP(STORE) {
+                int idx = R[arg1];
+                if (!VM_CHECKS || (idx >= 0 && idx < (int)HeapSize)) storeByte(idx, R[arg2]);
+                VM_NEXT();
+            }
+            VM_OP(LOAD_ADDR)
+                R[arg1] = (int32_t)(heap_top + arg2);
+                VM_NEXT();
+            VM_OP(PUSH)
+                VM_CHECK(sp >= StackSize, "Error: Stack Overflow");
+                stack[sp++] = R[arg1];
+                VM_NEXT();
+            VM_OP(POP)
+                VM_CHECK(sp == 0, "Error: Stack Underflow");
+                R[arg1] = stack[--sp];
+                VM_NEXT();
+            VM_OP(PEEK) {
+                uint16_t idx = sp + arg2;
+                VM_CHECK(idx >= StackSize, "Error: PEEK out of bounds");
+                R[arg1] = stack[idx];
+                VM_NEXT();
+            }
+            VM_OP(LOADM) {
+                int idx = R[arg2];
+                VM_CHECK(idx < 0 || idx >= (int)HeapSize, "Error: LOADM out of bounds");
+                R[arg1] = heap[idx];
+                VM_NEXT();
+            }
+            VM_OP(LOADX) {
+                uint32_t idx = (uint32_t)(R[SRC_A(arg2)] + R[SRC_B(arg2)]);
+                VM_CHECK(idx >= kHeapWords, "Error: LOADX out of bounds");
+                R[arg1] = loadWord(idx);
+                VM_NEXT();
+            }
+            VM_OP(STOREX) {
+                uint32_t idx = (uint32_t)(R[SRC_A(arg2)] + R[SRC_B(arg2)]);
+                VM_CHECK(idx >= kHeapWords, "Error: STOREX out of bounds");
+                storeWord(idx, R[arg1]);
+                VM_NEXT();
+            }
+            VM_OP(JMP)
+                ip = VM_TARGET();
+                VM_NEXT_BLOCK();
+            VM_OP(JZ)
+                if (flags.zero()) ip = VM_TARGET();
+                VM_NEXT_BLOCK();
+            VM_OP(JNZ)
+                if (!flags.zero()) ip = VM_TARGET();
+                VM_NEXT_BLOCK();
+            VM_OP(JLT)
+                if (flags.lt()) ip = VM_TARGET();
+                VM_NEXT_BLOCK();
+            VM_OP(JGT)
+                if (flags.gt()) ip = VM_TARGET();
+                VM_NEXT_BLOCK();
+            VM_OP(JLE)
+                if (flags.le()) ip = VM_TARGET();
+                VM_NEXT_BLOCK();
+            VM_OP(JGE)
+                if (flags.ge()) ip = VM_TARGET();
+                VM_NEXT_BLOCK();
+            VM_OP(CALL)
+                VM_CHECK(rsp >= ReturnDepth, "Error: Return stack overflow");
+                retStack[rsp++] = ip;
+                ip = VM_TARGET();
+                VM_NEXT_BLOCK();
+            VM_OP(RET)
+                // An empty return stack means we returned from the loop function
+                if (rsp == 0) goto stop;
+                ip = retStack[--rsp];
+                VM_NEXT_BLOCK();
+            VM_OP(BEQ)
+                ip = R[arg1] == R[arg2] ? VM_WORD() : ip + 2;
+                VM_NEXT_BLOCK();
+            VM_OP(BNE)
+                ip = R[arg1] != R[arg2] ? VM_WORD() : ip + 2;
+                VM_NEXT_BLOCK();
+            VM_OP(BLT)
+                ip = R[arg1] < R[arg2] ? VM_WORD() : ip + 2;
+                VM_NEXT_BLOCK();
+            VM_OP(BGE)
+                ip = R[arg1] >= R[arg2] ? VM_WORD() : ip + 2;
+                VM_NEXT_BLOCK();
+            VM_OP(HALT)
+                Policy::message("HALT encountered.");
+                goto stop;
+            VM_OP(PRINT)
+                Serial.println(R[arg1]);
+                VM_NEXT();
+            VM_OP(TRAP)
+                call_trap(arg1);
+                VM_NEXT();
+            VM_OP(ALLOC) {
+                int32_t base = allocWords(arg2);
+                if (base < 0) VM_FAIL("Error: Heap exhausted");
+                R[arg1] = base;
+                VM_NEXT();
+            }
+            VM_OP(FREE)
+                if (!freeWords(R[arg1])) VM_FAIL("Error: FREE of unallocated block");
+                VM_NEXT();
+            VM_OP(ENTER)
+                if (!enterFrame(arg2)) VM_FAIL("Error: Stack overflow on ENTER");
+                VM_NEXT();
+            VM_OP(LEAVE)
+                if (!leaveFrame()) VM_FAIL("Error: LEAVE without a frame");
+                VM_NEXT();
+            VM_OP(LDL) {
+                uint32_t idx = (uint32_t)fp + arg2;
+                VM_CHECK(idx >= sp, "Error: local outside the frame");
+                R[arg1] = stack[idx];
+                VM_NEXT();
+            }
+            VM_OP(STL) {
+                uint32_t idx = (uint32_t)fp + arg2;
+                VM_CHECK(idx >= sp, "Error: local outside the frame");
+                stack[idx] = R[arg1];
+                VM_NEXT();
+            }
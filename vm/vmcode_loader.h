@@ -0,0 +1,212 @@
+#pragma once
+
+// Single-pass assembler for .vmcode text listings, shared by the SD loader
+// in vm_complete.ino and the host tools. vm_complete.ino includes it after
+// TinyVM, whose mnemonics and instruction widths it uses. It never
+// allocates: the caller owns the output, the constant pool and the
+// function table.
+//
+// The text can arrive as one span (a mapped file) or in chunks of any size
+// (SD blocks). A line is read up to VMCODE_LINE_MAX characters, '\r' is
+// ignored, and the rules are:
+//
+//   # FUNCTION <name>         function entry at the current offset;
+//                             "loop" (or the older "# .loop") sets loopEntry
+//   # CONST <index> <value>   constant pool entry for LOADK
+//   # anything else           comment
+//   <mnemonic> <a1> <a2> [w]  instruction; w is the trailing 16-bit word
+//                             that wide instructions require
+//
+// Blank lines are skipped. Anything else is an error, reported with its
+// line number, and stops the load.
+
+#include "a3b.h"
+
+#define VMCODE_LINE_MAX 128
+#define VMCODE_NO_ENTRY 0xFFFFFFFFu
+
+struct VmcodeFunction {
+    char name[A3B_NAME_SIZE + 1];   // truncated like the .a3b function table
+    uint32_t start;
+};
+
+struct VmcodeLoader {
+    // Stores byte b at offset at of the program; false stops the load
+    typedef bool (*EmitFn)(void* user, uint32_t at, uint8_t b);
+
+    uint32_t size = 0;                  // bytes assembled so far
+    uint32_t loopEntry = VMCODE_NO_ENTRY;
+    uint16_t constCount = 0;
+    uint16_t functionCount = 0;         // may exceed the table's capacity
+    uint32_t line = 0;                  // lines seen; where error happened
+    const char* error = nullptr;
+
+    // constants (A3B_MAX_CONSTS * 4 bytes, little-endian int32s) and
+    // functions are optional; without them the entries are only counted
+    void begin(EmitFn emitFn, void* emitUser, uint8_t* constants = nullptr,
+               VmcodeFunction* functions = nullptr, uint16_t functionCapacity = 0) {
+        *this = VmcodeLoader();
+        emit = emitFn;
+        user = emitUser;
+        pool = constants;
+        table = functions;
+        capacity = functionCapacity;
+    }
+
+    // Feeds the next chunk of text. Lines may straddle chunks.
+    bool feed(const char* text, size_t len) {
+        const char* end = text + len;
+        while (text < end && error == nullptr) {
+            const char* nl = static_cast<const char*>(memchr(text, '\n', end - text));
+            const char* stop = nl != nullptr ? nl : end;
+            if (pending == 0 && nl != nullptr) {
+                // Whole line inside the chunk: parse it in place
+                parseLine(text, stop - text);
+            } else {
+                size_t n = stop - text;
+                if (n > VMCODE_LINE_MAX - pending) n = VMCODE_LINE_MAX - pending;
+                memcpy(partial + pending, text, n);
+                pending += n;
+                if (nl != nullptr) {
+                    parseLine(partial, pending);
+                    pending = 0;
+                }
+            }
+            text = nl != nullptr ? nl + 1 : end;
+        }
+        return error == nullptr;
+    }
+
+    // Parses a last line without a newline. Returns false if the listing
+    // had an error.
+    bool finish() {
+        if (pending > 0 && error == nullptr) parseLine(partial, pending);
+        pending = 0;
+        return error == nullptr;
+    }
+
+    // Convenience for a listing held in memory
+    bool load(const char* text, size_t len) {
+        return feed(text, len) && finish();
+    }
+
+private:
+    EmitFn emit = nullptr;
+    void* user = nullptr;
+    uint8_t* pool = nullptr;
+    VmcodeFunction* table = nullptr;
+    uint16_t capacity = 0;
+    char partial[VMCODE_LINE_MAX];
+    size_t pending = 0;     // start of a line continued by the next chunk
+
+    bool fail(const char* message) {
+        error = message;
+        return false;
+    }
+
+    static bool isBlank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+    static const char* skipBlanks(const char* p, const char* end) {
+        while (p < end && isBlank(*p)) p++;
+        return p;
+    }
+
+    // Reads a decimal integer of up to 32 bits; strtol would need a
+    // terminated string
+    static bool parseNumber(const char*& p, const char* end, int64_t& value) {
+        p = skipBlanks(p, end);
+        bool negative = p < end && *p == '-';
+        const char* q = negative ? p + 1 : p;
+        const char* digits = q;
+        uint32_t v = 0;
+        for (; q < end && *q >= '0' && *q <= '9'; q++) {
+            uint32_t d = (uint32_t)(*q - '0');
+            if (v > (0xFFFFFFFFu - d) / 10) return false;
+            v = v * 10 + d;
+        }
+        if (q == digits || (q < end && !isBlank(*q))) return false;
+        p = q;
+        value = negative ? -(int64_t)v : (int64_t)v;
+        return true;
+    }
+
+    // Matches a word at p followed by a blank or the end of the line
+    static bool word(const char*& p, const char* end, const char* w) {
+        size_t n = strlen(w);
+        if ((size_t)(end - p) < n || memcmp(p, w, n) != 0) return false;
+        if (p + n < end && !isBlank(p[n])) return false;
+        p = skipBlanks(p + n, end);
+        return true;
+    }
+
+    bool put(uint8_t b) {
+        return emit(user, size++, b) || fail("program too large");
+    }
+
+    void parseLine(const char* p, size_t len) {
+        if (len > VMCODE_LINE_MAX) len = VMCODE_LINE_MAX;
+        const char* end = p + len;
+        line++;
+        p = skipBlanks(p, end);
+        while (end > p && isBlank(end[-1])) end--;
+        if (p == end) return;
+        if (*p == '#') {
+            parseComment(skipBlanks(p + 1, end), end);
+            return;
+        }
+
+        const char* mnemonic = p;
+        while (p < end && !isBlank(*p)) p++;
+        uint8_t op = opcodeForMnemonic(mnemonic, p - mnemonic);
+        if (op == 0xFF) {
+            fail("unknown mnemonic");
+            return;
+        }
+        int64_t arg1, arg2, w = 0;
+        if (!parseNumber(p, end, arg1) || !parseNumber(p, end, arg2)) {
+            fail("expected two operands");
+            return;
+        }
+        bool wide = TinyVM::isWideOpcode(op);
+        if (wide && !parseNumber(p, end, w)) {
+            fail("missing 16-bit word");
+            return;
+        }
+        if (skipBlanks(p, end) != end) {
+            fail("unexpected text after the operands");
+            return;
+        }
+        if (!put(op) || !put((uint8_t)arg1) || !put((uint8_t)arg2) || !wide) return;
+        if (put((uint8_t)w)) put((uint8_t)(w >> 8));
+    }
+
+    void parseComment(const char* p, const char* end) {
+        if (word(p, end, ".loop") && p == end) {
+            loopEntry = size;
+        } else if (word(p, end, "FUNCTION") && p < end) {
+            size_t n = end - p;
+            if (n == 4 && memcmp(p, "loop", 4) == 0) loopEntry = size;
+            if (functionCount < capacity) {
+                VmcodeFunction& f = table[functionCount];
+                if (n > A3B_NAME_SIZE) n = A3B_NAME_SIZE;
+                memcpy(f.name, p, n);
+                f.name[n] = '\0';
+                f.start = size;
+            }
+            functionCount++;
+        } else if (word(p, end, "CONST")) {
+            int64_t index, value;
+            if (!parseNumber(p, end, index) || !parseNumber(p, end, value) || p != end) {
+                fail("malformed constant");
+            } else if (index < 0 || index >= A3B_MAX_CONSTS) {
+                fail("constant index out of range");
+            } else {
+                // Entries normally come in order; zero any that were skipped
+                for (; constCount <= index; constCount++) {
+                    if (pool != nullptr) a3b_put32(pool + constCount * 4, 0);
+                }
+                if (pool != nullptr) a3b_put32(pool + index * 4, (uint32_t)value);
+            }
+        }
+    }
+};